@@ -39,10 +39,17 @@
             'product_dir': '<(module_path)',
             'sources': [
                 "./src/cpp_util.cpp",
+                "./src/block_codec.cpp",
                 "./src/node_util.cpp",
+                "./src/grid_dump.cpp",
+                "./src/frozen_index.cpp",
                 "./src/memorycache.cpp",
+                "./src/decoded_cache.cpp",
                 "./src/rocksdbcache.cpp",
+                "./src/mmapcache.cpp",
+                "./src/task_pool.cpp",
                 "./src/coalesce.cpp",
+                "./src/worker_pool.cpp",
                 "./src/binding.cpp"
             ],
             "include_dirs" : [
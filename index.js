@@ -6,3 +6,70 @@ exports.PREFIX_SCAN = {
     enabled: 1,
     word_boundary: 2
 };
+
+/**
+ * Reads the Buffer coalesce and coalesceBatch call back with when
+ * options.packed is set. Every cover field is one typed array, indexed by
+ * cover, with each context's covers at contextOffsets[i] to
+ * contextOffsets[i + 1]; context(i) builds the same array of cover objects
+ * the unpacked mode would have, for code that wants one.
+ *
+ * @param {Buffer} buffer - the packed result
+ */
+class PackedCoalesceResult {
+    constructor(buffer) {
+        // typed arrays need their elements aligned
+        if (buffer.byteOffset % 8 !== 0) buffer = Buffer.from(buffer);
+        const ab = buffer.buffer;
+        let offset = buffer.byteOffset;
+        const counts = new Uint32Array(ab, offset, 2);
+        const contexts = counts[0];
+        const covers = counts[1];
+        offset += 8;
+
+        const take = (Type, length) => {
+            const array = new Type(ab, offset, length);
+            offset += Math.ceil(length * Type.BYTES_PER_ELEMENT / 8) * 8;
+            return array;
+        };
+        this.contextRelev = take(Float64Array, contexts);
+        this.contextOffsets = take(Uint32Array, contexts + 1);
+        this.relev = take(Float64Array, covers);
+        this.distance = take(Float64Array, covers);
+        this.scoredist = take(Float64Array, covers);
+        this.id = take(Uint32Array, covers);
+        this.tmpid = take(Uint32Array, covers);
+        this.x = take(Uint16Array, covers);
+        this.y = take(Uint16Array, covers);
+        this.score = take(Uint16Array, covers);
+        this.idx = take(Uint16Array, covers);
+        this.matchesLanguage = take(Uint8Array, covers);
+    }
+
+    // the number of contexts
+    get length() {
+        return this.contextRelev.length;
+    }
+
+    context(i) {
+        const out = [];
+        for (let j = this.contextOffsets[i]; j < this.contextOffsets[i + 1]; j++) {
+            out.push({
+                x: this.x[j],
+                y: this.y[j],
+                relev: this.relev[j],
+                score: this.score[j],
+                id: this.id[j],
+                idx: this.idx[j],
+                tmpid: this.tmpid[j],
+                distance: this.distance[j],
+                scoredist: this.scoredist[j],
+                matches_language: this.matchesLanguage[j] === 1
+            });
+        }
+        out.relev = this.contextRelev[i];
+        return out;
+    }
+}
+
+exports.PackedCoalesceResult = PackedCoalesceResult;
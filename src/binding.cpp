@@ -4,6 +4,10 @@ namespace carmen {
 
 using namespace v8;
 
+// the error coalesce jobs, and the cache lookups queued with them, fail with
+// when the worker pool's queue is full
+constexpr const char* COALESCE_QUEUE_FULL = "coalesce queue is full";
+
 template <>
 void JSCache<RocksDBCache>::Initialize(Handle<Object> target) {
     Nan::HandleScope scope;
@@ -11,9 +15,14 @@ void JSCache<RocksDBCache>::Initialize(Handle<Object> target) {
     t->InstanceTemplate()->SetInternalFieldCount(1);
     t->SetClassName(Nan::New("RocksDBCache").ToLocalChecked());
     Nan::SetPrototypeMethod(t, "pack", JSRocksDBCache::pack);
+    Nan::SetPrototypeMethod(t, "packMmap", JSRocksDBCache::packMmap);
     Nan::SetPrototypeMethod(t, "list", JSRocksDBCache::list);
     Nan::SetPrototypeMethod(t, "_get", _get);
     Nan::SetPrototypeMethod(t, "_getMatching", _getmatching);
+    Nan::SetPrototypeMethod(t, "_getGrids", _getGrids);
+    Nan::SetPrototypeMethod(t, "_getMatchingGrids", _getmatchingGrids);
+    Nan::SetPrototypeMethod(t, "getMatchingMany", getMatchingMany);
+    Nan::SetPrototypeMethod(t, "decodedCacheStats", decodedCacheStats);
     target->Set(Nan::New("RocksDBCache").ToLocalChecked(), t->GetFunction());
     constructor.Reset(t);
 }
@@ -25,19 +34,72 @@ void JSCache<MemoryCache>::Initialize(Handle<Object> target) {
     t->InstanceTemplate()->SetInternalFieldCount(1);
     t->SetClassName(Nan::New("MemoryCache").ToLocalChecked());
     Nan::SetPrototypeMethod(t, "pack", JSMemoryCache::pack);
+    Nan::SetPrototypeMethod(t, "packMmap", JSMemoryCache::packMmap);
     Nan::SetPrototypeMethod(t, "list", JSMemoryCache::list);
     Nan::SetPrototypeMethod(t, "_set", _set);
+    Nan::SetPrototypeMethod(t, "loadFile", loadFile);
+    Nan::SetPrototypeMethod(t, "freeze", freeze);
     Nan::SetPrototypeMethod(t, "_get", _get);
     Nan::SetPrototypeMethod(t, "_getMatching", _getmatching);
+    Nan::SetPrototypeMethod(t, "_getGrids", _getGrids);
+    Nan::SetPrototypeMethod(t, "_getMatchingGrids", _getmatchingGrids);
+    Nan::SetPrototypeMethod(t, "getMatchingMany", getMatchingMany);
     target->Set(Nan::New("MemoryCache").ToLocalChecked(), t->GetFunction());
     constructor.Reset(t);
 }
 
+template <>
+void JSCache<MmapCache>::Initialize(Handle<Object> target) {
+    Nan::HandleScope scope;
+    Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(JSCache::New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(Nan::New("MmapCache").ToLocalChecked());
+    Nan::SetPrototypeMethod(t, "list", JSMmapCache::list);
+    Nan::SetPrototypeMethod(t, "_get", _get);
+    Nan::SetPrototypeMethod(t, "_getMatching", _getmatching);
+    Nan::SetPrototypeMethod(t, "_getGrids", _getGrids);
+    Nan::SetPrototypeMethod(t, "_getMatchingGrids", _getmatchingGrids);
+    Nan::SetPrototypeMethod(t, "getMatchingMany", getMatchingMany);
+    target->Set(Nan::New("MmapCache").ToLocalChecked(), t->GetFunction());
+    constructor.Reset(t);
+}
+
 template <class T>
 JSCache<T>::JSCache()
     : ObjectWrap(),
       cache() {}
 
+Nan::Persistent<v8::Function> JSCoalesceHandle::constructor;
+
+// handles are only made by coalesce, so the constructor isn't exported
+void JSCoalesceHandle::Initialize() {
+    Nan::HandleScope scope;
+    Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(JSCoalesceHandle::New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(Nan::New("CoalesceHandle").ToLocalChecked());
+    Nan::SetPrototypeMethod(t, "cancel", cancel);
+    constructor.Reset(t->GetFunction());
+}
+
+NAN_METHOD(JSCoalesceHandle::New) {
+    auto* handle = new JSCoalesceHandle();
+    handle->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+}
+
+Local<Object> JSCoalesceHandle::wrap(std::shared_ptr<Interrupt> const& interrupt) {
+    Nan::EscapableHandleScope scope;
+    Local<Object> object = Nan::NewInstance(Nan::New(constructor)).ToLocalChecked();
+    node::ObjectWrap::Unwrap<JSCoalesceHandle>(object)->interrupt = interrupt;
+    return scope.Escape(object);
+}
+
+NAN_METHOD(JSCoalesceHandle::cancel) {
+    auto* handle = node::ObjectWrap::Unwrap<JSCoalesceHandle>(info.This());
+    if (handle->interrupt) handle->interrupt->cancel();
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
 template <class T>
 JSCache<T>::~JSCache() {}
 
@@ -47,12 +109,16 @@ JSCache<T>::~JSCache() {}
  * @name pack
  * @memberof JSCache
  * @param {String}, filename
+ * @param {Object} [options]
+ * @param {String} [options.encoding] - 'varint' (the default) or 'block'; block-encoded grid lists are faster to decode but can't be read by versions of carmen-cache before this option was added
+ * @param {Number} [options.bloomBitsPerKey] - build whole-key bloom filters with this many bits per key
+ * @param {Boolean} [options.prefixBloom] - build bloom filters on key prefixes (including the memoized =1/=2 autocomplete prefixes) for faster prefix scans
  * @returns {Boolean}
  * @example
  * const cache = require('@mapbox/carmen-cache');
  * const JSCache = new cache.JSCache('a');
  *
- * cache.pack('filename');
+ * cache.pack('filename', { encoding: 'block' });
  *
  */
 
@@ -71,10 +137,12 @@ NAN_METHOD(JSCache<T>::pack) {
         }
         std::string filename(*utf8_filename);
 
+        PackOptions options = jsToPackOptions(info[1]);
+
         T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
 
         try {
-            c->pack(filename);
+            c->pack(filename, options);
         } catch (std::exception const& ex) {
             return Nan::ThrowTypeError(ex.what());
         }
@@ -85,6 +153,49 @@ NAN_METHOD(JSCache<T>::pack) {
     }
 }
 
+/**
+ * Writes the contents of the JSCache out as an mmap index, a single read-only
+ * file that can be loaded with MmapCache and read in place without decoding
+ *
+ * @name packMmap
+ * @memberof JSCache
+ * @param {String}, filename
+ * @param {Object} [options] - as for pack
+ * @returns {Boolean}
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const JSCache = new cache.JSCache('a');
+ *
+ * cache.packMmap('filename');
+ *
+ */
+
+template <class T>
+NAN_METHOD(JSCache<T>::packMmap) {
+    if (info.Length() < 1) {
+        return Nan::ThrowTypeError("expected one info: 'filename'");
+    }
+    if (!info[0]->IsString()) {
+        return Nan::ThrowTypeError("first argument must be a String");
+    }
+    try {
+        Nan::Utf8String utf8_filename(info[0]);
+        if (utf8_filename.length() < 1) {
+            return Nan::ThrowTypeError("first arg must be a String");
+        }
+        std::string filename(*utf8_filename);
+
+        PackOptions options = jsToPackOptions(info[1]);
+
+        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
+        c->packMmap(filename, options);
+        info.GetReturnValue().Set(true);
+        return;
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
 /**
  * lists the keys in the JSCache object
  *
@@ -141,10 +252,17 @@ NAN_METHOD(JSCache<T>::list) {
  * @memberof JSCache
  * @param {String} id
  * @param {String} filename
+ * @param {Object} [options]
+ * @param {Number} [options.blockCacheSize] - bytes of private block cache for this index; by default every RocksDBCache shares one block cache, see configureBlockCache
+ * @param {Number} [options.bloomBitsPerKey] - use the whole-key bloom filters written by pack with the same option
+ * @param {Boolean} [options.prefixBloom] - use the prefix bloom filters written by pack with the same option to speed up prefix scans
+ * @param {Number} [options.maxOpenFiles] - the most table files to keep open at once; defaults to unlimited
+ * @param {Boolean} [options.mmapReads] - read table files through mmap rather than pread
+ * @param {Number} [options.decodedCacheSize] - bytes of memory for keeping decoded getMatching results of hot phrases between queries; off by default, see decodedCacheStats
  * @returns {Object}
  * @example
  * const cache = require('@mapbox/carmen-cache');
- * const JSCache = new cache.JSCache('a', 'filename');
+ * const JSCache = new cache.JSCache('a', 'filename', { blockCacheSize: 64 * 1024 * 1024, prefixBloom: true });
  *
  */
 
@@ -170,8 +288,100 @@ NAN_METHOD(JSCache<RocksDBCache>::New) {
         }
         std::string filename(*utf8_filename);
 
+        RocksDBOptions options = jsToRocksDBOptions(info[2]);
+
         JSCache<RocksDBCache>* im = new JSCache<RocksDBCache>();
-        im->cache = RocksDBCache(filename);
+        try {
+            im->cache = RocksDBCache(filename, options);
+        } catch (...) {
+            delete im;
+            throw;
+        }
+        im->Wrap(info.This());
+        info.This()->Set(Nan::New("id").ToLocalChecked(), info[0]);
+        info.GetReturnValue().Set(info.This());
+        return;
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Reports on the RocksDBCache's cache of decoded getMatching results. Lists
+ * too big for the cache are counted as rejected, as are large lists that are
+ * only kept once they've been asked for twice.
+ *
+ * @name decodedCacheStats
+ * @memberof RocksDBCache
+ * @returns {Object} with capacity, usage, entries, hits, misses, rejected and evictions; all 0 if the cache is disabled
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const rocks = new cache.RocksDBCache('a', 'filename', { decodedCacheSize: 64 * 1024 * 1024 });
+ * const stats = rocks.decodedCacheStats();
+ * console.log(stats.hits / (stats.hits + stats.misses));
+ *
+ */
+
+template <>
+NAN_METHOD(JSCache<RocksDBCache>::decodedCacheStats) {
+    JSRocksDBCache* c = node::ObjectWrap::Unwrap<JSRocksDBCache>(info.This());
+    DecodedCacheStats stats = c->cache.decodedCacheStats();
+    Local<Object> out = Nan::New<Object>();
+    out->Set(Nan::New("capacity").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.capacity)));
+    out->Set(Nan::New("usage").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.usage)));
+    out->Set(Nan::New("entries").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.entries)));
+    out->Set(Nan::New("hits").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.hits)));
+    out->Set(Nan::New("misses").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.misses)));
+    out->Set(Nan::New("rejected").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.rejected)));
+    out->Set(Nan::New("evictions").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.evictions)));
+    info.GetReturnValue().Set(out);
+}
+
+/**
+ * Loads a read-only mmap index written by packMmap. The file is mapped into
+ * memory and read in place, so every process on a host that loads the same
+ * index shares a single copy of it in the page cache.
+ *
+ * @name MmapCache
+ * @memberof MmapCache
+ * @param {String} id
+ * @param {String} filename
+ * @returns {Object}
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const MmapCache = new cache.MmapCache('a', 'filename');
+ *
+ */
+
+template <>
+NAN_METHOD(JSCache<MmapCache>::New) {
+    if (!info.IsConstructCall()) {
+        return Nan::ThrowTypeError("Cannot call constructor as function, you need to use 'new' keyword");
+    }
+    try {
+        if (info.Length() < 2) {
+            return Nan::ThrowTypeError("expected arguments 'id' and 'filename'");
+        }
+        if (!info[0]->IsString()) {
+            return Nan::ThrowTypeError("first argument 'id' must be a String");
+        }
+        if (!info[1]->IsString()) {
+            return Nan::ThrowTypeError("second argument 'filename' must be a String");
+        }
+
+        Nan::Utf8String utf8_filename(info[1]);
+        if (utf8_filename.length() < 1) {
+            return Nan::ThrowTypeError("second arg must be a String");
+        }
+        std::string filename(*utf8_filename);
+
+        JSCache<MmapCache>* im = new JSCache<MmapCache>();
+        try {
+            im->cache = MmapCache(filename);
+        } catch (...) {
+            delete im;
+            throw;
+        }
         im->Wrap(info.This());
         info.This()->Set(Nan::New("id").ToLocalChecked(), info[0]);
         info.GetReturnValue().Set(info.This());
@@ -219,6 +429,124 @@ NAN_METHOD(JSCache<MemoryCache>::New) {
     }
 }
 
+// the grids _get returns, or undefined if there are none
+Local<Value> gridsToArray(intarray const& vector) {
+    if (vector.empty()) return Nan::Undefined();
+    std::size_t size = vector.size();
+    Local<Array> array = Nan::New<Array>(static_cast<int>(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        array->Set(i, Nan::New<Number>(vector[i]));
+    }
+    return array;
+}
+
+// the grids _getMatching returns, as objects, or undefined if there are none
+Local<Value> gridsToCoverArray(intarray const& vector) {
+    if (vector.empty()) return Nan::Undefined();
+    std::size_t size = vector.size();
+    Local<Array> array = Nan::New<Array>(static_cast<int>(size));
+    for (uint32_t i = 0; i < size; ++i) {
+        auto obj = coverToObject(numToCover(vector[i]));
+
+        // these values don't make any sense outside the context of coalesce, so delete them
+        // it's a little clunky to set and then delete them, but this function as exposed
+        // to node is only used in debugging/testing, so, meh
+        obj->Delete(Nan::New("idx").ToLocalChecked());
+        obj->Delete(Nan::New("tmpid").ToLocalChecked());
+        obj->Delete(Nan::New("distance").ToLocalChecked());
+        obj->Delete(Nan::New("scoredist").ToLocalChecked());
+        array->Set(i, obj);
+    }
+    return array;
+}
+
+// Hands grids over to JS as a BigUint64Array without copying them or boxing
+// each one: the vector is moved to the heap and freed once the Buffer over it
+// is collected. V8 only has BigUint64Array from 6.7 on; before that the Buffer
+// itself is returned, holding each grid as 8 bytes in native byte order.
+Local<Value> gridsToTypedArray(intarray&& grids) {
+    if (grids.empty()) return Nan::Undefined();
+    intarray* owned = new intarray(std::move(grids));
+    size_t size = owned->size();
+    Local<Object> buffer = Nan::NewBuffer(
+                               reinterpret_cast<char*>(owned->data()),
+                               size * sizeof(uint64_t),
+                               [](char*, void* hint) { delete static_cast<intarray*>(hint); },
+                               owned)
+                               .ToLocalChecked();
+#if CARMEN_HAVE_BIGUINT64ARRAY
+    Local<Uint8Array> bytes = buffer.As<Uint8Array>();
+    return BigUint64Array::New(bytes->Buffer(), bytes->ByteOffset(), size);
+#else
+    return buffer;
+#endif
+}
+
+template <class T>
+void jsCacheLookupTask(uv_work_t* req) {
+    CacheLookupBaton<T>* baton = static_cast<CacheLookupBaton<T>*>(req->data);
+    try {
+        T& cache = baton->cache->cache;
+        if (baton->lookup == CacheLookup::get || baton->lookup == CacheLookup::getGrids) {
+            MatchingQuery const& query = baton->queries[0];
+            baton->results.push_back(cache.__get(query.phrase, query.langfield));
+        } else {
+            baton->results = cache.__getmatchingMany(baton->queries);
+        }
+    } catch (std::exception const& ex) {
+        baton->error = ex.what();
+    }
+}
+
+template <class T>
+void jsCacheLookupAfter(uv_work_t* req, int status) {
+    Nan::HandleScope scope;
+    CacheLookupBaton<T>* baton = static_cast<CacheLookupBaton<T>*>(req->data);
+
+    baton->cache->_unref();
+    if (status == UV_ECANCELED) baton->error = COALESCE_QUEUE_FULL;
+
+    if (!baton->error.empty()) {
+        v8::Local<v8::Value> argv[1] = {Nan::Error(baton->error.c_str())};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    } else {
+        Local<Value> result;
+        if (baton->lookup == CacheLookup::get) {
+            result = gridsToArray(baton->results[0]);
+        } else if (baton->lookup == CacheLookup::getmatching) {
+            result = gridsToCoverArray(baton->results[0]);
+        } else if (baton->lookup != CacheLookup::getmatchingMany) {
+            result = gridsToTypedArray(std::move(baton->results[0]));
+        } else {
+            Local<Array> results = Nan::New<Array>(static_cast<int>(baton->results.size()));
+            for (uint32_t i = 0; i < baton->results.size(); i++) {
+                results->Set(i, gridsToCoverArray(baton->results[i]));
+            }
+            result = results;
+        }
+        Local<Value> argv[2] = {Nan::Null(), result};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 2, argv);
+    }
+
+    baton->callback.Reset();
+    delete baton;
+}
+
+// Runs a lookup on the worker pool, behind the same admission control as
+// coalesce jobs, and calls back with its result. The cache is referenced
+// until then, so it can't be collected while the lookup is reading it.
+template <class T>
+void queueCacheLookup(JSCache<T>* cache, CacheLookup lookup, std::vector<MatchingQuery>&& queries, Local<Function> callback) {
+    CacheLookupBaton<T>* baton = new CacheLookupBaton<T>();
+    baton->cache = cache;
+    baton->lookup = lookup;
+    baton->queries = std::move(queries);
+    baton->callback.Reset(callback);
+    baton->request.data = baton;
+    cache->_ref();
+    queueCoalesceWork(&baton->request, jsCacheLookupTask<T>, jsCacheLookupAfter<T>);
+}
+
 /**
   * Retrieves data exactly matching phrase and language settings by id
   *
@@ -226,6 +554,7 @@ NAN_METHOD(JSCache<MemoryCache>::New) {
   * @memberof JSCache
   * @param {String} id
   * @param {Array} optional; array of languages
+  * @param {Function} optional; a callback, in which case the lookup runs on the worker pool and calls back with (err, grids)
   * @returns {Array} integers referring to grids
   * @example
   * const cache = require('@mapbox/carmen-cache');
@@ -236,14 +565,19 @@ NAN_METHOD(JSCache<MemoryCache>::New) {
   *
   */
 
+// _get and _getGrids, which only differ in how they return the grids
 template <class T>
-NAN_METHOD(JSCache<T>::_get) {
+void jsCacheGet(NAN_METHOD_ARGS_TYPE info, CacheLookup lookup) {
     if (info.Length() < 1) {
         return Nan::ThrowTypeError("expected at least one info: id, [languages]");
     }
     if (!info[0]->IsString()) {
         return Nan::ThrowTypeError("first arg must be a String");
     }
+    // a trailing callback makes the lookup asynchronous
+    int argc = info.Length();
+    bool async = argc > 1 && info[argc - 1]->IsFunction();
+    if (async) argc--;
     try {
         Nan::Utf8String utf8_id(info[0]);
         if (utf8_id.length() < 1) {
@@ -252,7 +586,7 @@ NAN_METHOD(JSCache<T>::_get) {
         std::string id(*utf8_id);
 
         langfield_type langfield;
-        if (info.Length() > 1 && !(info[1]->IsNull() || info[1]->IsUndefined())) {
+        if (argc > 1 && !(info[1]->IsNull() || info[1]->IsUndefined())) {
             if (!info[1]->IsArray()) {
                 return Nan::ThrowTypeError("second arg, if supplied must be an Array");
             }
@@ -261,25 +595,50 @@ NAN_METHOD(JSCache<T>::_get) {
             langfield = ALL_LANGUAGES;
         }
 
-        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
-        intarray vector = c->__get(id, langfield);
-        if (!vector.empty()) {
-            std::size_t size = vector.size();
-            Local<Array> array = Nan::New<Array>(static_cast<int>(size));
-            for (uint32_t i = 0; i < size; ++i) {
-                array->Set(i, Nan::New<Number>(vector[i]));
-            }
-            info.GetReturnValue().Set(array);
+        JSCache<T>* cache = node::ObjectWrap::Unwrap<JSCache<T>>(info.This());
+        if (async) {
+            std::vector<MatchingQuery> queries{MatchingQuery{id, PrefixMatch::disabled, langfield, 0}};
+            queueCacheLookup(cache, lookup, std::move(queries), info[argc].As<Function>());
             return;
+        }
+        intarray grids = cache->cache.__get(id, langfield);
+        if (lookup == CacheLookup::getGrids) {
+            info.GetReturnValue().Set(gridsToTypedArray(std::move(grids)));
         } else {
-            info.GetReturnValue().Set(Nan::Undefined());
-            return;
+            info.GetReturnValue().Set(gridsToArray(grids));
         }
+        return;
     } catch (std::exception const& ex) {
         return Nan::ThrowTypeError(ex.what());
     }
 }
 
+template <class T>
+NAN_METHOD(JSCache<T>::_get) {
+    jsCacheGet<T>(info, CacheLookup::get);
+}
+
+/**
+  * Like get, but returns the grids as a BigUint64Array that shares memory
+  * with the native result, so it costs no allocation per grid and keeps every
+  * bit of each grid, including LANGUAGE_MATCH_BOOST (bit 63), which doesn't
+  * survive conversion to a Number. Node versions whose V8 predates
+  * BigUint64Array (6.7) get the underlying Buffer instead, with each grid as
+  * 8 bytes in native byte order.
+  *
+  * @name getGrids
+  * @memberof JSCache
+  * @param {String} id
+  * @param {Array} optional; array of languages
+  * @param {Function} optional; a callback, as for get
+  * @returns {BigUint64Array|Buffer} grids, or undefined if there are none
+  */
+
+template <class T>
+NAN_METHOD(JSCache<T>::_getGrids) {
+    jsCacheGet<T>(info, CacheLookup::getGrids);
+}
+
 /**
  * Retrieves grid that at least partially matches phrase and/or language inputs
  *
@@ -288,6 +647,8 @@ NAN_METHOD(JSCache<T>::_get) {
  * @param {String} id
  * @param {Number} matches_prefix - whether or do an exact match (0), prefix scan(1), or word boundary scan(2); used for autocomplete
  * @param {Array} optional; array of languages
+ * @param {Boolean} optional; whether to return every match rather than the first 500000
+ * @param {Function} optional; a callback, in which case the lookup runs on the worker pool and calls back with (err, grids)
  * @returns {Array} integers referring to grids
  * @example
  * const cache = require('@mapbox/carmen-cache');
@@ -298,9 +659,15 @@ NAN_METHOD(JSCache<T>::_get) {
  *
  */
 
+// _getMatching and _getMatchingGrids, which only differ in how they return
+// the grids
 template <class T>
-NAN_METHOD(JSCache<T>::_getmatching) {
-    if (info.Length() < 2) {
+void jsCacheGetmatching(NAN_METHOD_ARGS_TYPE info, CacheLookup lookup) {
+    // a trailing callback makes the lookup asynchronous
+    int argc = info.Length();
+    bool async = argc > 2 && info[argc - 1]->IsFunction();
+    if (async) argc--;
+    if (argc < 2) {
         return Nan::ThrowTypeError("expected two to four info: id, match_prefixes, [languages], [extendedScan]");
     }
     if (!info[0]->IsString()) {
@@ -323,7 +690,7 @@ NAN_METHOD(JSCache<T>::_getmatching) {
         PrefixMatch match_prefixes = static_cast<PrefixMatch>(int32_prefix);
 
         langfield_type langfield;
-        if (info.Length() > 2 && !(info[2]->IsNull() || info[2]->IsUndefined())) {
+        if (argc > 2 && !(info[2]->IsNull() || info[2]->IsUndefined())) {
             if (!info[2]->IsArray()) {
                 return Nan::ThrowTypeError("third arg, if supplied, must be an Array");
             }
@@ -333,7 +700,7 @@ NAN_METHOD(JSCache<T>::_getmatching) {
         }
 
         bool extended_scan;
-        if (info.Length() > 3 && !(info[3]->IsNull() || info[3]->IsUndefined())) {
+        if (argc > 3 && !(info[3]->IsNull() || info[3]->IsUndefined())) {
             if (!info[3]->IsBoolean()) {
                 return Nan::ThrowTypeError("fourth arg, if supplied, must be a boolean");
             }
@@ -342,30 +709,131 @@ NAN_METHOD(JSCache<T>::_getmatching) {
             extended_scan = false;
         }
 
-        T* c = &(node::ObjectWrap::Unwrap<JSCache<T>>(info.This())->cache);
+        JSCache<T>* cache = node::ObjectWrap::Unwrap<JSCache<T>>(info.This());
         size_t max_results = extended_scan ? std::numeric_limits<size_t>::max() : PREFIX_MAX_GRID_LENGTH;
-        intarray vector = c->__getmatching(id, match_prefixes, langfield, max_results);
-        if (!vector.empty()) {
-            std::size_t size = vector.size();
-            Local<Array> array = Nan::New<Array>(static_cast<int>(size));
-            for (uint32_t i = 0; i < size; ++i) {
-                auto obj = coverToObject(numToCover(vector[i]));
-
-                // these values don't make any sense outside the context of coalesce, so delete them
-                // it's a little clunky to set and then delete them, but this function as exposed
-                // to node is only used in debugging/testing, so, meh
-                obj->Delete(Nan::New("idx").ToLocalChecked());
-                obj->Delete(Nan::New("tmpid").ToLocalChecked());
-                obj->Delete(Nan::New("distance").ToLocalChecked());
-                obj->Delete(Nan::New("scoredist").ToLocalChecked());
-                array->Set(i, obj);
-            }
-            info.GetReturnValue().Set(array);
+        if (async) {
+            std::vector<MatchingQuery> queries{MatchingQuery{id, match_prefixes, langfield, max_results}};
+            queueCacheLookup(cache, lookup, std::move(queries), info[argc].As<Function>());
             return;
+        }
+        intarray grids = cache->cache.__getmatching(id, match_prefixes, langfield, max_results);
+        if (lookup == CacheLookup::getmatchingGrids) {
+            info.GetReturnValue().Set(gridsToTypedArray(std::move(grids)));
         } else {
-            info.GetReturnValue().Set(Nan::Undefined());
-            return;
+            info.GetReturnValue().Set(gridsToCoverArray(grids));
+        }
+        return;
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+template <class T>
+NAN_METHOD(JSCache<T>::_getmatching) {
+    jsCacheGetmatching<T>(info, CacheLookup::getmatching);
+}
+
+/**
+ * Like getMatching, but returns the raw grids, with LANGUAGE_MATCH_BOOST set
+ * on those whose language matched, as a BigUint64Array (or Buffer) that shares
+ * memory with the native result, as for getGrids
+ *
+ * @name getMatchingGrids
+ * @memberof JSCache
+ * @param {String} id
+ * @param {Number} matches_prefix - as for getMatching
+ * @param {Array} optional; array of languages
+ * @param {Boolean} optional; whether to return every match rather than the first 500000
+ * @param {Function} optional; a callback, as for getMatching
+ * @returns {BigUint64Array|Buffer} grids, or undefined if there are none
+ */
+
+template <class T>
+NAN_METHOD(JSCache<T>::_getmatchingGrids) {
+    jsCacheGetmatching<T>(info, CacheLookup::getmatchingGrids);
+}
+
+// converts one query object passed to getMatchingMany
+MatchingQuery jsToMatchingQuery(Local<Value> const& value) {
+    if (!value->IsObject()) {
+        throw std::invalid_argument("each query must be an object");
+    }
+    Local<Object> query = value->ToObject();
+
+    Local<Value> phrase_val = query->Get(Nan::New("phrase").ToLocalChecked());
+    if (!phrase_val->IsString()) {
+        throw std::invalid_argument("phrase must be a String");
+    }
+    Nan::Utf8String utf8_phrase(phrase_val);
+    if (utf8_phrase.length() < 1) {
+        throw std::invalid_argument("phrase must be a String");
+    }
+
+    PrefixMatch match_prefixes = PrefixMatch::disabled;
+    Local<Value> prefix_val = query->Get(Nan::New("prefix").ToLocalChecked());
+    if (!(prefix_val->IsNull() || prefix_val->IsUndefined())) {
+        int32_t int32_prefix = prefix_val->IsNumber() ? prefix_val->Int32Value() : -1;
+        if (int32_prefix < 0 || int32_prefix > 2) {
+            throw std::invalid_argument("prefix must be an integer between 0 - 2");
+        }
+        match_prefixes = static_cast<PrefixMatch>(int32_prefix);
+    }
+
+    langfield_type langfield = ALL_LANGUAGES;
+    Local<Value> languages_val = query->Get(Nan::New("languages").ToLocalChecked());
+    if (!(languages_val->IsNull() || languages_val->IsUndefined())) {
+        if (!languages_val->IsArray()) {
+            throw std::invalid_argument("languages, if supplied, must be an Array");
+        }
+        langfield = langarrayToLangfield(Local<Array>::Cast(languages_val));
+    }
+
+    bool extended_scan = false;
+    Local<Value> es_val = query->Get(Nan::New("extendedScan").ToLocalChecked());
+    if (!(es_val->IsNull() || es_val->IsUndefined())) {
+        if (!es_val->IsBoolean()) {
+            throw std::invalid_argument("extendedScan, if supplied, must be a boolean");
+        }
+        extended_scan = es_val->BooleanValue();
+    }
+    size_t max_results = extended_scan ? std::numeric_limits<size_t>::max() : PREFIX_MAX_GRID_LENGTH;
+
+    return MatchingQuery{std::string(*utf8_phrase), match_prefixes, langfield, max_results};
+}
+
+/**
+ * Runs many getMatching lookups in one job on the worker pool. On a
+ * RocksDBCache, the messages of every exact-match lookup are read with a
+ * single MultiGet.
+ *
+ * @name getMatchingMany
+ * @memberof JSCache
+ * @param {Object[]} queries - the lookups, each {phrase, prefix, languages, extendedScan}, with the same meaning as the arguments of getMatching; only phrase is required
+ * @param {Function} callback - called with (err, results), where results holds the grids of each query in order, or undefined for queries with none
+ */
+
+template <class T>
+NAN_METHOD(JSCache<T>::getMatchingMany) {
+    if (info.Length() < 2) {
+        return Nan::ThrowTypeError("expected two info: queries, callback");
+    }
+    if (!info[0]->IsArray()) {
+        return Nan::ThrowTypeError("first arg must be an Array of queries");
+    }
+    if (!info[1]->IsFunction()) {
+        return Nan::ThrowTypeError("second arg must be a callback function");
+    }
+    try {
+        Local<Array> array = Local<Array>::Cast(info[0]);
+        std::vector<MatchingQuery> queries;
+        queries.reserve(array->Length());
+        for (uint32_t i = 0; i < array->Length(); i++) {
+            queries.push_back(jsToMatchingQuery(array->Get(i)));
         }
+
+        JSCache<T>* cache = node::ObjectWrap::Unwrap<JSCache<T>>(info.This());
+        queueCacheLookup(cache, CacheLookup::getmatchingMany, std::move(queries), info[1].As<Function>());
+        return;
     } catch (std::exception const& ex) {
         return Nan::ThrowTypeError(ex.what());
     }
@@ -379,12 +847,13 @@ NAN_METHOD(JSCache<MemoryCache>::_set) {
     if (!info[0]->IsString()) {
         return Nan::ThrowTypeError("first arg must be a String");
     }
-    if (!info[1]->IsArray()) {
-        return Nan::ThrowTypeError("second arg must be an Array");
-    }
-    Local<Array> data = Local<Array>::Cast(info[1]);
-    if (data->IsNull() || data->IsUndefined()) {
-        return Nan::ThrowTypeError("an array expected for second argument");
+#if CARMEN_HAVE_BIGUINT64ARRAY
+    bool typed = info[1]->IsFloat64Array() || info[1]->IsBigUint64Array();
+#else
+    bool typed = info[1]->IsFloat64Array();
+#endif
+    if (!info[1]->IsArray() && !typed) {
+        return Nan::ThrowTypeError("second arg must be an Array, Float64Array or BigUint64Array");
     }
     try {
 
@@ -406,16 +875,40 @@ NAN_METHOD(JSCache<MemoryCache>::_set) {
 
         bool append = info.Length() > 3 && info[3]->IsBoolean() && info[3]->BooleanValue();
 
-        unsigned array_size = data->Length();
         auto vec_data = intarray();
-        vec_data.reserve(array_size);
+        if (typed) {
+            // typed arrays are read straight out of their backing store,
+            // rather than element by element through V8
+            Local<TypedArray> data = info[1].As<TypedArray>();
+            size_t array_size = data->Length();
+            const char* contents = static_cast<const char*>(data->Buffer()->GetContents().Data()) + data->ByteOffset();
+            if (info[1]->IsFloat64Array()) {
+                const double* values = reinterpret_cast<const double*>(contents);
+                vec_data.reserve(array_size);
+                for (size_t i = 0; i < array_size; ++i) {
+                    vec_data.emplace_back(static_cast<uint64_t>(values[i]));
+                }
+            } else {
+                const uint64_t* values = reinterpret_cast<const uint64_t*>(contents);
+                vec_data.assign(values, values + array_size);
+            }
+        } else {
+            Local<Array> data = Local<Array>::Cast(info[1]);
+            unsigned array_size = data->Length();
+            vec_data.reserve(array_size);
 
-        for (unsigned i = 0; i < array_size; ++i) {
-            vec_data.emplace_back(static_cast<uint64_t>(data->Get(i)->NumberValue()));
+            for (unsigned i = 0; i < array_size; ++i) {
+                vec_data.emplace_back(static_cast<uint64_t>(data->Get(i)->NumberValue()));
+            }
         }
 
-        MemoryCache* c = &(node::ObjectWrap::Unwrap<JSMemoryCache>(info.This())->cache);
-        c->_set(id, vec_data, langfield, append);
+        // async lookups and coalesce jobs read the cache on other threads
+        // while they hold a reference to it
+        JSMemoryCache* wrap = node::ObjectWrap::Unwrap<JSMemoryCache>(info.This());
+        if (wrap->_busy()) {
+            return Nan::ThrowTypeError("cannot modify a MemoryCache while lookups or coalesce calls are using it");
+        }
+        wrap->cache._set(id, std::move(vec_data), langfield, append);
     } catch (std::exception const& ex) {
         return Nan::ThrowTypeError(ex.what());
     }
@@ -424,31 +917,89 @@ NAN_METHOD(JSCache<MemoryCache>::_set) {
 }
 
 /**
- * The PhrasematchSubqObject type describes the metadata known about possible matches to be assessed for stacking by
- * coalesce as seen from Javascript. Note: it is of similar purpose to the PhrasematchSubq C++ struct type, but differs
- * slightly in specific field names and types.
+ * Loads a grid dump into the cache natively, appending each record's grids
+ * to its phrase and languages as _set(id, grids, languages, true) would. The
+ * file is streamed, and may be either binary or NDJSON; see
+ * src/grid_dump.hpp for both formats.
  *
- * @typedef PhrasematchSubqObject
- * @name PhrasematchSubqObject
- * @type {Object}
- * @property {String} phrase - The matched string
- * @property {Number} weight - A float between 0 and 1 representing how much of the query this string covers
- * @property {Number} prefix - whether or do an exact match (0), prefix scan(1), or word boundary scan(2); used for autocomplete
- * @property {Number} idx - an identifier of the index the match came from; opaque to carmen-cache but returned in results
- * @property {Number} zoom - the configured tile zoom level for the index
- * @property {Number} mask - a bitmask representing which tokens in the original query the subquery covers
- * @property {Number[]} languages - a list of the language IDs to be considered matching
- * @property {Object} cache - the carmen-cache from the index in which the match was found
+ * @name loadFile
+ * @memberof MemoryCache
+ * @param {String} filename - the dump to load
+ * @returns {Number} the number of records loaded
  */
 
-/**
-  * @callback coalesceCallback
-  * @param err - error if any, or null if not
-  * @param {CoalesceResult[]} results - the results of the coalesce operation
-  */
-
-/**
- * A member of the result set from a coalesce operation.
+template <>
+NAN_METHOD(JSCache<MemoryCache>::loadFile) {
+    if (info.Length() < 1 || !info[0]->IsString()) {
+        return Nan::ThrowTypeError("first argument 'filename' must be a String");
+    }
+    try {
+        Nan::Utf8String utf8_filename(info[0]);
+        std::string filename(*utf8_filename);
+        JSMemoryCache* wrap = node::ObjectWrap::Unwrap<JSMemoryCache>(info.This());
+        if (wrap->_busy()) {
+            return Nan::ThrowTypeError("cannot modify a MemoryCache while lookups or coalesce calls are using it");
+        }
+        size_t records = wrap->cache.loadFile(filename);
+        info.GetReturnValue().Set(Nan::New<Number>(static_cast<double>(records)));
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Makes the cache read-only, converting it to a compact representation: each
+ * key's grids are sorted and deduplicated once, into one contiguous buffer,
+ * and lookups then read them in place instead of copying and sorting them.
+ * Results are the same as before, except that a grid set twice for the same
+ * phrase and languages is returned once. _set and loadFile throw afterwards,
+ * and freezing a frozen cache does nothing.
+ *
+ * @name freeze
+ * @memberof MemoryCache
+ * @returns undefined
+ */
+
+template <>
+NAN_METHOD(JSCache<MemoryCache>::freeze) {
+    JSMemoryCache* wrap = node::ObjectWrap::Unwrap<JSMemoryCache>(info.This());
+    if (wrap->_busy()) {
+        return Nan::ThrowTypeError("cannot freeze a MemoryCache while lookups or coalesce calls are using it");
+    }
+    try {
+        wrap->cache.freeze();
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+    info.GetReturnValue().Set(Nan::Undefined());
+}
+
+/**
+ * The PhrasematchSubqObject type describes the metadata known about possible matches to be assessed for stacking by
+ * coalesce as seen from Javascript. Note: it is of similar purpose to the PhrasematchSubq C++ struct type, but differs
+ * slightly in specific field names and types.
+ *
+ * @typedef PhrasematchSubqObject
+ * @name PhrasematchSubqObject
+ * @type {Object}
+ * @property {String} phrase - The matched string
+ * @property {Number} weight - A float between 0 and 1 representing how much of the query this string covers
+ * @property {Number} prefix - whether or do an exact match (0), prefix scan(1), or word boundary scan(2); used for autocomplete
+ * @property {Number} idx - an identifier of the index the match came from; opaque to carmen-cache but returned in results
+ * @property {Number} zoom - the configured tile zoom level for the index
+ * @property {Number} mask - a bitmask representing which tokens in the original query the subquery covers
+ * @property {Number[]} languages - a list of the language IDs to be considered matching
+ * @property {Object} cache - the carmen-cache (MemoryCache, RocksDBCache or MmapCache) from the index in which the match was found
+ */
+
+/**
+  * @callback coalesceCallback
+  * @param err - error if any, or null if not
+  * @param {CoalesceResult[]|Buffer} results - the results of the coalesce operation, or a Buffer of them if options.packed is set
+  */
+
+/**
+ * A member of the result set from a coalesce operation.
  *
  * @typedef CoalesceResult
  * @name CoalesceResult
@@ -477,7 +1028,13 @@ NAN_METHOD(JSCache<MemoryCache>::_set) {
  * @param {Number} [options.radius] - the fall-off radius for determining how wide-reaching the effect of proximity bias is
  * @param {Number[]} [options.centerzxy] - a 3-number array representing the ZXY of the tile on which the proximity point can be found
  * @param {Number[]} [options.bboxzxy] - a 5-number array representing the zoom, minX, minY, maxX, and maxY values of the tile cover of the requested bbox, if any
+ * @param {Boolean} [options.pruning=true] - skip grids that can't make a context within the relevance cutoff; turning it off gives the same results, more slowly
+ * @param {Number} [options.parallelism=1] - how many threads the coalesce may use, counting the one it runs on
+ * @param {Number} [options.deadlineMs] - fail with a "coalesce deadline exceeded" error if the job hasn't finished this many milliseconds after the call, counting time spent queued
+ * @param {Number} [options.lane=0] - the lane the job waits in to be admitted, if admission is limited; see configureAdmission
+ * @param {Boolean} [options.packed=false] - call back with a Buffer of packed typed arrays rather than an array of contexts; read it with PackedCoalesceResult
  * @param {coalesceCallback} callback - the callback function
+ * @returns {Object} a handle whose cancel() method stops the job early, failing it with a "coalesce cancelled" error
  */
 NAN_METHOD(JSCoalesce) {
     // PhrasematchStack (js => cpp)
@@ -490,8 +1047,7 @@ NAN_METHOD(JSCoalesce) {
     }
 
     Local<Array> array = Local<Array>::Cast(info[0]);
-    auto array_length = array->Length();
-    if (array_length < 1) {
+    if (array->Length() < 1) {
         return Nan::ThrowTypeError("Arg 1 must be an array with one or more PhrasematchSubqObjects");
     }
 
@@ -515,269 +1071,333 @@ NAN_METHOD(JSCoalesce) {
     // heading into the threadpool since we assume it will be deleted manually in coalesceAfter
     std::unique_ptr<CoalesceBaton> baton_ptr = std::make_unique<CoalesceBaton>();
     CoalesceBaton* baton = baton_ptr.get();
+    size_t lane;
     try {
-        for (uint32_t i = 0; i < array_length; i++) {
-            Local<Value> val = array->Get(i);
-            if (!val->IsObject()) {
-                return Nan::ThrowTypeError("All items in array must be valid PhrasematchSubqObjects");
-            }
-            Local<Object> jsStack = val->ToObject();
-            if (jsStack->IsNull() || jsStack->IsUndefined()) {
-                return Nan::ThrowTypeError("All items in array must be valid PhrasematchSubqObjects");
-            }
-
-            double weight;
-            std::string phrase;
-            PrefixMatch prefix;
-            unsigned short idx;
-            unsigned short zoom;
-            uint32_t mask;
-            langfield_type langfield;
-            bool extended_scan;
-
-            // TODO: this is verbose: we could write some generic functions to do this robust conversion per type
-            if (!jsStack->Has(Nan::New("idx").ToLocalChecked())) {
-                return Nan::ThrowTypeError("missing idx property");
-            } else {
-                Local<Value> prop_val = jsStack->Get(Nan::New("idx").ToLocalChecked());
-                if (!prop_val->IsNumber()) {
-                    return Nan::ThrowTypeError("idx value must be a number");
-                }
-                int64_t _idx = prop_val->IntegerValue();
-                if (_idx < 0 || _idx > std::numeric_limits<unsigned short>::max()) {
-                    return Nan::ThrowTypeError("encountered idx value too large to fit in unsigned short");
-                }
-                idx = static_cast<unsigned short>(_idx);
-            }
+        jsToPhrasematchStack(array, baton->stack, baton->refs);
+        jsToCoalesceOptions(options, baton->options);
+        lane = jsToCoalesceLane(options);
+        jsOptionalBoolean(options, "packed", baton->packed);
+    } catch (std::exception const& ex) {
+        unrefCaches(baton->refs);
+        return Nan::ThrowTypeError(ex.what());
+    }
 
-            if (!jsStack->Has(Nan::New("zoom").ToLocalChecked())) {
-                return Nan::ThrowTypeError("missing zoom property");
-            } else {
-                Local<Value> prop_val = jsStack->Get(Nan::New("zoom").ToLocalChecked());
-                if (!prop_val->IsNumber()) {
-                    return Nan::ThrowTypeError("zoom value must be a number");
-                }
-                int64_t _zoom = prop_val->IntegerValue();
-                if (_zoom < 0 || _zoom > std::numeric_limits<unsigned short>::max()) {
-                    return Nan::ThrowTypeError("encountered zoom value too large to fit in unsigned short");
-                }
-                zoom = static_cast<unsigned short>(_zoom);
-            }
+    baton->callback.Reset(callback.As<Function>());
 
-            if (!jsStack->Has(Nan::New("weight").ToLocalChecked())) {
-                return Nan::ThrowTypeError("missing weight property");
-            } else {
-                Local<Value> prop_val = jsStack->Get(Nan::New("weight").ToLocalChecked());
-                if (!prop_val->IsNumber()) {
-                    return Nan::ThrowTypeError("weight value must be a number");
-                }
-                double _weight = prop_val->NumberValue();
-                if (_weight < 0 || _weight > std::numeric_limits<double>::max()) {
-                    return Nan::ThrowTypeError("encountered weight value too large to fit in double");
-                }
-                weight = _weight;
-            }
+    // queue work
+    baton->request.data = baton;
+    // Release the managed baton
+    baton_ptr.release();
+    Local<Object> handle = JSCoalesceHandle::wrap(baton->options.interrupt);
+    queueCoalesceWork(&baton->request, jsCoalesceTask, static_cast<uv_after_work_cb>(jsCoalesceAfter), lane);
 
-            if (!jsStack->Has(Nan::New("phrase").ToLocalChecked())) {
-                return Nan::ThrowTypeError("missing phrase property");
-            } else {
-                Local<Value> prop_val = jsStack->Get(Nan::New("phrase").ToLocalChecked());
-                if (!prop_val->IsString()) {
-                    return Nan::ThrowTypeError("phrase value must be a string");
-                }
-                Nan::Utf8String _phrase(prop_val);
-                if (_phrase.length() < 1) {
-                    return Nan::ThrowTypeError("encountered invalid phrase");
-                }
-                phrase = *_phrase;
-            }
+    info.GetReturnValue().Set(handle);
+    return;
+}
 
-            if (!jsStack->Has(Nan::New("prefix").ToLocalChecked())) {
-                return Nan::ThrowTypeError("missing prefix property");
-            } else {
-                Local<Value> prop_val = jsStack->Get(Nan::New("prefix").ToLocalChecked());
-                if (!prop_val->IsNumber()) {
-                    return Nan::ThrowTypeError("prefix value must be a integer between 0 - 2");
-                }
+// reads an array of PhrasematchSubqObjects onto the end of stack, taking a
+// reference on each subquery's cache and recording it in refs
+void jsToPhrasematchStack(Local<Array> const& array, std::vector<PhrasematchSubq>& stack, std::vector<std::pair<char, void*>>& refs) {
+    auto array_length = array->Length();
+    for (uint32_t i = 0; i < array_length; i++) {
+        Local<Value> val = array->Get(i);
+        if (!val->IsObject()) {
+            throw std::invalid_argument("All items in array must be valid PhrasematchSubqObjects");
+        }
+        Local<Object> jsStack = val->ToObject();
+        if (jsStack->IsNull() || jsStack->IsUndefined()) {
+            throw std::invalid_argument("All items in array must be valid PhrasematchSubqObjects");
+        }
 
-                int32_t int32_prefix = prop_val->Int32Value();
-                if (int32_prefix < 0 || int32_prefix > 2) {
-                    return Nan::ThrowTypeError("prefix value must be a integer between 0 - 2");
-                }
-                prefix = static_cast<PrefixMatch>(int32_prefix);
-            }
+        double weight;
+        std::string phrase;
+        PrefixMatch prefix;
+        unsigned short idx;
+        unsigned short zoom;
+        uint32_t mask;
+        langfield_type langfield;
+        bool extended_scan;
 
-            if (!jsStack->Has(Nan::New("mask").ToLocalChecked())) {
-                return Nan::ThrowTypeError("missing mask property");
-            } else {
-                Local<Value> prop_val = jsStack->Get(Nan::New("mask").ToLocalChecked());
-                if (!prop_val->IsNumber()) {
-                    return Nan::ThrowTypeError("mask value must be a number");
-                }
-                int64_t _mask = prop_val->IntegerValue();
-                if (_mask < 0 || _mask > std::numeric_limits<uint32_t>::max()) {
-                    return Nan::ThrowTypeError("encountered mask value too large to fit in uint32_t");
-                }
-                mask = static_cast<uint32_t>(_mask);
+        // TODO: this is verbose: we could write some generic functions to do this robust conversion per type
+        if (!jsStack->Has(Nan::New("idx").ToLocalChecked())) {
+            throw std::invalid_argument("missing idx property");
+        } else {
+            Local<Value> prop_val = jsStack->Get(Nan::New("idx").ToLocalChecked());
+            if (!prop_val->IsNumber()) {
+                throw std::invalid_argument("idx value must be a number");
+            }
+            int64_t _idx = prop_val->IntegerValue();
+            if (_idx < 0 || _idx > std::numeric_limits<unsigned short>::max()) {
+                throw std::invalid_argument("encountered idx value too large to fit in unsigned short");
             }
+            idx = static_cast<unsigned short>(_idx);
+        }
 
-            langfield = ALL_LANGUAGES;
-            if (jsStack->Has(Nan::New("languages").ToLocalChecked())) {
-                Local<Value> c_array = jsStack->Get(Nan::New("languages").ToLocalChecked());
-                if (!c_array->IsArray()) {
-                    return Nan::ThrowTypeError("languages must be an array");
-                }
-                Local<Array> carray = Local<Array>::Cast(c_array);
-                langfield = langarrayToLangfield(carray);
+        if (!jsStack->Has(Nan::New("zoom").ToLocalChecked())) {
+            throw std::invalid_argument("missing zoom property");
+        } else {
+            Local<Value> prop_val = jsStack->Get(Nan::New("zoom").ToLocalChecked());
+            if (!prop_val->IsNumber()) {
+                throw std::invalid_argument("zoom value must be a number");
             }
+            int64_t _zoom = prop_val->IntegerValue();
+            if (_zoom < 0 || _zoom > std::numeric_limits<unsigned short>::max()) {
+                throw std::invalid_argument("encountered zoom value too large to fit in unsigned short");
+            }
+            zoom = static_cast<unsigned short>(_zoom);
+        }
 
-            extended_scan = false;
-            if (jsStack->Has(Nan::New("extendedScan").ToLocalChecked())) {
-                Local<Value> es_val = jsStack->Get(Nan::New("extendedScan").ToLocalChecked());
-                if (!es_val->IsBoolean()) {
-                    return Nan::ThrowTypeError("extendedScan, if supplied, must be a boolean");
-                }
-                extended_scan = es_val->BooleanValue();
+        if (!jsStack->Has(Nan::New("weight").ToLocalChecked())) {
+            throw std::invalid_argument("missing weight property");
+        } else {
+            Local<Value> prop_val = jsStack->Get(Nan::New("weight").ToLocalChecked());
+            if (!prop_val->IsNumber()) {
+                throw std::invalid_argument("weight value must be a number");
+            }
+            double _weight = prop_val->NumberValue();
+            if (_weight < 0 || _weight > std::numeric_limits<double>::max()) {
+                throw std::invalid_argument("encountered weight value too large to fit in double");
             }
+            weight = _weight;
+        }
 
-            if (!jsStack->Has(Nan::New("cache").ToLocalChecked())) {
-                return Nan::ThrowTypeError("missing cache property");
-            } else {
-                Local<Value> prop_val = jsStack->Get(Nan::New("cache").ToLocalChecked());
-                if (!prop_val->IsObject()) {
-                    return Nan::ThrowTypeError("cache value must be a Cache object");
-                }
-                Local<Object> _cache = prop_val->ToObject();
-                if (_cache->IsNull() || _cache->IsUndefined()) {
-                    return Nan::ThrowTypeError("cache value must be a Cache object");
-                }
-                bool isMemoryCache = Nan::New(JSMemoryCache::constructor)->HasInstance(prop_val);
-                bool isRocksDBCache = Nan::New(JSRocksDBCache::constructor)->HasInstance(prop_val);
-                if (!(isMemoryCache || isRocksDBCache)) {
-                    return Nan::ThrowTypeError("cache value must be a MemoryCache or RocksDBCache object");
-                }
-                if (isMemoryCache) {
-                    auto unwrapped = node::ObjectWrap::Unwrap<JSMemoryCache>(_cache);
-                    unwrapped->_ref();
-                    baton->stack.emplace_back(
-                        static_cast<void*>(&(unwrapped->cache)),
-                        TYPE_MEMORY,
-                        weight,
-                        phrase,
-                        prefix,
-                        idx,
-                        zoom,
-                        mask,
-                        langfield,
-                        extended_scan);
-                    baton->refs.emplace_back(std::make_pair(TYPE_MEMORY, static_cast<void*>(unwrapped)));
-                } else {
-                    auto unwrapped = node::ObjectWrap::Unwrap<JSRocksDBCache>(_cache);
-                    unwrapped->_ref();
-                    baton->stack.emplace_back(
-                        static_cast<void*>(&(unwrapped->cache)),
-                        TYPE_ROCKSDB,
-                        weight,
-                        phrase,
-                        prefix,
-                        idx,
-                        zoom,
-                        mask,
-                        langfield,
-                        extended_scan);
-                    baton->refs.emplace_back(std::make_pair(TYPE_ROCKSDB, static_cast<void*>(unwrapped)));
-                }
+        if (!jsStack->Has(Nan::New("phrase").ToLocalChecked())) {
+            throw std::invalid_argument("missing phrase property");
+        } else {
+            Local<Value> prop_val = jsStack->Get(Nan::New("phrase").ToLocalChecked());
+            if (!prop_val->IsString()) {
+                throw std::invalid_argument("phrase value must be a string");
+            }
+            Nan::Utf8String _phrase(prop_val);
+            if (_phrase.length() < 1) {
+                throw std::invalid_argument("encountered invalid phrase");
             }
+            phrase = *_phrase;
         }
 
-        if (options->Has(Nan::New("radius").ToLocalChecked())) {
-            Local<Value> prop_val = options->Get(Nan::New("radius").ToLocalChecked());
+        if (!jsStack->Has(Nan::New("prefix").ToLocalChecked())) {
+            throw std::invalid_argument("missing prefix property");
+        } else {
+            Local<Value> prop_val = jsStack->Get(Nan::New("prefix").ToLocalChecked());
             if (!prop_val->IsNumber()) {
-                return Nan::ThrowTypeError("radius must be a number");
+                throw std::invalid_argument("prefix value must be a integer between 0 - 2");
             }
-            int64_t _radius = prop_val->IntegerValue();
-            if (_radius < 0 || _radius > std::numeric_limits<unsigned>::max()) {
-                return Nan::ThrowTypeError("encountered radius too large to fit in unsigned");
+
+            int32_t int32_prefix = prop_val->Int32Value();
+            if (int32_prefix < 0 || int32_prefix > 2) {
+                throw std::invalid_argument("prefix value must be a integer between 0 - 2");
             }
-            baton->radius = static_cast<double>(_radius);
+            prefix = static_cast<PrefixMatch>(int32_prefix);
+        }
+
+        if (!jsStack->Has(Nan::New("mask").ToLocalChecked())) {
+            throw std::invalid_argument("missing mask property");
         } else {
-            baton->radius = 40.0;
+            Local<Value> prop_val = jsStack->Get(Nan::New("mask").ToLocalChecked());
+            if (!prop_val->IsNumber()) {
+                throw std::invalid_argument("mask value must be a number");
+            }
+            int64_t _mask = prop_val->IntegerValue();
+            if (_mask < 0 || _mask > std::numeric_limits<uint32_t>::max()) {
+                throw std::invalid_argument("encountered mask value too large to fit in uint32_t");
+            }
+            mask = static_cast<uint32_t>(_mask);
         }
 
-        if (options->Has(Nan::New("centerzxy").ToLocalChecked())) {
-            Local<Value> c_array = options->Get(Nan::New("centerzxy").ToLocalChecked());
+        langfield = ALL_LANGUAGES;
+        if (jsStack->Has(Nan::New("languages").ToLocalChecked())) {
+            Local<Value> c_array = jsStack->Get(Nan::New("languages").ToLocalChecked());
             if (!c_array->IsArray()) {
-                return Nan::ThrowTypeError("centerzxy must be an array");
+                throw std::invalid_argument("languages must be an array");
             }
             Local<Array> carray = Local<Array>::Cast(c_array);
-            if (carray->Length() != 3) {
-                return Nan::ThrowTypeError("centerzxy must be an array of 3 numbers");
-            }
-            baton->centerzxy.reserve(carray->Length());
-            for (uint32_t i = 0; i < carray->Length(); ++i) {
-                Local<Value> item = carray->Get(i);
-                if (!item->IsNumber()) {
-                    return Nan::ThrowTypeError("centerzxy values must be number");
-                }
-                int64_t a_val = item->IntegerValue();
-                if (a_val < 0 || a_val > std::numeric_limits<uint32_t>::max()) {
-                    return Nan::ThrowTypeError("encountered centerzxy value too large to fit in uint32_t");
-                }
-                baton->centerzxy.emplace_back(static_cast<uint32_t>(a_val));
+            langfield = langarrayToLangfield(carray);
+        }
+
+        extended_scan = false;
+        if (jsStack->Has(Nan::New("extendedScan").ToLocalChecked())) {
+            Local<Value> es_val = jsStack->Get(Nan::New("extendedScan").ToLocalChecked());
+            if (!es_val->IsBoolean()) {
+                throw std::invalid_argument("extendedScan, if supplied, must be a boolean");
             }
+            extended_scan = es_val->BooleanValue();
         }
 
-        if (options->Has(Nan::New("bboxzxy").ToLocalChecked())) {
-            Local<Value> c_array = options->Get(Nan::New("bboxzxy").ToLocalChecked());
-            if (!c_array->IsArray()) {
-                return Nan::ThrowTypeError("bboxzxy must be an array");
+        if (!jsStack->Has(Nan::New("cache").ToLocalChecked())) {
+            throw std::invalid_argument("missing cache property");
+        } else {
+            Local<Value> prop_val = jsStack->Get(Nan::New("cache").ToLocalChecked());
+            if (!prop_val->IsObject()) {
+                throw std::invalid_argument("cache value must be a Cache object");
             }
-            Local<Array> carray = Local<Array>::Cast(c_array);
-            if (carray->Length() != 5) {
-                return Nan::ThrowTypeError("bboxzxy must be an array of 5 numbers");
-            }
-            baton->bboxzxy.reserve(carray->Length());
-            for (uint32_t i = 0; i < carray->Length(); ++i) {
-                Local<Value> item = carray->Get(i);
-                if (!item->IsNumber()) {
-                    return Nan::ThrowTypeError("bboxzxy values must be number");
-                }
-                int64_t a_val = item->IntegerValue();
-                if (a_val < 0 || a_val > std::numeric_limits<uint32_t>::max()) {
-                    return Nan::ThrowTypeError("encountered bboxzxy value too large to fit in uint32_t");
-                }
-                baton->bboxzxy.emplace_back(static_cast<uint32_t>(a_val));
+            Local<Object> _cache = prop_val->ToObject();
+            if (_cache->IsNull() || _cache->IsUndefined()) {
+                throw std::invalid_argument("cache value must be a Cache object");
+            }
+            bool isMemoryCache = Nan::New(JSMemoryCache::constructor)->HasInstance(prop_val);
+            bool isRocksDBCache = Nan::New(JSRocksDBCache::constructor)->HasInstance(prop_val);
+            bool isMmapCache = Nan::New(JSMmapCache::constructor)->HasInstance(prop_val);
+            if (!(isMemoryCache || isRocksDBCache || isMmapCache)) {
+                throw std::invalid_argument("cache value must be a MemoryCache, RocksDBCache or MmapCache object");
+            }
+            if (isMemoryCache) {
+                auto unwrapped = node::ObjectWrap::Unwrap<JSMemoryCache>(_cache);
+                unwrapped->_ref();
+                stack.emplace_back(
+                    static_cast<void*>(&(unwrapped->cache)),
+                    TYPE_MEMORY,
+                    weight,
+                    phrase,
+                    prefix,
+                    idx,
+                    zoom,
+                    mask,
+                    langfield,
+                    extended_scan);
+                refs.emplace_back(std::make_pair(TYPE_MEMORY, static_cast<void*>(unwrapped)));
+            } else if (isMmapCache) {
+                auto unwrapped = node::ObjectWrap::Unwrap<JSMmapCache>(_cache);
+                unwrapped->_ref();
+                stack.emplace_back(
+                    static_cast<void*>(&(unwrapped->cache)),
+                    TYPE_MMAP,
+                    weight,
+                    phrase,
+                    prefix,
+                    idx,
+                    zoom,
+                    mask,
+                    langfield,
+                    extended_scan);
+                refs.emplace_back(std::make_pair(TYPE_MMAP, static_cast<void*>(unwrapped)));
+            } else {
+                auto unwrapped = node::ObjectWrap::Unwrap<JSRocksDBCache>(_cache);
+                unwrapped->_ref();
+                stack.emplace_back(
+                    static_cast<void*>(&(unwrapped->cache)),
+                    TYPE_ROCKSDB,
+                    weight,
+                    phrase,
+                    prefix,
+                    idx,
+                    zoom,
+                    mask,
+                    langfield,
+                    extended_scan);
+                refs.emplace_back(std::make_pair(TYPE_ROCKSDB, static_cast<void*>(unwrapped)));
             }
         }
+    }
+}
 
-        baton->callback.Reset(callback.As<Function>());
+// reads the options object shared by coalesce and coalesceBatch
+void jsToCoalesceOptions(Local<Object> const& options, CoalesceOptions& out) {
+    if (options->Has(Nan::New("radius").ToLocalChecked())) {
+        Local<Value> prop_val = options->Get(Nan::New("radius").ToLocalChecked());
+        if (!prop_val->IsNumber()) {
+            throw std::invalid_argument("radius must be a number");
+        }
+        int64_t _radius = prop_val->IntegerValue();
+        if (_radius < 0 || _radius > std::numeric_limits<unsigned>::max()) {
+            throw std::invalid_argument("encountered radius too large to fit in unsigned");
+        }
+        out.radius = static_cast<double>(_radius);
+    } else {
+        out.radius = 40.0;
+    }
 
-        // queue work
-        baton->request.data = baton;
-        // Release the managed baton
-        baton_ptr.release();
-        uv_queue_work(uv_default_loop(), &baton->request, jsCoalesceTask, static_cast<uv_after_work_cb>(jsCoalesceAfter));
-    } catch (std::exception const& ex) {
-        return Nan::ThrowTypeError(ex.what());
+    if (options->Has(Nan::New("centerzxy").ToLocalChecked())) {
+        Local<Value> c_array = options->Get(Nan::New("centerzxy").ToLocalChecked());
+        if (!c_array->IsArray()) {
+            throw std::invalid_argument("centerzxy must be an array");
+        }
+        Local<Array> carray = Local<Array>::Cast(c_array);
+        if (carray->Length() != 3) {
+            throw std::invalid_argument("centerzxy must be an array of 3 numbers");
+        }
+        out.centerzxy.reserve(carray->Length());
+        for (uint32_t i = 0; i < carray->Length(); ++i) {
+            Local<Value> item = carray->Get(i);
+            if (!item->IsNumber()) {
+                throw std::invalid_argument("centerzxy values must be number");
+            }
+            int64_t a_val = item->IntegerValue();
+            if (a_val < 0 || a_val > std::numeric_limits<uint32_t>::max()) {
+                throw std::invalid_argument("encountered centerzxy value too large to fit in uint32_t");
+            }
+            out.centerzxy.emplace_back(static_cast<uint32_t>(a_val));
+        }
     }
 
-    info.GetReturnValue().Set(Nan::Undefined());
-    return;
+    if (options->Has(Nan::New("bboxzxy").ToLocalChecked())) {
+        Local<Value> c_array = options->Get(Nan::New("bboxzxy").ToLocalChecked());
+        if (!c_array->IsArray()) {
+            throw std::invalid_argument("bboxzxy must be an array");
+        }
+        Local<Array> carray = Local<Array>::Cast(c_array);
+        if (carray->Length() != 5) {
+            throw std::invalid_argument("bboxzxy must be an array of 5 numbers");
+        }
+        out.bboxzxy.reserve(carray->Length());
+        for (uint32_t i = 0; i < carray->Length(); ++i) {
+            Local<Value> item = carray->Get(i);
+            if (!item->IsNumber()) {
+                throw std::invalid_argument("bboxzxy values must be number");
+            }
+            int64_t a_val = item->IntegerValue();
+            if (a_val < 0 || a_val > std::numeric_limits<uint32_t>::max()) {
+                throw std::invalid_argument("encountered bboxzxy value too large to fit in uint32_t");
+            }
+            out.bboxzxy.emplace_back(static_cast<uint32_t>(a_val));
+        }
+    }
+    jsOptionalBoolean(options, "pruning", out.pruning);
+    jsOptionalUnsigned(options, "parallelism", out.parallelism);
+
+    // the deadline counts from now, so time spent waiting for a thread is
+    // included
+    out.interrupt = std::make_shared<Interrupt>();
+    uint32_t deadline_ms;
+    if (jsOptionalUnsigned(options, "deadlineMs", deadline_ms)) {
+        out.interrupt->setDeadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline_ms));
+    }
+}
+
+// the admission lane a coalesce job waits in; see configureAdmission
+size_t jsToCoalesceLane(Local<Object> const& options) {
+    size_t lane = 0;
+    jsOptionalUnsigned(options, "lane", lane);
+    if (lane >= coalesceLanes()) {
+        throw std::invalid_argument("lane " + std::to_string(lane) + " doesn't exist");
+    }
+    return lane;
+}
+
+// releases the references taken on caches while reading subqueries
+void unrefCaches(std::vector<std::pair<char, void*>> const& refs) {
+    for (auto const& ref : refs) {
+        if (ref.first == TYPE_MEMORY)
+            reinterpret_cast<JSMemoryCache*>(ref.second)->_unref();
+        else if (ref.first == TYPE_MMAP)
+            reinterpret_cast<JSMmapCache*>(ref.second)->_unref();
+        else
+            reinterpret_cast<JSRocksDBCache*>(ref.second)->_unref();
+    }
 }
 
 void jsCoalesceTask(uv_work_t* req) {
     CoalesceBaton* baton = static_cast<CoalesceBaton*>(req->data);
     try {
-        baton->features = coalesce(baton->stack, baton->centerzxy, baton->bboxzxy, baton->radius);
+        baton->features = coalesce(baton->stack, baton->options);
+        if (baton->packed) {
+            baton->packed_features = packContexts(baton->features);
+            baton->features.clear();
+        }
     } catch (std::exception const& ex) {
         baton->error = ex.what();
     }
 }
 
-// we don't use the 'status' parameter, but it's required as part of the uv_after_work_cb
-// function signature, so suppress the warning about it
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunused-parameter"
 // this function handles getting the results of either coalesceSingle or coalesceMulti
 // ready to be passed back to JS land, and queues up a callback invokation on the main thread
 void jsCoalesceAfter(uv_work_t* req, int status) {
@@ -785,16 +1405,16 @@ void jsCoalesceAfter(uv_work_t* req, int status) {
     CoalesceBaton* baton = static_cast<CoalesceBaton*>(req->data);
 
     // Reference count the cache objects
-    for (auto& ref : baton->refs) {
-        if (ref.first == TYPE_MEMORY)
-            reinterpret_cast<JSMemoryCache*>(ref.second)->_unref();
-        else
-            reinterpret_cast<JSRocksDBCache*>(ref.second)->_unref();
-    }
+    unrefCaches(baton->refs);
+    if (status == UV_ECANCELED) baton->error = COALESCE_QUEUE_FULL;
 
     if (!baton->error.empty()) {
         v8::Local<v8::Value> argv[1] = {Nan::Error(baton->error.c_str())};
         Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    } else if (baton->packed) {
+        std::string const& packed = baton->packed_features;
+        Local<Value> argv[2] = {Nan::Null(), Nan::CopyBuffer(packed.data(), static_cast<uint32_t>(packed.size())).ToLocalChecked()};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 2, argv);
     } else {
         std::vector<Context> const& features = baton->features;
 
@@ -810,13 +1430,398 @@ void jsCoalesceAfter(uv_work_t* req, int status) {
     baton->callback.Reset();
     delete baton;
 }
-#pragma clang diagnostic pop
+
+/**
+ * Runs coalesce over many stacks in a single job on the thread pool. Stacks
+ * built for the same query usually share subqueries (the same cache, phrase,
+ * prefix and languages), and each shared subquery's grids are read and
+ * decoded once for the whole batch rather than once per stack.
+ *
+ * @name coalesceBatch
+ * @param {Array<PhrasematchSubqObject[]>} stacks - the stacks to coalesce, each an array of PhrasematchSubqObjects as passed to coalesce
+ * @param {Object} options - options for every stack in the batch, as for coalesce
+ * @param {coalesceBatchCallback} callback - the callback function
+ * @returns {Object} a handle whose cancel() method stops the batch early, as for coalesce
+ */
+
+/**
+  * @callback coalesceBatchCallback
+  * @param err - error if any, or null if not
+  * @param {Array<CoalesceResult[]>|Buffer[]} results - the results of coalescing each stack, in the order the stacks were given (Buffers if options.packed is set)
+  */
+NAN_METHOD(JSCoalesceBatch) {
+    if (info.Length() < 3) {
+        return Nan::ThrowTypeError("Expects 3 arguments: an array of PhrasematchSubqObject arrays, an option object, and a callback");
+    }
+
+    if (!info[0]->IsArray()) {
+        return Nan::ThrowTypeError("Arg 1 must be an array of PhrasematchSubqObject arrays");
+    }
+    Local<Array> array = Local<Array>::Cast(info[0]);
+
+    Local<Value> options_val = info[1];
+    if (!options_val->IsObject()) {
+        return Nan::ThrowTypeError("Arg 2 must be an options object");
+    }
+    Local<Object> options = options_val->ToObject();
+
+    Local<Value> callback = info[2];
+    if (!callback->IsFunction()) {
+        return Nan::ThrowTypeError("Arg 3 must be a callback function");
+    }
+
+    // see JSCoalesce
+    std::unique_ptr<CoalesceBatchBaton> baton_ptr = std::make_unique<CoalesceBatchBaton>();
+    CoalesceBatchBaton* baton = baton_ptr.get();
+    size_t lane;
+    try {
+        auto array_length = array->Length();
+        baton->stacks.reserve(array_length);
+        for (uint32_t i = 0; i < array_length; i++) {
+            Local<Value> stack_val = array->Get(i);
+            if (!stack_val->IsArray() || Local<Array>::Cast(stack_val)->Length() < 1) {
+                throw std::invalid_argument("Every stack must be an array with one or more PhrasematchSubqObjects");
+            }
+            baton->stacks.emplace_back();
+            jsToPhrasematchStack(Local<Array>::Cast(stack_val), baton->stacks.back(), baton->refs);
+        }
+        jsToCoalesceOptions(options, baton->options);
+        lane = jsToCoalesceLane(options);
+        jsOptionalBoolean(options, "packed", baton->packed);
+    } catch (std::exception const& ex) {
+        unrefCaches(baton->refs);
+        return Nan::ThrowTypeError(ex.what());
+    }
+
+    baton->callback.Reset(callback.As<Function>());
+
+    baton->request.data = baton;
+    baton_ptr.release();
+    Local<Object> handle = JSCoalesceHandle::wrap(baton->options.interrupt);
+    queueCoalesceWork(&baton->request, jsCoalesceBatchTask, static_cast<uv_after_work_cb>(jsCoalesceBatchAfter), lane);
+
+    info.GetReturnValue().Set(handle);
+    return;
+}
+
+void jsCoalesceBatchTask(uv_work_t* req) {
+    CoalesceBatchBaton* baton = static_cast<CoalesceBatchBaton*>(req->data);
+    try {
+        baton->results = coalesceBatch(baton->stacks, baton->options);
+        if (baton->packed) {
+            for (auto const& result : baton->results) {
+                baton->packed_results.push_back(packContexts(result));
+            }
+            baton->results.clear();
+        }
+    } catch (std::exception const& ex) {
+        baton->error = ex.what();
+    }
+}
+
+void jsCoalesceBatchAfter(uv_work_t* req, int status) {
+    Nan::HandleScope scope;
+    CoalesceBatchBaton* baton = static_cast<CoalesceBatchBaton*>(req->data);
+
+    unrefCaches(baton->refs);
+    if (status == UV_ECANCELED) baton->error = COALESCE_QUEUE_FULL;
+
+    if (!baton->error.empty()) {
+        v8::Local<v8::Value> argv[1] = {Nan::Error(baton->error.c_str())};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 1, argv);
+    } else if (baton->packed) {
+        Local<Array> jsResults = Nan::New<Array>(static_cast<int>(baton->packed_results.size()));
+        for (uint32_t i = 0; i < baton->packed_results.size(); i++) {
+            std::string const& packed = baton->packed_results[i];
+            jsResults->Set(i, Nan::CopyBuffer(packed.data(), static_cast<uint32_t>(packed.size())).ToLocalChecked());
+        }
+
+        Local<Value> argv[2] = {Nan::Null(), jsResults};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 2, argv);
+    } else {
+        Local<Array> jsResults = Nan::New<Array>(static_cast<int>(baton->results.size()));
+        for (uint32_t i = 0; i < baton->results.size(); i++) {
+            std::vector<Context> const& features = baton->results[i];
+            Local<Array> jsFeatures = Nan::New<Array>(static_cast<int>(features.size()));
+            for (uint32_t j = 0; j < features.size(); j++) {
+                jsFeatures->Set(j, contextToArray(features[j]));
+            }
+            jsResults->Set(i, jsFeatures);
+        }
+
+        Local<Value> argv[2] = {Nan::Null(), jsResults};
+        Nan::MakeCallback(Nan::GetCurrentContext()->Global(), Nan::New(baton->callback), 2, argv);
+    }
+
+    baton->callback.Reset();
+    delete baton;
+}
+
+/**
+ * Configures the block cache shared by every RocksDBCache that isn't given its
+ * own blockCacheSize. The capacity can be changed at any time; the type only
+ * before the first RocksDBCache is opened.
+ *
+ * @name configureBlockCache
+ * @param {Object} options
+ * @param {Number} options.size - the shared block cache's capacity in bytes; defaults to 256MB
+ * @param {String} [options.type] - 'lru' (the default) or 'clock'; falls back to 'lru' if rocksdb was built without clock cache support
+ * @returns undefined
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * cache.configureBlockCache({ size: 1024 * 1024 * 1024 });
+ *
+ */
+
+NAN_METHOD(JSConfigureBlockCache) {
+    try {
+        if (info.Length() < 1 || !info[0]->IsObject()) {
+            return Nan::ThrowTypeError("expected an options object");
+        }
+        Local<Object> options = info[0]->ToObject();
+
+        size_t size = 0;
+        if (!jsOptionalUnsigned(options, "size", size)) {
+            return Nan::ThrowTypeError("missing size property");
+        }
+        std::string type = sharedBlockCacheStats().type;
+        if (options->Has(Nan::New("type").ToLocalChecked())) {
+            Local<Value> prop_val = options->Get(Nan::New("type").ToLocalChecked());
+            if (!prop_val->IsString()) {
+                return Nan::ThrowTypeError("type must be a string");
+            }
+            type = *Nan::Utf8String(prop_val);
+        }
+
+        configureSharedBlockCache(size, type);
+        info.GetReturnValue().Set(Nan::Undefined());
+        return;
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Reports on the block cache shared between RocksDBCaches. The hit and miss
+ * counts cover block cache lookups by every RocksDBCache, including those
+ * with a private blockCacheSize.
+ *
+ * @name blockCacheStats
+ * @returns {Object} with type, capacity, usage, pinnedUsage, hits and misses
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const stats = cache.blockCacheStats();
+ * console.log(stats.hits / (stats.hits + stats.misses));
+ *
+ */
+
+NAN_METHOD(JSBlockCacheStats) {
+    BlockCacheStats stats = sharedBlockCacheStats();
+    Local<Object> out = Nan::New<Object>();
+    out->Set(Nan::New("type").ToLocalChecked(), Nan::New(stats.type).ToLocalChecked());
+    out->Set(Nan::New("capacity").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.capacity)));
+    out->Set(Nan::New("usage").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.usage)));
+    out->Set(Nan::New("pinnedUsage").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.pinned_usage)));
+    out->Set(Nan::New("hits").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.hits)));
+    out->Set(Nan::New("misses").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.misses)));
+    info.GetReturnValue().Set(out);
+}
+
+/**
+ * Moves coalesce and coalesceBatch off the libuv threadpool (which they
+ * otherwise share with fs and dns work, sized by UV_THREADPOOL_SIZE) onto a
+ * pool of threads of their own. Jobs that arrive while maxQueued jobs are
+ * already waiting for a thread fail with a "coalesce queue is full" error.
+ * The pool can only be reconfigured while no coalesce jobs are running or
+ * waiting for their callbacks (so not from inside a coalesce callback).
+ *
+ * @name configureWorkerPool
+ * @param {Object} options
+ * @param {Number} options.threads - the number of threads; 0 goes back to the libuv threadpool
+ * @param {Number} [options.maxQueued=1024] - the most jobs that can wait for a thread
+ * @param {Number[]} [options.affinity] - cpus to pin the threads to, round robin; only supported on linux
+ * @returns undefined
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * cache.configureWorkerPool({ threads: require('os').cpus().length, maxQueued: 256 });
+ *
+ */
+
+NAN_METHOD(JSConfigureWorkerPool) {
+    try {
+        if (info.Length() < 1 || !info[0]->IsObject()) {
+            return Nan::ThrowTypeError("expected an options object");
+        }
+        Local<Object> options = info[0]->ToObject();
+
+        WorkerPoolOptions pool_options;
+        if (!jsOptionalUnsigned(options, "threads", pool_options.threads)) {
+            return Nan::ThrowTypeError("missing threads property");
+        }
+        jsOptionalUnsigned(options, "maxQueued", pool_options.max_queued);
+        if (options->Has(Nan::New("affinity").ToLocalChecked())) {
+            Local<Value> prop_val = options->Get(Nan::New("affinity").ToLocalChecked());
+            if (!prop_val->IsArray()) {
+                return Nan::ThrowTypeError("affinity must be an array of cpu numbers");
+            }
+            Local<Array> cpus = Local<Array>::Cast(prop_val);
+            for (uint32_t i = 0; i < cpus->Length(); i++) {
+                Local<Value> cpu = cpus->Get(i);
+                if (!cpu->IsNumber()) {
+                    return Nan::ThrowTypeError("affinity must be an array of cpu numbers");
+                }
+                int64_t _cpu = cpu->IntegerValue();
+                if (_cpu < 0 || _cpu > std::numeric_limits<unsigned>::max()) {
+                    return Nan::ThrowTypeError("affinity must be an array of cpu numbers");
+                }
+                pool_options.affinity.push_back(static_cast<unsigned>(_cpu));
+            }
+        }
+
+        configureCoalescePool(pool_options);
+        info.GetReturnValue().Set(Nan::Undefined());
+        return;
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Reports on the coalesce worker pool. Wait times are measured from when a
+ * job is queued to when a thread starts on it.
+ *
+ * @name workerPoolStats
+ * @returns {Object} with threads, maxQueued, queued, active, completed, rejected, totalWaitMs and maxWaitMs; all 0 if there's no pool
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const stats = cache.workerPoolStats();
+ * console.log(stats.totalWaitMs / stats.completed);
+ *
+ */
+
+NAN_METHOD(JSWorkerPoolStats) {
+    WorkerPoolStats stats = coalescePoolStats();
+    Local<Object> out = Nan::New<Object>();
+    out->Set(Nan::New("threads").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.threads)));
+    out->Set(Nan::New("maxQueued").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.max_queued)));
+    out->Set(Nan::New("queued").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.queued)));
+    out->Set(Nan::New("active").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.active)));
+    out->Set(Nan::New("completed").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.completed)));
+    out->Set(Nan::New("rejected").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.rejected)));
+    out->Set(Nan::New("totalWaitMs").ToLocalChecked(), Nan::New<Number>(stats.total_wait_ms));
+    out->Set(Nan::New("maxWaitMs").ToLocalChecked(), Nan::New<Number>(stats.max_wait_ms));
+    info.GetReturnValue().Set(out);
+}
+
+/**
+ * Limits how many coalesce and coalesceBatch jobs are handed to threads at
+ * once. Jobs beyond maxInFlight wait to be admitted in one of several lanes
+ * (picked with the lane option of coalesce), and as jobs finish the next one
+ * is taken from the lowest-numbered lane that has any. A job that arrives
+ * when its lane already has maxQueued jobs waiting fails straight away with a
+ * "coalesce queue is full" error. By default there's one lane and no limits.
+ *
+ * @name configureAdmission
+ * @param {Object} options
+ * @param {Number} [options.maxInFlight=0] - the most jobs running or waiting for a thread at once; 0 for no limit
+ * @param {Number|Number[]} [options.maxQueued] - the most jobs that can wait to be admitted, or an array with the limit for each lane, highest priority first; unlimited by default
+ * @returns undefined
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * // forward geocodes in lane 0, autocomplete in lane 1
+ * cache.configureAdmission({ maxInFlight: 16, maxQueued: [256, 64] });
+ * cache.coalesce(stack, { lane: 1 }, callback);
+ *
+ */
+
+NAN_METHOD(JSConfigureAdmission) {
+    try {
+        if (info.Length() < 1 || !info[0]->IsObject()) {
+            return Nan::ThrowTypeError("expected an options object");
+        }
+        Local<Object> options = info[0]->ToObject();
+
+        AdmissionOptions admission_options;
+        jsOptionalUnsigned(options, "maxInFlight", admission_options.max_in_flight);
+        if (options->Has(Nan::New("maxQueued").ToLocalChecked())) {
+            Local<Value> prop_val = options->Get(Nan::New("maxQueued").ToLocalChecked());
+            Local<Array> lanes;
+            if (prop_val->IsArray()) {
+                lanes = Local<Array>::Cast(prop_val);
+            } else {
+                lanes = Nan::New<Array>();
+                lanes->Set(0, prop_val);
+            }
+            admission_options.max_queued.clear();
+            for (uint32_t i = 0; i < lanes->Length(); i++) {
+                Local<Value> lane = lanes->Get(i);
+                if (!lane->IsNumber() || lane->NumberValue() < 0) {
+                    return Nan::ThrowTypeError("maxQueued must be a number or an array of numbers");
+                }
+                // Infinity, or anything too big for a size_t, means no limit
+                double max_queued = lane->NumberValue();
+                admission_options.max_queued.push_back(max_queued >= static_cast<double>(std::numeric_limits<size_t>::max()) ? std::numeric_limits<size_t>::max() : static_cast<size_t>(max_queued));
+            }
+        }
+
+        configureCoalesceAdmission(admission_options);
+        info.GetReturnValue().Set(Nan::Undefined());
+        return;
+    } catch (std::exception const& ex) {
+        return Nan::ThrowTypeError(ex.what());
+    }
+}
+
+/**
+ * Reports on coalesce admission, so callers can shed load before the queues
+ * fill up.
+ *
+ * @name admissionStats
+ * @returns {Object} with maxInFlight, inFlight, queued (the total waiting), lanes (an array of { queued, maxQueued }), admitted and rejected
+ * @example
+ * const cache = require('@mapbox/carmen-cache');
+ * const stats = cache.admissionStats();
+ * if (stats.lanes[1].queued > 32) return res.status(503).end();
+ *
+ */
+
+NAN_METHOD(JSAdmissionStats) {
+    AdmissionStats stats = coalesceAdmissionStats();
+    Local<Object> out = Nan::New<Object>();
+    out->Set(Nan::New("maxInFlight").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.max_in_flight)));
+    out->Set(Nan::New("inFlight").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.in_flight)));
+    size_t queued = 0;
+    Local<Array> lanes = Nan::New<Array>();
+    for (size_t i = 0; i < stats.queued.size(); i++) {
+        Local<Object> lane = Nan::New<Object>();
+        lane->Set(Nan::New("queued").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.queued[i])));
+        // no limit is reported as Infinity
+        double max_queued = stats.max_queued[i] == std::numeric_limits<size_t>::max() ? std::numeric_limits<double>::infinity() : static_cast<double>(stats.max_queued[i]);
+        lane->Set(Nan::New("maxQueued").ToLocalChecked(), Nan::New<Number>(max_queued));
+        lanes->Set(static_cast<uint32_t>(i), lane);
+        queued += stats.queued[i];
+    }
+    out->Set(Nan::New("queued").ToLocalChecked(), Nan::New<Number>(static_cast<double>(queued)));
+    out->Set(Nan::New("lanes").ToLocalChecked(), lanes);
+    out->Set(Nan::New("admitted").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.admitted)));
+    out->Set(Nan::New("rejected").ToLocalChecked(), Nan::New<Number>(static_cast<double>(stats.rejected)));
+    info.GetReturnValue().Set(out);
+}
 
 extern "C" {
 static void start(Handle<Object> target) {
     JSMemoryCache::Initialize(target);
     JSRocksDBCache::Initialize(target);
+    JSMmapCache::Initialize(target);
+    JSCoalesceHandle::Initialize();
     Nan::SetMethod(target, "coalesce", JSCoalesce);
+    Nan::SetMethod(target, "coalesceBatch", JSCoalesceBatch);
+    Nan::SetMethod(target, "configureBlockCache", JSConfigureBlockCache);
+    Nan::SetMethod(target, "blockCacheStats", JSBlockCacheStats);
+    Nan::SetMethod(target, "configureWorkerPool", JSConfigureWorkerPool);
+    Nan::SetMethod(target, "workerPoolStats", JSWorkerPoolStats);
+    Nan::SetMethod(target, "configureAdmission", JSConfigureAdmission);
+    Nan::SetMethod(target, "admissionStats", JSAdmissionStats);
 }
 }
 
@@ -826,4 +1831,3 @@ static void start(Handle<Object> target) {
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wold-style-cast"
 NODE_MODULE(carmen, carmen::start)
-#pragma clang diagnostic pop
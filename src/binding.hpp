@@ -3,8 +3,10 @@
 
 #include "coalesce.hpp"
 #include "memorycache.hpp"
+#include "mmapcache.hpp"
 #include "node_util.hpp"
 #include "rocksdbcache.hpp"
+#include "worker_pool.hpp"
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunknown-pragmas"
@@ -34,13 +36,22 @@ class JSCache : public node::ObjectWrap {
     static void Initialize(v8::Handle<v8::Object> target);
     static NAN_METHOD(New);
     static NAN_METHOD(pack);
+    static NAN_METHOD(packMmap);
     static NAN_METHOD(list);
     static NAN_METHOD(_get);
     static NAN_METHOD(_getmatching);
+    static NAN_METHOD(_getGrids);
+    static NAN_METHOD(_getmatchingGrids);
+    static NAN_METHOD(getMatchingMany);
     static NAN_METHOD(_set);
+    static NAN_METHOD(loadFile);
+    static NAN_METHOD(freeze);
+    static NAN_METHOD(decodedCacheStats);
     explicit JSCache();
     void _ref() { Ref(); }
     void _unref() { Unref(); }
+    // whether async work holding a _ref() might still be reading the cache
+    bool _busy() const { return refs_ > 0; }
 
     T cache;
 };
@@ -52,38 +63,119 @@ template <>
 NAN_METHOD(JSCache<carmen::RocksDBCache>::New);
 template <>
 NAN_METHOD(JSCache<carmen::MemoryCache>::New);
+template <>
+NAN_METHOD(JSCache<carmen::MmapCache>::New);
 
 template <>
 NAN_METHOD(JSCache<carmen::MemoryCache>::_set);
+template <>
+NAN_METHOD(JSCache<carmen::MemoryCache>::loadFile);
+template <>
+NAN_METHOD(JSCache<carmen::MemoryCache>::freeze);
+template <>
+NAN_METHOD(JSCache<carmen::RocksDBCache>::decodedCacheStats);
 
 using JSRocksDBCache = JSCache<carmen::RocksDBCache>;
 using JSMemoryCache = JSCache<carmen::MemoryCache>;
+using JSMmapCache = JSCache<carmen::MmapCache>;
 
 template <class T>
 intarray __get(JSCache<T>* c, const std::string& phrase, langfield_type langfield, size_t max_results);
 template <class T>
 intarray __getmatching(JSCache<T>* c, const std::string& phrase, bool match_prefixes, langfield_type langfield, size_t max_results);
 
+enum class CacheLookup {
+    get,
+    getGrids,
+    getmatching,
+    getmatchingGrids,
+    getmatchingMany
+};
+
+// a cache lookup running on the worker pool
+template <class T>
+struct CacheLookupBaton : carmen::noncopyable {
+    uv_work_t request;
+    // params
+    JSCache<T>* cache;
+    CacheLookup lookup;
+    // get and getGrids queries only use phrase and langfield
+    std::vector<MatchingQuery> queries;
+    Nan::Persistent<v8::Function> callback;
+    // return, one per query
+    std::vector<intarray> results;
+    // error
+    std::string error;
+};
+
+// What coalesce and coalesceBatch return: cancel() stops the job early, with a
+// "coalesce cancelled" error, if it hasn't finished yet.
+class JSCoalesceHandle : public node::ObjectWrap {
+  public:
+    static Nan::Persistent<v8::Function> constructor;
+    static void Initialize();
+    static NAN_METHOD(New);
+    static NAN_METHOD(cancel);
+    // a new handle that cancels through interrupt
+    static Local<Object> wrap(std::shared_ptr<Interrupt> const& interrupt);
+
+    std::shared_ptr<Interrupt> interrupt;
+};
+
 struct CoalesceBaton : carmen::noncopyable {
     uv_work_t request;
     // params
     std::vector<PhrasematchSubq> stack;
-    std::vector<uint64_t> centerzxy;
-    std::vector<uint64_t> bboxzxy;
-    double radius;
+    CoalesceOptions options;
     Nan::Persistent<v8::Function> callback;
     // ref tracking
     std::vector<std::pair<char, void*>> refs;
+    // return contexts packed by packContexts, rather than as objects
+    bool packed = false;
     // return
     std::vector<Context> features;
+    std::string packed_features;
+    // error
+    std::string error;
+};
+
+struct CoalesceBatchBaton : carmen::noncopyable {
+    uv_work_t request;
+    // params
+    std::vector<std::vector<PhrasematchSubq>> stacks;
+    CoalesceOptions options;
+    Nan::Persistent<v8::Function> callback;
+    // ref tracking
+    std::vector<std::pair<char, void*>> refs;
+    // see CoalesceBaton
+    bool packed = false;
+    // return
+    std::vector<std::vector<Context>> results;
+    std::vector<std::string> packed_results;
     // error
     std::string error;
 };
 
+NAN_METHOD(JSConfigureBlockCache);
+NAN_METHOD(JSBlockCacheStats);
+NAN_METHOD(JSConfigureWorkerPool);
+NAN_METHOD(JSWorkerPoolStats);
+NAN_METHOD(JSConfigureAdmission);
+NAN_METHOD(JSAdmissionStats);
+
 NAN_METHOD(JSCoalesce);
 void jsCoalesceTask(uv_work_t* req);
 void jsCoalesceAfter(uv_work_t* req, int status);
 
+void jsToPhrasematchStack(Local<Array> const& array, std::vector<PhrasematchSubq>& stack, std::vector<std::pair<char, void*>>& refs);
+void jsToCoalesceOptions(Local<Object> const& options, CoalesceOptions& out);
+size_t jsToCoalesceLane(Local<Object> const& options);
+void unrefCaches(std::vector<std::pair<char, void*>> const& refs);
+
+NAN_METHOD(JSCoalesceBatch);
+void jsCoalesceBatchTask(uv_work_t* req);
+void jsCoalesceBatchAfter(uv_work_t* req, int status);
+
 } // namespace carmen
 
 #endif // __CARMEN_BINDING_HPP__
@@ -0,0 +1,377 @@
+#include "block_codec.hpp"
+#include "cpp_util.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+// The SIMD kernels are compiled with per-function target attributes rather than
+// global -mavx2/-msse4.2 flags, so the same binary runs everywhere and picks
+// the best kernels for the CPU it finds itself on at runtime.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CARMEN_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace carmen {
+
+namespace {
+
+inline uint64_t load64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline void store64(uint8_t* p, uint64_t value) {
+    memcpy(p, &value, sizeof(value));
+}
+
+inline uint64_t widthMask(unsigned width) {
+    return width >= 64 ? ~static_cast<uint64_t>(0) : (static_cast<uint64_t>(1) << width) - 1;
+}
+
+inline size_t packedBytes(unsigned width, size_t n) {
+    return (n * width + 7) / 8;
+}
+
+inline bool inBbox(uint64_t grid, const uint64_t box[4]) {
+    uint64_t x = grid & X_MASK;
+    uint64_t y = grid & Y_MASK;
+    return (x >= box[0] && x <= box[2] && y >= box[1] && y <= box[3]);
+}
+
+// scalar kernels; these also finish off whatever the SIMD kernels leave over
+// at the end of a block
+
+inline uint64_t unpackOne(const uint8_t* packed, unsigned width, size_t i, uint64_t base) {
+    if (width == 64) return base - load64(packed + i * 8);
+    size_t bit = i * width;
+    return base - ((load64(packed + (bit >> 3)) >> (bit & 7)) & widthMask(width));
+}
+
+void unpackScalar(const uint8_t* packed, unsigned width, size_t start, size_t n, uint64_t base, uint64_t* out) {
+    for (size_t i = start; i < n; i++) {
+        out[i] = unpackOne(packed, width, i, base);
+    }
+}
+
+void unpackScalarKernel(const uint8_t* packed, unsigned width, size_t n, uint64_t base, uint64_t* out) {
+    unpackScalar(packed, width, 0, n, base, out);
+}
+
+size_t unpackInBboxScalarKernel(const uint8_t* packed, unsigned width, size_t n, uint64_t base, const uint64_t box[4], uint64_t* out) {
+    uint64_t grids[GRID_BLOCK_SIZE];
+    unpackScalar(packed, width, 0, n, base, grids);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (inBbox(grids[i], box)) out[count++] = grids[i];
+    }
+    return count;
+}
+
+#ifdef CARMEN_X86_KERNELS
+
+// AVX2 kernels: four grids at a time. Each lane gathers the 8 bytes holding its
+// offset, shifts it down with a per-lane variable shift, masks it and
+// subtracts it from the block base.
+
+__attribute__((target("avx2"))) inline __m256i unpackFourAvx2(const uint8_t* packed, __m256i bits, __m256i seven, __m256i mask, __m256i base) {
+    __m256i bytes = _mm256_srli_epi64(bits, 3);
+    __m256i words = _mm256_i64gather_epi64(reinterpret_cast<const long long*>(packed), bytes, 1);
+    __m256i offsets = _mm256_and_si256(_mm256_srlv_epi64(words, _mm256_and_si256(bits, seven)), mask);
+    return _mm256_sub_epi64(base, offsets);
+}
+
+__attribute__((target("avx2"))) inline int bboxLanesAvx2(__m256i grids, __m256i xmask, __m256i ymask, const __m256i box[4]) {
+    __m256i x = _mm256_and_si256(grids, xmask);
+    __m256i y = _mm256_and_si256(grids, ymask);
+    // the masked coordinates are well under 2^63, so signed compares are safe
+    __m256i outside = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpgt_epi64(box[0], x), _mm256_cmpgt_epi64(x, box[2])),
+        _mm256_or_si256(_mm256_cmpgt_epi64(box[1], y), _mm256_cmpgt_epi64(y, box[3])));
+    return ~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xF;
+}
+
+__attribute__((target("avx2"))) void unpackAvx2Kernel(const uint8_t* packed, unsigned width, size_t n, uint64_t base, uint64_t* out) {
+    size_t i = 0;
+    const __m256i vbase = _mm256_set1_epi64x(static_cast<long long>(base));
+    if (width == 64) {
+        for (; i + 4 <= n; i += 4) {
+            __m256i offsets = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(packed + i * 8));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_sub_epi64(vbase, offsets));
+        }
+    } else if (width > 0) {
+        const __m256i seven = _mm256_set1_epi64x(7);
+        const __m256i mask = _mm256_set1_epi64x(static_cast<long long>(widthMask(width)));
+        const __m256i step = _mm256_set1_epi64x(static_cast<long long>(4 * width));
+        __m256i bits = _mm256_set_epi64x(static_cast<long long>(3 * width), static_cast<long long>(2 * width), static_cast<long long>(width), 0);
+        for (; i + 4 <= n; i += 4) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), unpackFourAvx2(packed, bits, seven, mask, vbase));
+            bits = _mm256_add_epi64(bits, step);
+        }
+    }
+    unpackScalar(packed, width, i, n, base, out);
+}
+
+__attribute__((target("avx2"))) size_t unpackInBboxAvx2Kernel(const uint8_t* packed, unsigned width, size_t n, uint64_t base, const uint64_t box[4], uint64_t* out) {
+    if (width == 64) {
+        // there's no gather to fuse with here, so unpack and filter separately
+        uint64_t grids[GRID_BLOCK_SIZE];
+        unpackAvx2Kernel(packed, width, n, base, grids);
+        size_t count = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (inBbox(grids[i], box)) out[count++] = grids[i];
+        }
+        return count;
+    }
+
+    const __m256i vbox[4] = {
+        _mm256_set1_epi64x(static_cast<long long>(box[0])),
+        _mm256_set1_epi64x(static_cast<long long>(box[1])),
+        _mm256_set1_epi64x(static_cast<long long>(box[2])),
+        _mm256_set1_epi64x(static_cast<long long>(box[3]))};
+    const __m256i xmask = _mm256_set1_epi64x(static_cast<long long>(X_MASK));
+    const __m256i ymask = _mm256_set1_epi64x(static_cast<long long>(Y_MASK));
+    const __m256i vbase = _mm256_set1_epi64x(static_cast<long long>(base));
+    const __m256i seven = _mm256_set1_epi64x(7);
+    const __m256i mask = _mm256_set1_epi64x(static_cast<long long>(widthMask(width)));
+    const __m256i step = _mm256_set1_epi64x(static_cast<long long>(4 * width));
+    __m256i bits = _mm256_set_epi64x(static_cast<long long>(3 * width), static_cast<long long>(2 * width), static_cast<long long>(width), 0);
+
+    size_t count = 0;
+    size_t i = 0;
+    alignas(32) uint64_t lanes[4];
+    for (; i + 4 <= n; i += 4) {
+        __m256i grids = unpackFourAvx2(packed, bits, seven, mask, vbase);
+        bits = _mm256_add_epi64(bits, step);
+
+        int keep = bboxLanesAvx2(grids, xmask, ymask, vbox);
+        if (keep == 0) continue;
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), grids);
+        for (int lane = 0; lane < 4; lane++) {
+            if ((keep >> lane) & 1) out[count++] = lanes[lane];
+        }
+    }
+
+    for (; i < n; i++) {
+        uint64_t grid = unpackOne(packed, width, i, base);
+        if (inBbox(grid, box)) out[count++] = grid;
+    }
+    return count;
+}
+
+// SSE4.2 kernels: two grids at a time. SSE has no per-lane variable shift, so
+// both lanes are shifted by each lane's count and blended back together; the
+// bbox test uses the 64-bit compare that SSE4.2 adds.
+
+__attribute__((target("sse4.2"))) inline __m128i unpackTwoSse42(const uint8_t* packed, size_t bit, unsigned width, __m128i mask, __m128i base) {
+    size_t bit_hi = bit + width;
+    __m128i words = _mm_set_epi64x(
+        static_cast<long long>(load64(packed + (bit_hi >> 3))),
+        static_cast<long long>(load64(packed + (bit >> 3))));
+    __m128i lo = _mm_srl_epi64(words, _mm_cvtsi32_si128(static_cast<int>(bit & 7)));
+    __m128i hi = _mm_srl_epi64(words, _mm_cvtsi32_si128(static_cast<int>(bit_hi & 7)));
+    __m128i offsets = _mm_and_si128(_mm_blend_epi16(lo, hi, 0xF0), mask);
+    return _mm_sub_epi64(base, offsets);
+}
+
+__attribute__((target("sse4.2"))) void unpackSse42Kernel(const uint8_t* packed, unsigned width, size_t n, uint64_t base, uint64_t* out) {
+    size_t i = 0;
+    const __m128i vbase = _mm_set1_epi64x(static_cast<long long>(base));
+    if (width == 64) {
+        for (; i + 2 <= n; i += 2) {
+            __m128i offsets = _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + i * 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi64(vbase, offsets));
+        }
+    } else if (width > 0) {
+        const __m128i mask = _mm_set1_epi64x(static_cast<long long>(widthMask(width)));
+        for (; i + 2 <= n; i += 2) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), unpackTwoSse42(packed, i * width, width, mask, vbase));
+        }
+    }
+    unpackScalar(packed, width, i, n, base, out);
+}
+
+__attribute__((target("sse4.2"))) size_t unpackInBboxSse42Kernel(const uint8_t* packed, unsigned width, size_t n, uint64_t base, const uint64_t box[4], uint64_t* out) {
+    uint64_t grids[GRID_BLOCK_SIZE];
+    unpackSse42Kernel(packed, width, n, base, grids);
+
+    const __m128i min_x = _mm_set1_epi64x(static_cast<long long>(box[0]));
+    const __m128i min_y = _mm_set1_epi64x(static_cast<long long>(box[1]));
+    const __m128i max_x = _mm_set1_epi64x(static_cast<long long>(box[2]));
+    const __m128i max_y = _mm_set1_epi64x(static_cast<long long>(box[3]));
+    const __m128i xmask = _mm_set1_epi64x(static_cast<long long>(X_MASK));
+    const __m128i ymask = _mm_set1_epi64x(static_cast<long long>(Y_MASK));
+
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(grids + i));
+        __m128i x = _mm_and_si128(v, xmask);
+        __m128i y = _mm_and_si128(v, ymask);
+        __m128i outside = _mm_or_si128(
+            _mm_or_si128(_mm_cmpgt_epi64(min_x, x), _mm_cmpgt_epi64(x, max_x)),
+            _mm_or_si128(_mm_cmpgt_epi64(min_y, y), _mm_cmpgt_epi64(y, max_y)));
+        int keep = ~_mm_movemask_pd(_mm_castsi128_pd(outside)) & 0x3;
+        if (keep & 1) out[count++] = grids[i];
+        if (keep & 2) out[count++] = grids[i + 1];
+    }
+    if (i < n && inBbox(grids[i], box)) out[count++] = grids[i];
+    return count;
+}
+
+#endif // CARMEN_X86_KERNELS
+
+struct GridBlockKernels {
+    const char* name;
+    void (*unpack)(const uint8_t* packed, unsigned width, size_t n, uint64_t base, uint64_t* out);
+    size_t (*unpackInBbox)(const uint8_t* packed, unsigned width, size_t n, uint64_t base, const uint64_t box[4], uint64_t* out);
+};
+
+// CARMEN_CACHE_GRID_KERNEL can be set to "scalar" or "sse4.2" to force a
+// less capable kernel than the CPU supports, which is mostly useful for
+// checking that all of them produce the same results
+GridBlockKernels chooseKernels() {
+    GridBlockKernels scalar{"scalar", unpackScalarKernel, unpackInBboxScalarKernel};
+    const char* forced = getenv("CARMEN_CACHE_GRID_KERNEL");
+    std::string limit = forced == nullptr ? "" : forced;
+    if (limit == "scalar") return scalar;
+
+#ifdef CARMEN_X86_KERNELS
+    __builtin_cpu_init();
+    if (limit != "sse4.2" && __builtin_cpu_supports("avx2")) {
+        return {"avx2", unpackAvx2Kernel, unpackInBboxAvx2Kernel};
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return {"sse4.2", unpackSse42Kernel, unpackInBboxSse42Kernel};
+    }
+#endif
+
+    return scalar;
+}
+
+GridBlockKernels const& kernels() {
+    static const GridBlockKernels chosen = chooseKernels();
+    return chosen;
+}
+
+} // namespace
+
+const char* gridBlockKernel() {
+    return kernels().name;
+}
+
+void encodeGridBlocks(std::vector<uint64_t> const& grids, std::string& out) {
+    if (grids.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::invalid_argument("too many grids to block-encode");
+    }
+    auto count = static_cast<uint32_t>(grids.size());
+
+    out.push_back(static_cast<char>(GRID_BLOCK_VERSION));
+    out.append(reinterpret_cast<const char*>(&count), sizeof(count));
+
+    std::vector<uint8_t> packed;
+    for (size_t start = 0; start < grids.size(); start += GRID_BLOCK_SIZE) {
+        size_t n = std::min(GRID_BLOCK_SIZE, grids.size() - start);
+        auto first = grids.begin() + static_cast<std::ptrdiff_t>(start);
+        auto last = first + static_cast<std::ptrdiff_t>(n);
+
+        // grids are normally sorted in descending order, in which case the
+        // base is just the first grid, but don't rely on it
+        uint64_t base = *std::max_element(first, last);
+        uint64_t spread = base - *std::min_element(first, last);
+        unsigned width = spread == 0 ? 0 : static_cast<unsigned>(64 - __builtin_clzll(spread));
+        // a single unaligned 8-byte load can't hold an offset wider than 56 bits
+        // at an arbitrary bit position, so store those blocks unpacked
+        if (width > 56) width = 64;
+
+        out.append(reinterpret_cast<const char*>(&base), sizeof(base));
+        out.push_back(static_cast<char>(width));
+
+        if (width == 64) {
+            for (auto it = first; it != last; ++it) {
+                uint64_t offset = base - *it;
+                out.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
+            }
+        } else if (width > 0) {
+            size_t bytes = packedBytes(width, n);
+            packed.assign(bytes + sizeof(uint64_t), 0);
+            size_t bit = 0;
+            for (auto it = first; it != last; ++it, bit += width) {
+                uint8_t* p = packed.data() + (bit >> 3);
+                store64(p, load64(p) | ((base - *it) << (bit & 7)));
+            }
+            out.append(reinterpret_cast<const char*>(packed.data()), bytes);
+        }
+    }
+
+    out.append(GRID_BLOCK_PADDING, '\0');
+}
+
+GridBlockReader::GridBlockReader()
+    : data_(nullptr),
+      end_(nullptr),
+      remaining_(0) {}
+
+GridBlockReader::GridBlockReader(const char* data, size_t size)
+    : GridBlockReader() {
+    if (size < 1 + sizeof(uint32_t) + GRID_BLOCK_PADDING) {
+        throw std::invalid_argument("corrupt grid block message");
+    }
+    const auto* bytes = reinterpret_cast<const uint8_t*>(data);
+    if (bytes[0] != GRID_BLOCK_VERSION) {
+        throw std::invalid_argument("unsupported grid block version");
+    }
+    uint32_t count;
+    memcpy(&count, bytes + 1, sizeof(count));
+
+    remaining_ = count;
+    data_ = bytes + 1 + sizeof(uint32_t);
+    end_ = bytes + size - GRID_BLOCK_PADDING;
+}
+
+// checks that the next block lies within the payload, and returns a pointer to
+// its packed offsets
+const uint8_t* GridBlockReader::readBlockHeader(uint64_t& base, unsigned& width, size_t& n) {
+    n = std::min(GRID_BLOCK_SIZE, remaining_);
+    if (static_cast<size_t>(end_ - data_) < sizeof(uint64_t) + 1) {
+        throw std::invalid_argument("corrupt grid block message");
+    }
+    base = load64(data_);
+    width = data_[sizeof(uint64_t)];
+    if (width > 56 && width != 64) {
+        throw std::invalid_argument("corrupt grid block message");
+    }
+
+    const uint8_t* packed = data_ + sizeof(uint64_t) + 1;
+    size_t bytes = width == 64 ? n * sizeof(uint64_t) : packedBytes(width, n);
+    if (static_cast<size_t>(end_ - packed) < bytes) {
+        throw std::invalid_argument("corrupt grid block message");
+    }
+
+    data_ = packed + bytes;
+    remaining_ -= n;
+    return packed;
+}
+
+size_t GridBlockReader::next(uint64_t* out) {
+    if (remaining_ == 0) return 0;
+    uint64_t base;
+    unsigned width;
+    size_t n;
+    const uint8_t* packed = readBlockHeader(base, width, n);
+    kernels().unpack(packed, width, n, base, out);
+    return n;
+}
+
+size_t GridBlockReader::nextInBbox(uint64_t* out, const uint64_t box[4]) {
+    if (remaining_ == 0) return 0;
+    uint64_t base;
+    unsigned width;
+    size_t n;
+    const uint8_t* packed = readBlockHeader(base, width, n);
+    return kernels().unpackInBbox(packed, width, n, base, box, out);
+}
+
+} // namespace carmen
@@ -0,0 +1,68 @@
+#ifndef __CARMEN_BLOCK_CODEC_HPP__
+#define __CARMEN_BLOCK_CODEC_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace carmen {
+
+// The block encoding is an alternative to the packed varint delta lists used
+// for grid messages. Decoding a varint list is a serial chain (each value
+// depends on the length and value of the one before it), whereas every value
+// in a block can be decoded independently, which lets the decoder use SIMD.
+//
+// A block payload is laid out as:
+//
+//   version         uint8_t, currently GRID_BLOCK_VERSION
+//   count           uint32_t, the total number of grids in all blocks
+//   blocks          ceil(count / GRID_BLOCK_SIZE) blocks, each holding:
+//     base          uint64_t, the largest grid in the block
+//     width         uint8_t, bits per packed offset (0-56, or 64)
+//     offsets       base - grid for each grid in the block, in order, packed
+//                   LSB-first into ceil(n * width / 8) bytes
+//   padding         GRID_BLOCK_PADDING zero bytes
+//
+// All integers are little-endian. The trailing padding means any packed offset
+// can be read with a single unaligned 8-byte load without running past the
+// end of the payload.
+constexpr uint8_t GRID_BLOCK_VERSION = 1;
+constexpr size_t GRID_BLOCK_SIZE = 128;
+constexpr size_t GRID_BLOCK_PADDING = 8;
+
+// appends the block payload for a list of grids to out; the grids should be
+// sorted in descending order (as they are everywhere else) and deduplicated
+void encodeGridBlocks(std::vector<uint64_t> const& grids, std::string& out);
+
+// reads the blocks of a payload one at a time
+class GridBlockReader {
+  public:
+    GridBlockReader();
+    GridBlockReader(const char* data, size_t size);
+
+    // the number of grids left in the blocks that haven't been read yet
+    size_t remaining() const { return remaining_; }
+
+    // decodes the next block into out, which must have room for GRID_BLOCK_SIZE
+    // grids, and returns the number of grids written
+    size_t next(uint64_t* out);
+
+    // as above, but only writes the grids whose x and y fall inside box; see
+    // decodeAndBboxFilter for the format of the box
+    size_t nextInBbox(uint64_t* out, const uint64_t box[4]);
+
+  private:
+    const uint8_t* readBlockHeader(uint64_t& base, unsigned& width, size_t& n);
+
+    const uint8_t* data_;
+    const uint8_t* end_;
+    size_t remaining_;
+};
+
+// the name of the kernels chosen for this CPU: "avx2", "sse4.2" or "scalar"
+const char* gridBlockKernel();
+
+} // namespace carmen
+
+#endif // __CARMEN_BLOCK_CODEC_HPP__
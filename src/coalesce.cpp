@@ -1,45 +1,226 @@
 
 #include "coalesce.hpp"
+#include "flat_hash_map.hpp"
 #include "memorycache.hpp"
+#include "mmapcache.hpp"
 #include "rocksdbcache.hpp"
+#include "task_pool.hpp"
 
 namespace carmen {
 
-std::vector<Context> coalesce(std::vector<PhrasematchSubq>& stack, const std::vector<uint64_t>& centerzxy, const std::vector<uint64_t>& bboxzxy, double radius) {
-    std::vector<Context> contexts;
-    if (stack.size() == 1) {
-        contexts = coalesceSingle(stack, centerzxy, bboxzxy, radius);
-    } else {
-        contexts = coalesceMulti(stack, centerzxy, bboxzxy, radius);
+// with options.parallelism, grids are read in chunks of this many, and each
+// chunk split into partitions of this many for the threads to share
+constexpr size_t PARALLEL_CHUNK_GRIDS = 16384;
+constexpr size_t PARALLEL_PARTITION_GRIDS = 1024;
+
+// load the grids for a subquery from whichever kind of cache it refers to
+inline intarray getmatchingForSubq(PhrasematchSubq const& subq, size_t max_results, Interrupt const* interrupt) {
+    switch (subq.type) {
+        case TYPE_MEMORY:
+            return reinterpret_cast<MemoryCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results, interrupt);
+        case TYPE_MMAP:
+            return reinterpret_cast<MmapCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results, interrupt);
+        default:
+            return reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results, interrupt);
+    }
+}
+
+// as above, but as a cursor, so grids are only decoded as they're used
+inline std::unique_ptr<GridCursor> getmatchingCursorForSubq(PhrasematchSubq const& subq, size_t max_results) {
+    switch (subq.type) {
+        case TYPE_MEMORY:
+            return reinterpret_cast<MemoryCache*>(subq.cache)->__getmatchingCursor(subq.phrase, subq.prefix, subq.langfield, max_results);
+        case TYPE_MMAP:
+            return reinterpret_cast<MmapCache*>(subq.cache)->__getmatchingCursor(subq.phrase, subq.prefix, subq.langfield, max_results);
+        default:
+            return reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatchingCursor(subq.phrase, subq.prefix, subq.langfield, max_results);
+    }
+}
+
+// like getmatchingForSubq, but only returns grids inside the supplied bbox (see
+// RocksDBCache::__getmatchingBboxFiltered for the box format); the
+// MemoryCache has no filtered variant, so its callers filter afterwards
+inline intarray getmatchingBboxFilteredForSubq(PhrasematchSubq const& subq, size_t max_results, const uint64_t box[4], Interrupt const* interrupt) {
+    switch (subq.type) {
+        case TYPE_MEMORY:
+            return reinterpret_cast<MemoryCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results, interrupt);
+        case TYPE_MMAP:
+            return reinterpret_cast<MmapCache*>(subq.cache)->__getmatchingBboxFiltered(subq.phrase, subq.prefix, subq.langfield, max_results, box, interrupt);
+        default:
+            return reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatchingBboxFiltered(subq.phrase, subq.prefix, subq.langfield, max_results, box, interrupt);
+    }
+}
+
+// reads a shared array of grids in order
+class ArrayGridCursor : public GridCursor {
+  public:
+    explicit ArrayGridCursor(intarray const& _grids)
+        : grids(_grids),
+          pos(0),
+          unboosted(std::any_of(grids.begin(), grids.end(), [](uint64_t grid) {
+              return (grid & LANGUAGE_MATCH_BOOST) == 0u;
+          })) {}
+
+    bool next(uint64_t& grid) override {
+        if (pos == grids.size()) return false;
+        grid = grids[pos++];
+        return true;
+    }
+
+    bool mayProduceUnboosted() const override { return unboosted; }
+
+  private:
+    intarray const& grids;
+    size_t pos;
+    bool unboosted;
+};
+
+SubqGrids::SubqGrids(bool _shared, Interrupt const* _interrupt)
+    : shared(_shared),
+      interrupt(_interrupt),
+      scratch(),
+      grids() {}
+
+intarray const& SubqGrids::matching(PhrasematchSubq const& subq, size_t max_results) {
+    if (!shared) {
+        scratch = getmatchingForSubq(subq, max_results, interrupt);
+        return scratch;
+    }
+    auto inserted = grids.emplace(key_type(subq.cache, subq.phrase, subq.prefix, subq.langfield, max_results, false), intarray());
+    if (inserted.second) inserted.first->second = getmatchingForSubq(subq, max_results, interrupt);
+    return inserted.first->second;
+}
+
+// every subquery in a batch is filtered by the same box, so it isn't part of
+// the key
+intarray const& SubqGrids::matchingBboxFiltered(PhrasematchSubq const& subq, size_t max_results, const uint64_t box[4]) {
+    if (!shared) {
+        scratch = getmatchingBboxFilteredForSubq(subq, max_results, box, interrupt);
+        return scratch;
     }
+    auto inserted = grids.emplace(key_type(subq.cache, subq.phrase, subq.prefix, subq.langfield, max_results, true), intarray());
+    if (inserted.second) inserted.first->second = getmatchingBboxFilteredForSubq(subq, max_results, box, interrupt);
+    return inserted.first->second;
+}
+
+// unshared reads stay lazy; shared ones are decoded in full the first time,
+// since other stacks may read further
+std::unique_ptr<GridCursor> SubqGrids::cursor(PhrasematchSubq const& subq, size_t max_results) {
+    if (!shared) return getmatchingCursorForSubq(subq, max_results);
+    return std::unique_ptr<GridCursor>(new ArrayGridCursor(matching(subq, max_results)));
+}
 
+// Picks the contexts coalesce returns out of a list sorted by relev: at most
+// 40 of them, none 0.25 or more less relevant than the first, and only the
+// first context for each feature. relev(i) and first(i) return the relev and
+// first cover of the i-th context, and take(i) is called for each one picked.
+template <typename Relev, typename First, typename Take>
+void selectContexts(size_t count, Relev&& relev, First&& first, Take&& take) {
+    if (count == 0) return;
+
+    // Coalesce stack, generate relevs.
+    double relevMax = relev(0);
+    std::size_t total = 0;
+    // only the keys matter; the values are unused
+    FlatHashMap<char> sets;
+    std::size_t max_contexts = 40;
+    for (size_t i = 0; i < count; i++) {
+        // Maximum allowance of coalesced features: 40.
+        if (total >= max_contexts) break;
+
+        // Since `coalesced` is sorted by relev desc at first
+        // threshold miss we can break the loop.
+        if (relevMax - relev(i) >= 0.25) break;
+
+        // Only collect each feature once.
+        uint32_t id = first(i).tmpid;
+        if (!sets.emplace(id).second) continue;
+
+        take(i);
+        total++;
+    }
+}
+
+// coalesces one stack, reading its grids from source
+inline std::vector<Context> coalesceStack(std::vector<PhrasematchSubq>& stack, CoalesceOptions const& options, SubqGrids& source) {
+    if (stack.size() > 1) {
+        return coalesceMulti(stack, options, source);
+    }
+
+    std::vector<Context> contexts = coalesceSingle(stack, options, source);
     std::vector<Context> out;
-    if (!contexts.empty()) {
-        // Coalesce stack, generate relevs.
-        double relevMax = contexts[0].relev;
-        std::size_t total = 0;
-        std::map<uint64_t, bool> sets;
-        std::map<uint64_t, bool>::iterator sit;
-        std::size_t max_contexts = 40;
-        out.reserve(max_contexts);
-        for (auto&& context : contexts) {
-            // Maximum allowance of coalesced features: 40.
-            if (total >= max_contexts) break;
-
-            // Since `coalesced` is sorted by relev desc at first
-            // threshold miss we can break the loop.
-            if (relevMax - context.relev >= 0.25) break;
-
-            // Only collect each feature once.
-            uint32_t id = context.coverList[0].tmpid;
-            sit = sets.find(id);
-            if (sit != sets.end()) continue;
-
-            sets.emplace(id, true);
-            out.emplace_back(std::move(context));
-            total++;
+    out.reserve(std::min(contexts.size(), static_cast<size_t>(40)));
+    selectContexts(
+        contexts.size(),
+        [&contexts](size_t i) { return contexts[i].relev; },
+        [&contexts](size_t i) -> Cover const& { return contexts[i].coverList[0]; },
+        [&contexts, &out](size_t i) { out.emplace_back(std::move(contexts[i])); });
+    return out;
+}
+
+std::vector<Context> coalesce(std::vector<PhrasematchSubq>& stack, CoalesceOptions const& options) {
+    // it may have been cancelled, or run out of time, while it was queued
+    if (options.interrupt) options.interrupt->check();
+    SubqGrids source(false, options.interrupt.get());
+    return coalesceStack(stack, options, source);
+}
+
+// Coalesces every stack in turn, in one job. Stacks built for the same query
+// tend to share subqueries, so their grids are read and decoded once, for the
+// first stack that has them, and shared read-only with the rest.
+std::vector<std::vector<Context>> coalesceBatch(std::vector<std::vector<PhrasematchSubq>>& stacks, CoalesceOptions const& options) {
+    SubqGrids source(true, options.interrupt.get());
+    std::vector<std::vector<Context>> results;
+    results.reserve(stacks.size());
+    for (auto& stack : stacks) {
+        if (options.interrupt) options.interrupt->check();
+        results.push_back(coalesceStack(stack, options, source));
+    }
+    return results;
+}
+
+// appends the field of every cover to out, padded to a multiple of 8 bytes
+template <typename T, typename Field>
+void packCoverField(std::vector<Context> const& contexts, std::string& out, Field&& field) {
+    for (Context const& context : contexts) {
+        for (Cover const& cover : context.coverList) {
+            T value = field(cover);
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
         }
     }
+    out.resize((out.size() + 7) & ~static_cast<size_t>(7), '\0');
+}
+
+std::string packContexts(std::vector<Context> const& contexts) {
+    std::vector<uint32_t> offsets{0};
+    offsets.reserve(contexts.size() + 1);
+    for (Context const& context : contexts) {
+        offsets.push_back(offsets.back() + static_cast<uint32_t>(context.coverList.size()));
+    }
+    size_t covers = offsets.back();
+
+    std::string out;
+    // every field's array rounded up to 8 bytes
+    out.reserve(8 + contexts.size() * 12 + 16 + covers * (3 * 8 + 2 * 4 + 4 * 2 + 1) + 8 * 10);
+    uint32_t counts[2] = {static_cast<uint32_t>(contexts.size()), static_cast<uint32_t>(covers)};
+    out.append(reinterpret_cast<const char*>(counts), sizeof(counts));
+
+    for (Context const& context : contexts) {
+        out.append(reinterpret_cast<const char*>(&context.relev), sizeof(context.relev));
+    }
+    out.append(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint32_t));
+    out.resize((out.size() + 7) & ~static_cast<size_t>(7), '\0');
+
+    packCoverField<double>(contexts, out, [](Cover const& cover) { return cover.relev; });
+    packCoverField<double>(contexts, out, [](Cover const& cover) { return cover.distance; });
+    packCoverField<double>(contexts, out, [](Cover const& cover) { return cover.scoredist; });
+    packCoverField<uint32_t>(contexts, out, [](Cover const& cover) { return cover.id; });
+    packCoverField<uint32_t>(contexts, out, [](Cover const& cover) { return cover.tmpid; });
+    packCoverField<uint16_t>(contexts, out, [](Cover const& cover) { return cover.x; });
+    packCoverField<uint16_t>(contexts, out, [](Cover const& cover) { return cover.y; });
+    packCoverField<uint16_t>(contexts, out, [](Cover const& cover) { return cover.score; });
+    packCoverField<uint16_t>(contexts, out, [](Cover const& cover) { return cover.idx; });
+    packCoverField<uint8_t>(contexts, out, [](Cover const& cover) { return static_cast<uint8_t>(cover.matches_language ? 1 : 0); });
     return out;
 }
 
@@ -47,8 +228,11 @@ std::vector<Context> coalesce(std::vector<PhrasematchSubq>& stack, const std::ve
 // it's actually trying to stack multiple matches or whether it's considering a
 // single match that consumes the entire query; this function handles the latter case
 // and takes as a parameter the libuv task that contains info about the job it's supposed to do
-inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack, const std::vector<uint64_t>& centerzxy, const std::vector<uint64_t>& bboxzxy, double radius) {
+inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack, CoalesceOptions const& options, SubqGrids& source) {
     PhrasematchSubq const& subq = stack[0];
+    std::vector<uint64_t> const& centerzxy = options.centerzxy;
+    std::vector<uint64_t> const& bboxzxy = options.bboxzxy;
+    double radius = options.radius;
 
     // proximity (optional)
     bool proximity = !centerzxy.empty();
@@ -84,45 +268,31 @@ inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack,
     }
 
     // Load and concatenate grids for all ids in `phrases`
-    intarray grids;
     size_t max_results = subq.extended_scan ? std::numeric_limits<size_t>::max() : PREFIX_MAX_GRID_LENGTH;
-    if (subq.type == TYPE_MEMORY) {
-        grids = reinterpret_cast<MemoryCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results);
-    } else {
-        if (subq.extended_scan && bbox) {
-            uint64_t inplace_bbox[4] = {
-                static_cast<uint64_t>((minx & POW2_14M1) << 20),
-                static_cast<uint64_t>((miny & POW2_14M1) << 34),
-                static_cast<uint64_t>((maxx & POW2_14M1) << 20),
-                static_cast<uint64_t>((maxy & POW2_14M1) << 34)};
-            grids = reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatchingBboxFiltered(subq.phrase, subq.prefix, subq.langfield, max_results, inplace_bbox);
-        } else {
-            grids = reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, max_results);
-        }
-    }
+    uint64_t inplace_bbox[4] = {
+        static_cast<uint64_t>((minx & POW2_14M1) << 20),
+        static_cast<uint64_t>((miny & POW2_14M1) << 34),
+        static_cast<uint64_t>((maxx & POW2_14M1) << 20),
+        static_cast<uint64_t>((maxy & POW2_14M1) << 34)};
+    intarray const& grids = (subq.extended_scan && bbox) ? source.matchingBboxFiltered(subq, max_results, inplace_bbox) : source.matching(subq, max_results);
 
-    unsigned long m = grids.size();
     double relevMax = 0;
     std::vector<Cover> covers;
 
-    uint32_t length = 0;
-    uint32_t lastId = 0;
-    double lastRelev = 0;
-    double lastScoredist = 0;
-    double lastDistance = 0;
-    double minScoredist = std::numeric_limits<double>::max();
-    for (unsigned long j = 0; j < m; j++) {
-        Cover cover = numToCover(grids[j]);
+    // fills in cover for a grid, or returns false if it's outside the bbox;
+    // last is the cover scored before it, if any, whose distance is reused
+    // if it's in the same tile
+    auto score = [&](uint64_t grid, Cover& cover, Cover const* last) {
+        cover = numToCover(grid);
 
         if (bbox) {
-            if (cover.x < minx || cover.y < miny || cover.x > maxx || cover.y > maxy) continue;
+            if (cover.x < minx || cover.y < miny || cover.x > maxx || cover.y > maxy) return false;
         }
 
         cover.idx = subq.idx;
         cover.tmpid = static_cast<uint32_t>(cover.idx * POW2_25 + cover.id);
         cover.relev = cover.relev * subq.weight;
         if (proximity) {
-            auto last = covers.empty() ? nullptr : &covers.back();
             if (
                 last != nullptr &&
                 last->x == cover.x &&
@@ -142,26 +312,80 @@ inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack,
             cover.scoredist = cover.score;
             if (!cover.matches_language) cover.relev *= .96;
         }
+        return true;
+    };
 
+    uint32_t length = 0;
+    uint32_t lastId = 0;
+    double lastRelev = 0;
+    double lastScoredist = 0;
+    double lastDistance = 0;
+    double minScoredist = std::numeric_limits<double>::max();
+    // keeps cover if it's good enough, in grid order; returns false once no
+    // later cover can be
+    auto accept = [&](Cover const& cover) {
         // only add cover id if it's got a higer scoredist
-        if (lastId == cover.id && cover.scoredist <= lastScoredist) continue;
+        if (lastId == cover.id && cover.scoredist <= lastScoredist) return true;
 
         // short circuit based on relevMax thres
         if (length > 40) {
-            if (cover.scoredist < minScoredist) continue;
-            if (cover.relev < lastRelev) break;
+            if (cover.scoredist < minScoredist) return true;
+            if (cover.relev < lastRelev) return false;
         }
-        if (relevMax - cover.relev >= 0.25) break;
+        if (relevMax - cover.relev >= 0.25) return false;
         if (cover.relev > relevMax) relevMax = cover.relev;
 
         covers.emplace_back(cover);
         if (lastId != cover.id) length++;
-        if (!proximity && length > 40) break;
+        if (!proximity && length > 40) return false;
         if (cover.scoredist < minScoredist) minScoredist = cover.scoredist;
         lastId = cover.id;
         lastRelev = cover.relev;
         lastScoredist = cover.scoredist;
         lastDistance = cover.distance;
+        return true;
+    };
+
+    // Without proximity, the scan stops after about 40 features, so only
+    // proximity scans, which run until the relev cutoff, are worth spreading
+    // over threads. Chunks of grids are scored in parallel, then accepted in
+    // order on this thread, so the covers kept are the same either way.
+    Interrupt const* interrupt = options.interrupt.get();
+    if (proximity && options.parallelism > 1 && grids.size() > PARALLEL_PARTITION_GRIDS) {
+        std::vector<Cover> scored;
+        std::vector<char> inside;
+        bool done = false;
+        for (size_t start = 0; start < grids.size() && !done; start += PARALLEL_CHUNK_GRIDS) {
+            if (interrupt != nullptr) interrupt->check();
+            size_t end = std::min(grids.size(), start + PARALLEL_CHUNK_GRIDS);
+            scored.resize(end - start);
+            inside.resize(end - start);
+            size_t partitions = (end - start + PARALLEL_PARTITION_GRIDS - 1) / PARALLEL_PARTITION_GRIDS;
+            TaskPool::shared().run(partitions, options.parallelism - 1, [&](size_t p) {
+                size_t from = start + p * PARALLEL_PARTITION_GRIDS;
+                size_t to = std::min(end, from + PARALLEL_PARTITION_GRIDS);
+                Cover const* last = nullptr;
+                for (size_t j = from; j < to; j++) {
+                    Cover& cover = scored[j - start];
+                    inside[j - start] = score(grids[j], cover, last);
+                    if (inside[j - start]) last = &cover;
+                }
+            });
+            for (size_t k = 0; k < scored.size(); k++) {
+                if (inside[k] && !accept(scored[k])) {
+                    done = true;
+                    break;
+                }
+            }
+        }
+    } else {
+        size_t polls = 0;
+        for (uint64_t grid : grids) {
+            if (interrupt != nullptr) interrupt->poll(polls);
+            Cover cover;
+            if (!score(grid, cover, covers.empty() ? nullptr : &covers.back())) continue;
+            if (!accept(cover)) break;
+        }
     }
 
     // sort grids by distance to proximity point
@@ -190,9 +414,222 @@ inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack,
     return contexts;
 }
 
-// this function handles the case where stacking is occurring between multiple subqueries
-// again, it takes a libuv task as a parameter
-inline std::vector<Context> coalesceMulti(std::vector<PhrasematchSubq>& stack, const std::vector<uint64_t>& centerzxy, const std::vector<uint64_t>& bboxzxy, double radius) {
+// relevs are sums of products of doubles, and the bounds used for pruning
+// aren't summed in the same order as the contexts they bound, so a context is
+// only pruned when its bound misses the cutoff by more than this
+constexpr double PRUNE_EPSILON = 1e-9;
+
+// the most relev any cover of a subquery can have: grid relevs are between
+// 0.4 and 1, and penalties only lower them
+inline double maxCoverRelev(PhrasematchSubq const& subq) {
+    return std::max(subq.weight, subq.weight * 0.4);
+}
+
+constexpr size_t NO_CONTEXT = std::numeric_limits<size_t>::max();
+constexpr uint32_t NO_COVER = std::numeric_limits<uint32_t>::max();
+
+// the contexts coalesced into one tile, as a chain through CoalesceArena
+struct ContextChain {
+    size_t head;
+    size_t tail;
+};
+
+// one link in the list of covers of a StackedContext
+struct CoverNode {
+    uint32_t cover;
+    uint32_t next;
+};
+
+// a context whose covers are a chain of CoverNodes in a CoalesceArena
+struct StackedContext {
+    uint32_t head;
+    uint32_t mask;
+    double relev;
+};
+
+// a cover picked for a context being built, and the node it was read from;
+// NO_COVER stands for the new cover itself, which isn't in the arena yet
+typedef std::pair<uint32_t, uint32_t> PickedCover;
+
+// Storage for the contexts coalesceMulti builds up.
+//
+// Every cover that ends up in a context is stored once, in covers, and a
+// context's covers are a chain of nodes into it. A context stacked onto a
+// parent context usually ends with all of the parent's covers, in order, so
+// its chain links onto the parent's instead of copying it; memory grows with
+// the number of contexts rather than with contexts times stack depth. Chains
+// are only copied out into coverLists for the contexts coalesce returns.
+//
+// Contexts that later subqueries can stack onto are appended to contexts,
+// and the contexts for each tile are chained together through next in the
+// order they were added, with the tile's chain found through a flat hash map
+// keyed by packed zxy.
+//
+// Each thread keeps one arena and resets it at the start of every request, so
+// the memory is allocated once and reused rather than allocated node by node
+// on every request.
+struct CoalesceArena {
+    std::vector<Cover> covers;
+    std::vector<CoverNode> nodes;
+    FlatHashMap<ContextChain> coalesced;
+    std::vector<StackedContext> contexts;
+    std::vector<size_t> next;
+    std::vector<StackedContext> results;
+    std::vector<PickedCover> picked;
+
+    CoalesceArena()
+        : covers(),
+          nodes(),
+          coalesced(),
+          contexts(),
+          next(),
+          results(),
+          picked() {}
+
+    void reset() {
+        covers.clear();
+        nodes.clear();
+        coalesced.clear();
+        contexts.clear();
+        next.clear();
+        results.clear();
+        picked.clear();
+    }
+
+    Cover const& first(StackedContext const& context) const {
+        return covers[nodes[context.head].cover];
+    }
+
+    // stores the covers in picked as a chain and returns its head; the
+    // longest run at the end of picked that is already the end of a chain is
+    // linked onto rather than copied
+    uint32_t chain(Cover const& own) {
+        size_t shared = picked.size();
+        uint32_t head = NO_COVER;
+        uint32_t last_node = picked.back().second;
+        if (last_node != NO_COVER && nodes[last_node].next == NO_COVER) {
+            shared--;
+            while (shared > 0 &&
+                   picked[shared - 1].second != NO_COVER &&
+                   nodes[picked[shared - 1].second].next == picked[shared].second) {
+                shared--;
+            }
+            head = picked[shared].second;
+        }
+
+        for (size_t k = shared; k-- > 0;) {
+            uint32_t cover = picked[k].first;
+            if (cover == NO_COVER) {
+                cover = static_cast<uint32_t>(covers.size());
+                covers.push_back(own);
+            }
+            nodes.push_back(CoverNode{cover, head});
+            head = static_cast<uint32_t>(nodes.size() - 1);
+        }
+        return head;
+    }
+
+    // appends a context to the chain for zxy
+    void add(uint64_t zxy, StackedContext const& context) {
+        size_t index = contexts.size();
+        contexts.push_back(context);
+        next.push_back(NO_CONTEXT);
+
+        auto tile = coalesced.emplace(zxy);
+        if (tile.second) {
+            tile.first->head = index;
+        } else {
+            next[tile.first->tail] = index;
+        }
+        tile.first->tail = index;
+    }
+
+    // copies a context's covers out of the arena
+    Context materialize(StackedContext const& context) const {
+        std::vector<Cover> coverList;
+        for (uint32_t n = context.head; n != NO_COVER; n = nodes[n].next) {
+            coverList.push_back(covers[nodes[n].cover]);
+        }
+        return Context(std::move(coverList), context.mask, context.relev);
+    }
+};
+
+// Stacks a cover onto the contexts already coalesced into the tiles over it
+// at the zooms in zCache. The covers picked for its context are appended to
+// picked, starting with NO_COVER for the cover itself; the context's mask is
+// written to context_mask and its relev returned. Only reads the arena.
+inline double stackCover(CoalesceArena const& arena, Cover const& cover, unsigned short z, intarray const& zCache, std::vector<PickedCover>& picked, uint32_t& context_mask) {
+    picked.emplace_back(NO_COVER, NO_COVER);
+    context_mask = cover.mask;
+    double context_relev = cover.relev;
+
+    for (uint64_t p : zCache) {
+        auto s = static_cast<double>(1 << (z - p));
+        uint64_t pxy = static_cast<uint64_t>(p * POW2_28) +
+                       static_cast<uint64_t>(std::floor(cover.x / s) * POW2_14) +
+                       static_cast<uint64_t>(std::floor(cover.y / s));
+        ContextChain const* tile = arena.coalesced.find(pxy);
+        if (tile != nullptr) {
+            uint32_t lastMask = 0;
+            double lastRelev = 0.0;
+            for (size_t c = tile->head; c != NO_CONTEXT; c = arena.next[c]) {
+                for (uint32_t n = arena.contexts[c].head; n != NO_COVER; n = arena.nodes[n].next) {
+                    Cover const& parent = arena.covers[arena.nodes[n].cover];
+                    // this cover is functionally identical with previous and
+                    // is more relevant, replace the previous.
+                    if (parent.mask == lastMask && parent.relev > lastRelev) {
+                        picked.back() = PickedCover(arena.nodes[n].cover, n);
+                        context_relev -= lastRelev;
+                        context_relev += parent.relev;
+                        lastMask = parent.mask;
+                        lastRelev = parent.relev;
+                        // this cover doesn't overlap with used mask.
+                    } else if ((context_mask & parent.mask) == 0u) {
+                        picked.emplace_back(arena.nodes[n].cover, n);
+                        context_relev += parent.relev;
+                        context_mask = context_mask | parent.mask;
+                        lastMask = parent.mask;
+                        lastRelev = parent.relev;
+                    }
+                }
+            }
+        }
+    }
+    return context_relev;
+}
+
+// how much less relevant a last-subquery context with the count covers at
+// picked is made
+inline double lastContextPenalty(CoalesceArena const& arena, Cover const& cover, PickedCover const* picked, size_t count) {
+    // Slightly penalize contexts that have no stacking
+    if (count == 1) return 0.01;
+    // Slightly penalize contexts in ascending order
+    Cover const& first_cover = picked[0].first == NO_COVER ? cover : arena.covers[picked[0].first];
+    Cover const& second_cover = picked[1].first == NO_COVER ? cover : arena.covers[picked[1].first];
+    return first_cover.mask > second_cover.mask ? 0.01 : 0.0;
+}
+
+// a last-subquery cover stacked by a helper thread, waiting to be merged
+struct StackedCover {
+    Cover cover;
+    // the cover's relev before penalties
+    double base_relev;
+    // the context's relev, before and after lastContextPenalty
+    double context_relev;
+    double penalty;
+    uint32_t context_mask;
+    // where its picked covers are in its partition's buffer; a count of 0
+    // means it wasn't stacked, because it can't be used
+    size_t picked_begin;
+    size_t picked_count;
+};
+
+// this function handles the case where stacking is occurring between multiple subqueries,
+// and returns the contexts coalesce should return for them
+inline std::vector<Context> coalesceMulti(std::vector<PhrasematchSubq>& stack, CoalesceOptions const& options, SubqGrids& source) {
+    std::vector<uint64_t> const& centerzxy = options.centerzxy;
+    std::vector<uint64_t> const& bboxzxy = options.bboxzxy;
+    double radius = options.radius;
     std::sort(stack.begin(), stack.end(), subqSortByZoom);
     std::size_t stackSize = stack.size();
 
@@ -216,11 +653,8 @@ inline std::vector<Context> coalesceMulti(std::vector<PhrasematchSubq>& stack, c
     // Coalesce relevs into higher zooms, e.g.
     // z5 inherits relev of overlapping tiles at z4.
     // @TODO assumes sources are in zoom ascending order.
-    std::map<uint64_t, std::vector<Context>> coalesced;
-    std::map<uint64_t, std::vector<Context>>::iterator cit;
-    std::map<uint64_t, std::vector<Context>>::iterator pit;
-    std::map<uint64_t, bool> done;
-    std::map<uint64_t, bool>::iterator dit;
+    static thread_local CoalesceArena arena;
+    arena.reset();
 
     // proximity (optional)
     bool proximity = !centerzxy.empty();
@@ -258,27 +692,64 @@ inline std::vector<Context> coalesceMulti(std::vector<PhrasematchSubq>& stack, c
         maxy = 0;
     }
 
-    std::vector<Context> contexts;
+    // Pruning: contexts from the last subquery aren't stacked onto, so the
+    // only thing one of its covers can do is make a context that's returned,
+    // or raise maxrelev. Neither happens if the most relev a context with the
+    // cover could have is .25 or more below maxrelev, so covers like that, and
+    // the whole subquery if its weight rules them all out, are skipped.
+    //
+    // Stacking only adds covers with masks that don't overlap the context's,
+    // so a context holds at most one cover for each mask, and none for masks
+    // that overlap the last subquery's. The most relev it can have is its own
+    // cover's, plus the most relevant cover seen so far for each of the other
+    // masks. That doesn't hold for subqueries with empty masks, which can add
+    // any number of covers, so stacks with them are never pruned.
+    //
+    // Earlier subqueries aren't pruned the same way: their contexts can be
+    // stacked onto, and leaving one out changes which covers are picked for
+    // the contexts stacked onto it, so results could differ.
+    bool can_prune = options.pruning && std::none_of(stack.begin(), stack.end(), [](PhrasematchSubq const& subq) {
+        return subq.mask == 0;
+    });
+    // the most relevant cover each mask has added to a context so far
+    std::vector<std::pair<uint32_t, double>> mask_max_relevs;
+
+    std::vector<PickedCover>& picked = arena.picked;
+    Interrupt const* interrupt = options.interrupt.get();
+    size_t polls = 0;
     std::size_t i = 0;
     for (auto const& subq : stack) {
-        // Load and concatenate grids for all ids in `phrases`
-        intarray grids;
-        grids = subq.type == TYPE_MEMORY ? reinterpret_cast<MemoryCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, PREFIX_MAX_GRID_LENGTH) : reinterpret_cast<RocksDBCache*>(subq.cache)->__getmatching(subq.phrase, subq.prefix, subq.langfield, PREFIX_MAX_GRID_LENGTH);
-
+        if (interrupt != nullptr) interrupt->check();
         bool first = i == 0;
         bool last = i == (stack.size() - 1);
         unsigned short z = subq.zoom;
         auto const& zCache = zoomCache[i];
-        std::size_t zCacheSize = zCache.size();
 
-        unsigned long m = grids.size();
+        double stacked_relev_bound = 0;
+        if (last && can_prune) {
+            for (auto const& mask_relev : mask_max_relevs) {
+                if ((mask_relev.first & subq.mask) == 0u) stacked_relev_bound += mask_relev.second;
+            }
+            if (maxrelev - (maxCoverRelev(subq) + stacked_relev_bound) >= .25 + PRUNE_EPSILON) break;
+        }
+
+        // grids are pulled from the cache as they're used, so the ones that
+        // are never reached are never decoded
+        std::unique_ptr<GridCursor> cursor = source.cursor(subq, PREFIX_MAX_GRID_LENGTH);
+        bool unboosted = cursor->mayProduceUnboosted();
+        double subq_max_relev = 0;
 
-        for (unsigned long j = 0; j < m; j++) {
-            Cover cover = numToCover(grids[j]);
+        // the cover for a grid of this subquery, before penalties
+        auto toCover = [&subq](uint64_t grid) {
+            Cover cover = numToCover(grid);
             cover.idx = subq.idx;
             cover.mask = subq.mask;
             cover.tmpid = static_cast<uint32_t>(cover.idx * POW2_25 + cover.id);
             cover.relev = cover.relev * subq.weight;
+            return cover;
+        };
+        // fills in distance and scoredist, and applies the language penalty
+        auto scoreCover = [&](Cover& cover) {
             if (proximity) {
                 ZXY dxy = pxy2zxy(z, cover.x, cover.y, cz);
                 cover.distance = tileDist(cx, cy, dxy.x, dxy.y);
@@ -291,91 +762,163 @@ inline std::vector<Context> coalesceMulti(std::vector<PhrasematchSubq>& stack, c
                 cover.scoredist = cover.score;
                 if (!cover.matches_language) cover.relev *= .96;
             }
+        };
+        auto inBbox = [&](Cover const& cover) {
+            if (!bbox) return true;
+            ZXY min = bxy2zxy(bboxz, minx, miny, z, false);
+            ZXY max = bxy2zxy(bboxz, maxx, maxy, z, true);
+            return !(cover.x < min.x || cover.y < min.y || cover.x > max.x || cover.y > max.y);
+        };
+        // Grids come out in descending order, so once past any grids with
+        // the language boost, no later grid has a higher relev than this one
+        // (before penalties), and if this one is pruned, so are all of the
+        // rest.
+        auto pruneRest = [&](Cover const& cover, double base_relev) {
+            return last && can_prune && (!cover.matches_language || !unboosted) &&
+                   maxrelev - (base_relev + stacked_relev_bound) >= .25 + PRUNE_EPSILON;
+        };
+        auto prune = [&](double relev, double bound_maxrelev) {
+            return last && can_prune && bound_maxrelev - (relev + stacked_relev_bound) >= .25 + PRUNE_EPSILON;
+        };
+
+        uint64_t grid;
+        if (last && options.parallelism > 1) {
+            // The last subquery's contexts are never stacked onto, so the
+            // arena doesn't change while its covers are stacked. Chunks of
+            // its grids are stacked by several threads at once, each
+            // partition into its own buffer of picked covers, then merged in
+            // grid order on this thread, where maxrelev, pruning and the
+            // results are applied just as the loop below applies them, so the
+            // results are the same.
+            //
+            // The helpers mustn't name arena: it's thread_local, so they'd
+            // get their own.
+            CoalesceArena const& stacked_onto = arena;
+            std::vector<uint64_t> chunk;
+            std::vector<StackedCover> stacked;
+            std::vector<std::vector<PickedCover>> buffers;
+            bool done = false;
+            while (!done) {
+                if (interrupt != nullptr) interrupt->check();
+                chunk.clear();
+                while (chunk.size() < PARALLEL_CHUNK_GRIDS && cursor->next(grid)) {
+                    chunk.push_back(grid);
+                }
+                if (chunk.empty()) break;
+
+                size_t partitions = (chunk.size() + PARALLEL_PARTITION_GRIDS - 1) / PARALLEL_PARTITION_GRIDS;
+                stacked.resize(chunk.size());
+                buffers.resize(partitions);
+                // maxrelev only grows, so covers pruned against its value now
+                // are pruned when they're merged too, and needn't be stacked
+                double chunk_maxrelev = maxrelev;
+                TaskPool::shared().run(partitions, options.parallelism - 1, [&](size_t p) {
+                    std::vector<PickedCover>& buffer = buffers[p];
+                    buffer.clear();
+                    size_t to = std::min(chunk.size(), (p + 1) * PARALLEL_PARTITION_GRIDS);
+                    for (size_t j = p * PARALLEL_PARTITION_GRIDS; j < to; j++) {
+                        StackedCover& item = stacked[j];
+                        item.cover = toCover(chunk[j]);
+                        item.base_relev = item.cover.relev;
+                        item.picked_count = 0;
+                        scoreCover(item.cover);
+                        if (prune(item.cover.relev, chunk_maxrelev) || !inBbox(item.cover)) continue;
+
+                        item.picked_begin = buffer.size();
+                        item.context_relev = stackCover(stacked_onto, item.cover, z, zCache, buffer, item.context_mask);
+                        item.picked_count = buffer.size() - item.picked_begin;
+                        item.penalty = lastContextPenalty(stacked_onto, item.cover, &buffer[item.picked_begin], item.picked_count);
+                    }
+                });
 
-            if (bbox) {
-                ZXY min = bxy2zxy(bboxz, minx, miny, z, false);
-                ZXY max = bxy2zxy(bboxz, maxx, maxy, z, true);
-                if (cover.x < min.x || cover.y < min.y || cover.x > max.x || cover.y > max.y) continue;
-            }
-
-            uint64_t zxy = (z * POW2_28) + (cover.x * POW2_14) + (cover.y);
-
-            std::vector<Cover> covers;
-            covers.push_back(cover);
-            uint32_t context_mask = cover.mask;
-            double context_relev = cover.relev;
-
-            for (unsigned a = 0; a < zCacheSize; a++) {
-                uint64_t p = zCache[a];
-                auto s = static_cast<double>(1 << (z - p));
-                uint64_t pxy = static_cast<uint64_t>(p * POW2_28) +
-                               static_cast<uint64_t>(std::floor(cover.x / s) * POW2_14) +
-                               static_cast<uint64_t>(std::floor(cover.y / s));
-                pit = coalesced.find(pxy);
-                if (pit != coalesced.end()) {
-                    uint32_t lastMask = 0;
-                    double lastRelev = 0.0;
-                    for (auto const& parents : pit->second) {
-                        for (auto const& parent : parents.coverList) {
-                            // this cover is functionally identical with previous and
-                            // is more relevant, replace the previous.
-                            if (parent.mask == lastMask && parent.relev > lastRelev) {
-                                covers.pop_back();
-                                covers.emplace_back(parent);
-                                context_relev -= lastRelev;
-                                context_relev += parent.relev;
-                                lastMask = parent.mask;
-                                lastRelev = parent.relev;
-                                // this cover doesn't overlap with used mask.
-                            } else if ((context_mask & parent.mask) == 0u) {
-                                covers.emplace_back(parent);
-                                context_relev += parent.relev;
-                                context_mask = context_mask | parent.mask;
-                                lastMask = parent.mask;
-                                lastRelev = parent.relev;
-                            }
-                        }
+                for (size_t j = 0; j < chunk.size(); j++) {
+                    StackedCover const& item = stacked[j];
+                    if (pruneRest(item.cover, item.base_relev)) {
+                        done = true;
+                        break;
+                    }
+                    if (prune(item.cover.relev, maxrelev) || !inBbox(item.cover)) continue;
+
+                    maxrelev = std::max(maxrelev, item.context_relev);
+                    double context_relev = item.context_relev - item.penalty;
+                    if (maxrelev - context_relev < .25) {
+                        auto const& buffer = buffers[j / PARALLEL_PARTITION_GRIDS];
+                        picked.assign(buffer.begin() + static_cast<std::ptrdiff_t>(item.picked_begin),
+                                      buffer.begin() + static_cast<std::ptrdiff_t>(item.picked_begin + item.picked_count));
+                        arena.results.push_back(StackedContext{arena.chain(item.cover), item.context_mask, context_relev});
                     }
                 }
             }
-            maxrelev = std::max(maxrelev, context_relev);
-            if (last) {
-                // Slightly penalize contexts that have no stacking
-                if (covers.size() == 1) {
-                    context_relev -= 0.01;
-                    // Slightly penalize contexts in ascending order
-                } else if (covers[0].mask > covers[1].mask) {
-                    context_relev -= 0.01;
-                }
-                if (maxrelev - context_relev < .25) {
-                    contexts.emplace_back(std::move(covers), context_mask, context_relev);
-                }
-            } else if (first || covers.size() > 1) {
-                cit = coalesced.find(zxy);
-                if (cit == coalesced.end()) {
-                    std::vector<Context> local_contexts;
-                    local_contexts.emplace_back(std::move(covers), context_mask, context_relev);
-                    coalesced.emplace(zxy, std::move(local_contexts));
-                } else {
-                    cit->second.emplace_back(std::move(covers), context_mask, context_relev);
+        } else {
+            while (cursor->next(grid)) {
+                if (interrupt != nullptr) interrupt->poll(polls);
+                Cover cover = toCover(grid);
+                if (pruneRest(cover, cover.relev)) break;
+
+                scoreCover(cover);
+                if (prune(cover.relev, maxrelev) || !inBbox(cover)) continue;
+
+                subq_max_relev = std::max(subq_max_relev, cover.relev);
+
+                uint64_t zxy = (z * POW2_28) + (cover.x * POW2_14) + (cover.y);
+
+                picked.clear();
+                uint32_t context_mask;
+                double context_relev = stackCover(arena, cover, z, zCache, picked, context_mask);
+                maxrelev = std::max(maxrelev, context_relev);
+                if (last) {
+                    context_relev -= lastContextPenalty(arena, cover, picked.data(), picked.size());
+                    if (maxrelev - context_relev < .25) {
+                        arena.results.push_back(StackedContext{arena.chain(cover), context_mask, context_relev});
+                    }
+                } else if (first || picked.size() > 1) {
+                    arena.add(zxy, StackedContext{arena.chain(cover), context_mask, context_relev});
                 }
             }
         }
 
+        auto mask_relev = std::find_if(mask_max_relevs.begin(), mask_max_relevs.end(), [&subq](std::pair<uint32_t, double> const& item) {
+            return item.first == subq.mask;
+        });
+        if (mask_relev == mask_max_relevs.end()) {
+            mask_max_relevs.emplace_back(subq.mask, subq_max_relev);
+        } else {
+            mask_relev->second = std::max(mask_relev->second, subq_max_relev);
+        }
         i++;
     }
 
-    // append coalesced to contexts by moving memory
-    for (auto&& matched : coalesced) {
-        for (auto&& context : matched.second) {
-            if (maxrelev - context.relev < .25) {
-                contexts.emplace_back(std::move(context));
+    // append coalesced to the results; tiles are visited in zxy order, as
+    // they always have been, because the sort below isn't stable
+    std::vector<std::pair<uint64_t, ContextChain>> tiles;
+    tiles.reserve(arena.coalesced.size());
+    arena.coalesced.forEach([&tiles](uint64_t zxy, ContextChain const& tile) {
+        tiles.emplace_back(zxy, tile);
+    });
+    std::sort(tiles.begin(), tiles.end(), [](std::pair<uint64_t, ContextChain> const& a, std::pair<uint64_t, ContextChain> const& b) {
+        return a.first < b.first;
+    });
+    std::vector<StackedContext>& results = arena.results;
+    for (auto const& tile : tiles) {
+        for (size_t c = tile.second.head; c != NO_CONTEXT; c = arena.next[c]) {
+            if (maxrelev - arena.contexts[c].relev < .25) {
+                results.push_back(arena.contexts[c]);
             }
         }
     }
 
-    std::sort(contexts.begin(), contexts.end(), contextSortByRelev);
-    return contexts;
+    std::sort(results.begin(), results.end(), [](StackedContext const& a, StackedContext const& b) {
+        return contextSortByRelev(a.relev, arena.first(a), b.relev, arena.first(b));
+    });
+
+    // only the contexts that are returned get their covers copied out
+    std::vector<Context> out;
+    selectContexts(
+        results.size(),
+        [&results](size_t r) { return results[r].relev; },
+        [&results](size_t r) -> Cover const& { return arena.first(results[r]); },
+        [&results, &out](size_t r) { out.push_back(arena.materialize(results[r])); });
+    return out;
 }
 
 } // namespace carmen
@@ -3,11 +3,73 @@
 
 #include "cpp_util.hpp"
 
+#include <map>
+#include <tuple>
+
 namespace carmen {
 
-std::vector<Context> coalesce(std::vector<PhrasematchSubq>& stack, const std::vector<uint64_t>& centerzxy, const std::vector<uint64_t>& bboxzxy, double radius);
-inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack, const std::vector<uint64_t>& centerzxy, const std::vector<uint64_t>& bboxzxy, double radius);
-inline std::vector<Context> coalesceMulti(std::vector<PhrasematchSubq>& stack, const std::vector<uint64_t>& centerzxy, const std::vector<uint64_t>& bboxzxy, double radius);
+// the options for a coalesce that apply to every subquery in the stack
+struct CoalesceOptions {
+    std::vector<uint64_t> centerzxy;
+    std::vector<uint64_t> bboxzxy;
+    double radius = 40.0;
+    bool pruning = true;
+    // how many threads one stack may use, counting the one it runs on; see
+    // TaskPool
+    unsigned parallelism = 1;
+    // if set, checked as the coalesce goes, which throws an Interrupted once
+    // it's been cancelled or its deadline has passed
+    std::shared_ptr<Interrupt> interrupt;
+};
+
+// Reads the grids for coalesce's subqueries. By default every read goes to
+// the subquery's cache; a shared source keeps the grids it has read, keyed by
+// everything that decides which grids a subquery matches, and hands the same
+// array to every later subquery with the same key.
+class SubqGrids : noncopyable {
+  public:
+    SubqGrids(bool _shared, Interrupt const* _interrupt);
+
+    // the grids __getmatching would return for the subquery
+    intarray const& matching(PhrasematchSubq const& subq, size_t max_results);
+
+    // the grids __getmatchingBboxFiltered would return for the subquery
+    intarray const& matchingBboxFiltered(PhrasematchSubq const& subq, size_t max_results, const uint64_t box[4]);
+
+    // the grids __getmatching would return for the subquery, as a cursor
+    std::unique_ptr<GridCursor> cursor(PhrasematchSubq const& subq, size_t max_results);
+
+  private:
+    typedef std::tuple<void*, std::string, PrefixMatch, langfield_type, size_t, bool> key_type;
+
+    bool shared;
+    // passed on to __getmatching; may be null
+    Interrupt const* interrupt;
+    // the grids of the last unshared read
+    intarray scratch;
+    std::map<key_type, intarray> grids;
+};
+
+std::vector<Context> coalesce(std::vector<PhrasematchSubq>& stack, CoalesceOptions const& options);
+
+// Packs contexts into one flat buffer, for the packed result mode. It begins
+// with the number of contexts and the number of covers, as uint32s, followed
+// by one array per field, struct-of-arrays style, each starting on an 8-byte
+// boundary:
+//
+//   float64 context relev[contexts]
+//   uint32  context offsets[contexts + 1] (context i's covers are
+//           offsets[i] to offsets[i + 1])
+//   float64 relev[covers], distance[covers], scoredist[covers]
+//   uint32  id[covers], tmpid[covers]
+//   uint16  x[covers], y[covers], score[covers], idx[covers]
+//   uint8   matches_language[covers]
+//
+// in native byte order. index.js's PackedCoalesceResult reads it.
+std::string packContexts(std::vector<Context> const& contexts);
+std::vector<std::vector<Context>> coalesceBatch(std::vector<std::vector<PhrasematchSubq>>& stacks, CoalesceOptions const& options);
+inline std::vector<Context> coalesceSingle(std::vector<PhrasematchSubq>& stack, CoalesceOptions const& options, SubqGrids& source);
+inline std::vector<Context> coalesceMulti(std::vector<PhrasematchSubq>& stack, CoalesceOptions const& options, SubqGrids& source);
 
 } // namespace carmen
 
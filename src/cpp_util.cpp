@@ -1,6 +1,10 @@
 
 #include "cpp_util.hpp"
 
+#include <cstdio>
+#include <mutex>
+#include <queue>
+
 namespace carmen {
 
 // Converts from the packed integer into (relev, score, x, y, feature_id)
@@ -169,6 +173,343 @@ double scoredist(unsigned zoom, double distance, unsigned short score, double ra
     return ((6 * E_POW[score] / E_POW[7]) + 1) / distRatio;
 }
 
+// The memo prefix extractor picks out the part of a key that every scan for
+// it will share, so that prefix blooms can rule tables out of a scan:
+//
+//  * =1 memo keys: "=1" plus the first character; tier 1 scans always seek
+//    to at least one character of the phrase
+//  * =2 memo keys: "=2" plus the first three characters; tier 2 scans
+//    can seek to as few as three (for three-character word boundary scans)
+//  * =m metadata keys: "=m" plus the prefix of the key they describe
+//  * everything else: the key up to and including the langfield separator,
+//    or the first six bytes if that's shorter, as scans that aren't
+//    answered from the memo keys either seek to "phrase|" or to a prefix
+//    longer than six characters
+//
+// Keys too short to have a prefix by these rules are out of its domain, and
+// scans for them fall back to a total order seek.
+class MemoPrefixExtractor : public rocksdb::SliceTransform {
+  public:
+    const char* Name() const override {
+        return "carmen.MemoPrefix.v1";
+    }
+
+    rocksdb::Slice Transform(const rocksdb::Slice& key) const override {
+        return rocksdb::Slice(key.data(), prefixLength(key));
+    }
+
+    bool InDomain(const rocksdb::Slice& key) const override {
+        return prefixLength(key) > 0;
+    }
+
+    bool InRange(const rocksdb::Slice& dst) const override {
+        return prefixLength(dst) == dst.size();
+    }
+
+    bool SameResultWhenAppended(const rocksdb::Slice& prefix) const override {
+        size_t length = prefixLength(prefix);
+        return length > 0 && length == prefix.size();
+    }
+
+  private:
+    // the length of the prefix, or 0 if the key is out of the domain
+    static size_t prefixLength(const rocksdb::Slice& key) {
+        if (key.size() >= 2 && key[0] == '=') {
+            if (key[1] == 'm') {
+                size_t length = prefixLength(rocksdb::Slice(key.data() + 2, key.size() - 2));
+                return length > 0 ? length + 2 : 0;
+            }
+            size_t length = key[1] == '1' ? 3 : key[1] == '2' ? 5 : 0;
+            return key.size() >= length ? length : 0;
+        }
+        const char* separator = static_cast<const char*>(memchr(key.data(), LANGFIELD_SEPARATOR, std::min(key.size(), NORMAL_PREFIX_LENGTH)));
+        if (separator != nullptr) return static_cast<size_t>(separator - key.data()) + 1;
+        return key.size() >= NORMAL_PREFIX_LENGTH ? NORMAL_PREFIX_LENGTH : 0;
+    }
+
+    static constexpr size_t NORMAL_PREFIX_LENGTH = 6;
+};
+
+constexpr size_t MemoPrefixExtractor::NORMAL_PREFIX_LENGTH;
+
+std::shared_ptr<const rocksdb::SliceTransform> memoPrefixExtractor() {
+    static std::shared_ptr<const rocksdb::SliceTransform> extractor = std::make_shared<MemoPrefixExtractor>();
+    return extractor;
+}
+
+// a prefix bloom is only useful with a filter policy to build it with, so
+// asking for one without any bloom bits uses rocksdb's usual 10 bits per key
+constexpr int DEFAULT_BLOOM_BITS_PER_KEY = 10;
+
+void setFilterOptions(rocksdb::Options& options, rocksdb::BlockBasedTableOptions& table_options, int bloom_bits_per_key, bool prefix_bloom) {
+    if (prefix_bloom) {
+        options.prefix_extractor = memoPrefixExtractor();
+        if (bloom_bits_per_key <= 0) bloom_bits_per_key = DEFAULT_BLOOM_BITS_PER_KEY;
+    }
+    if (bloom_bits_per_key > 0) {
+        table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(bloom_bits_per_key, false));
+    }
+}
+
+#if CARMEN_HAVE_ZSTD_TRAINING
+// zstd recommends training a dictionary on about a hundred times its size
+constexpr uint64_t ZSTD_TRAIN_BYTES_PER_DICT_BYTE = 100;
+#endif
+
+rocksdb::Options packRocksDBOptions(PackOptions const& pack_options) {
+    rocksdb::Options options;
+    options.create_if_missing = true;
+
+    rocksdb::BlockBasedTableOptions table_options;
+    setFilterOptions(options, table_options, pack_options.bloom_bits_per_key, pack_options.prefix_bloom);
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+
+    if (pack_options.bottommost_compression != rocksdb::kDisableCompressionOption) {
+        options.bottommost_compression = pack_options.bottommost_compression;
+        // rocksdb only checks that compression types are linked in for the
+        // types listed in compression_per_level (or compression) when the
+        // database is opened, and otherwise quietly writes blocks uncompressed;
+        // listing the bottommost type as the last level's makes an unsupported
+        // type fail the open instead
+        options.compression_per_level.assign(static_cast<size_t>(options.num_levels), options.compression);
+        options.compression_per_level.back() = pack_options.bottommost_compression;
+    }
+    options.compression_opts.max_dict_bytes = pack_options.compression_dict_bytes;
+#if CARMEN_HAVE_ZSTD_TRAINING
+    // zstd can train a dictionary on a larger sample instead of using the raw
+    // sampled bytes
+    if (pack_options.bottommost_compression == rocksdb::kZSTD && pack_options.compression_dict_bytes > 0) {
+        options.compression_opts.zstd_max_train_bytes = pack_options.compression_dict_bytes * ZSTD_TRAIN_BYTES_PER_DICT_BYTE;
+#if CARMEN_HAVE_BOTTOMMOST_COMPRESSION_OPTS
+        options.bottommost_compression_opts = options.compression_opts;
+        options.bottommost_compression_opts.enabled = true;
+#endif
+    }
+#endif
+
+    // a finalized database is compacted once at the end, so compactions
+    // while it's being written would only be repeated
+    if (pack_options.finalize) options.disable_auto_compactions = true;
+    return options;
+}
+
+void finalizePackedDB(rocksdb::DB& db, PackOptions const& pack_options) {
+    if (!pack_options.finalize) return;
+
+    // pack never writes through the memtable or the WAL, so there's nothing
+    // to flush first; compacting the whole key range moves every table into
+    // one sorted level, so each lookup probes at most one file
+    rocksdb::CompactRangeOptions compact_options;
+    compact_options.change_level = true;
+    compact_options.bottommost_level_compaction = rocksdb::BottommostLevelCompaction::kForce;
+    rocksdb::Status status = db.CompactRange(compact_options, nullptr, nullptr);
+    if (!status.ok()) {
+        throw std::invalid_argument("unable to finalize packed rocksdb file: " + status.ToString());
+    }
+}
+
+// the shared block cache is created by the first cache to be opened (or the
+// first call to configure it), and is never destroyed, since each rocksdb
+// handle that was opened with it keeps a reference to it anyway
+struct SharedBlockCache {
+    std::mutex mutex;
+    // the type asked for, and the type actually created
+    std::string requested_type = "lru";
+    std::string type = "lru";
+    size_t capacity = DEFAULT_SHARED_BLOCK_CACHE_SIZE;
+    std::shared_ptr<rocksdb::Cache> cache;
+    std::shared_ptr<rocksdb::Statistics> statistics;
+};
+
+SharedBlockCache& sharedBlockCache() {
+    static SharedBlockCache* shared = new SharedBlockCache();
+    return *shared;
+}
+
+// must be called with the shared block cache's mutex held
+void createSharedBlockCache(SharedBlockCache& shared) {
+    if (shared.cache) return;
+    shared.type = shared.requested_type;
+    if (shared.type == "clock") {
+        // rocksdb only has a clock cache when built with TBB, and returns
+        // nullptr otherwise
+        shared.cache = rocksdb::NewClockCache(shared.capacity);
+        if (!shared.cache) shared.type = "lru";
+    }
+    if (!shared.cache) {
+        shared.cache = rocksdb::NewLRUCache(shared.capacity);
+    }
+    shared.statistics = rocksdb::CreateDBStatistics();
+}
+
+void configureSharedBlockCache(size_t capacity, std::string const& type) {
+    if (type != "lru" && type != "clock") {
+        throw std::invalid_argument("block cache type must be 'lru' or 'clock'");
+    }
+    SharedBlockCache& shared = sharedBlockCache();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    if (shared.cache) {
+        if (type != shared.requested_type) {
+            throw std::invalid_argument("block cache type can't be changed once a RocksDBCache has been opened");
+        }
+        shared.capacity = capacity;
+        shared.cache->SetCapacity(capacity);
+        return;
+    }
+    shared.requested_type = type;
+    shared.capacity = capacity;
+    createSharedBlockCache(shared);
+}
+
+BlockCacheStats sharedBlockCacheStats() {
+    SharedBlockCache& shared = sharedBlockCache();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    createSharedBlockCache(shared);
+    BlockCacheStats stats{};
+    stats.type = shared.type;
+    stats.capacity = shared.cache->GetCapacity();
+    stats.usage = shared.cache->GetUsage();
+    stats.pinned_usage = shared.cache->GetPinnedUsage();
+    stats.hits = shared.statistics->getTickerCount(rocksdb::BLOCK_CACHE_HIT);
+    stats.misses = shared.statistics->getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+    return stats;
+}
+
+rocksdb::Options loadRocksDBOptions(RocksDBOptions const& load_options) {
+    rocksdb::Options options;
+    options.create_if_missing = true;
+    options.max_open_files = load_options.max_open_files;
+    options.allow_mmap_reads = load_options.mmap_reads;
+
+    rocksdb::BlockBasedTableOptions table_options;
+    {
+        SharedBlockCache& shared = sharedBlockCache();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        createSharedBlockCache(shared);
+        table_options.block_cache = shared.cache;
+        options.statistics = shared.statistics;
+    }
+    if (load_options.block_cache_size > 0) {
+        table_options.block_cache = rocksdb::NewLRUCache(load_options.block_cache_size);
+    }
+    setFilterOptions(options, table_options, load_options.bloom_bits_per_key, load_options.prefix_bloom);
+    options.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+    return options;
+}
+
+size_t packThreads(PackOptions const& pack_options) {
+    if (pack_options.threads > 0) return pack_options.threads;
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+void ingestPackedEntries(rocksdb::DB& db, rocksdb::Options const& options, std::string const& directory, std::vector<std::vector<PackedEntry>> const& runs, size_t threads) {
+    // a k-way merge of the runs into one sorted list; only pointers are moved
+    // around, the entries themselves stay where they are
+    typedef std::pair<size_t, size_t> cursor;
+    auto later = [&runs](cursor const& a, cursor const& b) {
+        return runs[a.first][a.second].first > runs[b.first][b.second].first;
+    };
+    std::priority_queue<cursor, std::vector<cursor>, decltype(later)> heap(later);
+
+    size_t total = 0;
+    for (size_t i = 0; i < runs.size(); i++) {
+        total += runs[i].size();
+        if (!runs[i].empty()) heap.emplace(i, 0);
+    }
+
+    std::vector<PackedEntry const*> sorted;
+    sorted.reserve(total);
+    while (!heap.empty()) {
+        cursor c = heap.top();
+        heap.pop();
+        PackedEntry const* entry = &runs[c.first][c.second];
+        // SST files only accept strictly increasing keys; if a key turns up
+        // twice, keep the first
+        if (sorted.empty() || sorted.back()->first != entry->first) {
+            sorted.push_back(entry);
+        }
+        if (++c.second < runs[c.first].size()) heap.push(c);
+    }
+    if (sorted.empty()) return;
+
+    // files that are ingested together can't overlap, so each thread writes
+    // its files from a contiguous slice of the sorted entries
+    size_t shards = std::max(std::min(threads, sorted.size()), static_cast<size_t>(1));
+    std::vector<std::unique_ptr<SstFileSequence>> sequences;
+    for (size_t i = 0; i < shards; i++) {
+        sequences.emplace_back(new SstFileSequence(options, directory + "/carmen-pack-" + std::to_string(i)));
+    }
+
+    parallelShards(shards, [&](size_t i) {
+        size_t begin = sorted.size() * i / shards;
+        size_t end = sorted.size() * (i + 1) / shards;
+        for (size_t j = begin; j < end; j++) {
+            sequences[i]->add(sorted[j]->first, sorted[j]->second);
+        }
+        sequences[i]->finish();
+    });
+
+    std::vector<std::string> paths;
+    for (auto const& sequence : sequences) {
+        std::vector<std::string> const& written = sequence->finish();
+        paths.insert(paths.end(), written.begin(), written.end());
+    }
+    ingestSstFiles(db, paths);
+}
+
+SstFileSequence::SstFileSequence(rocksdb::Options const& options, std::string const& path_prefix)
+    : options_(options),
+      path_prefix_(path_prefix),
+      writer_(),
+      paths_() {}
+
+SstFileSequence::~SstFileSequence() {
+    writer_.reset();
+    for (auto const& path : paths_) {
+        std::remove(path.c_str());
+    }
+}
+
+void SstFileSequence::add(rocksdb::Slice const& key, rocksdb::Slice const& value) {
+    rocksdb::Status status;
+    if (!writer_) {
+        std::string path = path_prefix_ + "-" + std::to_string(paths_.size()) + ".sst";
+        writer_.reset(new rocksdb::SstFileWriter(rocksdb::EnvOptions(), options_));
+        paths_.push_back(path);
+        status = writer_->Open(path);
+    }
+    if (status.ok()) status = writer_->Add(key, value);
+    if (!status.ok()) {
+        throw std::invalid_argument("unable to write sst file for packing: " + status.ToString());
+    }
+    if (writer_->FileSize() >= PACK_SST_FILE_SIZE) split();
+}
+
+void SstFileSequence::split() {
+    if (!writer_) return;
+    rocksdb::Status status = writer_->Finish();
+    writer_.reset();
+    if (!status.ok()) {
+        throw std::invalid_argument("unable to write sst file for packing: " + status.ToString());
+    }
+}
+
+std::vector<std::string> const& SstFileSequence::finish() {
+    split();
+    return paths_;
+}
+
+void ingestSstFiles(rocksdb::DB& db, std::vector<std::string> const& paths) {
+    if (paths.empty()) return;
+
+    rocksdb::IngestExternalFileOptions ingest_options;
+    ingest_options.move_files = true;
+    rocksdb::Status status = db.IngestExternalFile(paths, ingest_options);
+    if (!status.ok()) {
+        throw std::invalid_argument("unable to ingest sst files for packing: " + status.ToString());
+    }
+}
+
 // Open database for read-write availability
 rocksdb::Status OpenDB(const rocksdb::Options& options, const std::string& name, std::unique_ptr<rocksdb::DB>& dbptr) {
     rocksdb::DB* db;
@@ -13,18 +13,47 @@
 #pragma clang diagnostic ignored "-Wsign-conversion"
 #pragma clang diagnostic ignored "-Wshorten-64-to-32"
 
+#include "rocksdb/cache.h"
 #include "rocksdb/db.h"
+#include "rocksdb/filter_policy.h"
+#include "rocksdb/slice_transform.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/statistics.h"
+#include "rocksdb/table.h"
+#include "rocksdb/version.h"
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <exception>
 #include <map>
 #include <protozero/pbf_reader.hpp>
 #include <protozero/pbf_writer.hpp>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #pragma clang diagnostic pop
 
+#include "block_codec.hpp"
+
+// zstd dictionary training (CompressionOptions::zstd_max_train_bytes) exists
+// from RocksDB 5.15 on, and separate bottommost compression options (with
+// their own dictionary settings) from 6.4 on; older builds, like the bundled
+// 5.4.6, use the sampled bytes as the dictionary as they are
+#if ROCKSDB_MAJOR > 5 || (ROCKSDB_MAJOR == 5 && ROCKSDB_MINOR >= 15)
+#define CARMEN_HAVE_ZSTD_TRAINING 1
+#else
+#define CARMEN_HAVE_ZSTD_TRAINING 0
+#endif
+#if ROCKSDB_MAJOR > 6 || (ROCKSDB_MAJOR == 6 && ROCKSDB_MINOR >= 4)
+#define CARMEN_HAVE_BOTTOMMOST_COMPRESSION_OPTS 1
+#else
+#define CARMEN_HAVE_BOTTOMMOST_COMPRESSION_OPTS 0
+#endif
+
 namespace carmen {
 
 typedef std::string key_type;
@@ -50,6 +79,8 @@ typedef enum {
 } PrefixMatch;
 
 typedef unsigned __int128 langfield_type;
+// the largest language id a langfield can hold
+constexpr unsigned MAX_LANG = (sizeof(langfield_type) * 8) - 1;
 constexpr uint64_t LANGUAGE_MATCH_BOOST = static_cast<const uint64_t>(1) << 63;
 
 //relev = 5 bits
@@ -109,6 +140,78 @@ struct PhrasematchSubq {
     PhrasematchSubq(PhrasematchSubq&& c) = default;
 };
 
+// one lookup in a __getmatchingMany batch, with the same meaning as the
+// arguments of __getmatching
+struct MatchingQuery {
+    std::string phrase;
+    PrefixMatch match_prefixes;
+    langfield_type langfield;
+    size_t max_results;
+};
+
+// A pull-based stream of the grids a getmatching query matches, in the same
+// order (and up to the same max_results) as __getmatching would return them,
+// so that callers who stop early don't pay to decode the rest.
+class GridCursor : noncopyable {
+  public:
+    virtual ~GridCursor() = default;
+
+    // sets grid to the next grid and returns true, or returns false once
+    // there are none left
+    virtual bool next(uint64_t& grid) = 0;
+
+    // false if every grid the cursor produces has LANGUAGE_MATCH_BOOST set,
+    // in which case relevs never increase from one grid to the next; true if
+    // some might not, or if the cursor can't tell
+    virtual bool mayProduceUnboosted() const { return true; }
+};
+
+// thrown by Interrupt::check
+class Interrupted : public std::runtime_error {
+  public:
+    explicit Interrupted(const char* what)
+        : std::runtime_error(what) {}
+};
+
+// Lets a query that's queued or running be stopped from outside: by cancel(),
+// which may be called from any thread, or by a deadline passing. The query
+// calls check() between steps, and poll() in loops over grids or messages, so
+// it stops soon after either happens by throwing an Interrupted.
+class Interrupt : noncopyable {
+  public:
+    Interrupt()
+        : cancelled(false),
+          has_deadline(false),
+          deadline() {}
+
+    void cancel() { cancelled = true; }
+
+    // only set it before the query starts
+    void setDeadline(std::chrono::steady_clock::time_point _deadline) {
+        has_deadline = true;
+        deadline = _deadline;
+    }
+
+    // throws if the query has been cancelled or its deadline has passed
+    void check() const {
+        if (cancelled) throw Interrupted("coalesce cancelled");
+        if (has_deadline && std::chrono::steady_clock::now() >= deadline) throw Interrupted("coalesce deadline exceeded");
+    }
+
+    // calls check() once every POLL_INTERVAL calls with the same counter,
+    // since even reading the clock adds up in the tightest loops
+    void poll(size_t& counter) const {
+        if (++counter % POLL_INTERVAL == 0) check();
+    }
+
+    static constexpr size_t POLL_INTERVAL = 1024;
+
+  private:
+    std::atomic<bool> cancelled;
+    bool has_deadline;
+    std::chrono::steady_clock::time_point deadline;
+};
+
 struct Cover {
     double relev;
     uint32_t id;
@@ -209,20 +312,27 @@ inline bool subqSortByZoom(PhrasematchSubq const& a, PhrasematchSubq const& b) n
     return (a.idx < b.idx);
 }
 
-inline bool contextSortByRelev(Context const& a, Context const& b) noexcept {
-    if (b.relev > a.relev)
+// contexts are sorted by their relev and then by their first cover; this
+// takes those separately so that it also works for contexts whose covers
+// aren't stored in a coverList
+inline bool contextSortByRelev(double a_relev, Cover const& a_first, double b_relev, Cover const& b_first) noexcept {
+    if (b_relev > a_relev)
         return false;
-    else if (b.relev < a.relev)
+    else if (b_relev < a_relev)
         return true;
-    else if (b.coverList[0].scoredist > a.coverList[0].scoredist)
+    else if (b_first.scoredist > a_first.scoredist)
         return false;
-    else if (b.coverList[0].scoredist < a.coverList[0].scoredist)
+    else if (b_first.scoredist < a_first.scoredist)
         return true;
-    else if (b.coverList[0].idx < a.coverList[0].idx)
+    else if (b_first.idx < a_first.idx)
         return false;
-    else if (b.coverList[0].idx > a.coverList[0].idx)
+    else if (b_first.idx > a_first.idx)
         return true;
-    return (b.coverList[0].id > a.coverList[0].id);
+    return (b_first.id > a_first.id);
+}
+
+inline bool contextSortByRelev(Context const& a, Context const& b) noexcept {
+    return contextSortByRelev(a.relev, a.coverList[0], b.relev, b.coverList[0]);
 }
 
 inline double tileDist(unsigned px, unsigned py, unsigned tileX, unsigned tileY) {
@@ -266,29 +376,92 @@ inline void add_langfield(std::string& s, langfield_type langfield) {
 //
 // we centralize both the adding of the field and extracting of the field here to keep from having
 // to handle that optimization everywhere
-inline langfield_type extract_langfield(std::string const& s) {
-    size_t length = s.length();
-    size_t langfield_start = s.find(LANGFIELD_SEPARATOR) + 1;
+inline langfield_type extract_langfield(const char* data, size_t length) {
+    const char* separator = static_cast<const char*>(memchr(data, LANGFIELD_SEPARATOR, length));
+    if (separator == nullptr) return ALL_LANGUAGES;
+    size_t langfield_start = static_cast<size_t>(separator - data) + 1;
     size_t distance_from_end = length - langfield_start;
 
     if (distance_from_end == 0) {
         return ALL_LANGUAGES;
     } else {
         langfield_type result(0);
-        memcpy(&result, s.data() + langfield_start, distance_from_end);
+        memcpy(&result, data + langfield_start, distance_from_end);
         return result;
     }
 }
 
-inline void packVec(intarray const& varr, std::unique_ptr<rocksdb::DB> const& db, std::string const& key) {
-    std::string message;
+inline langfield_type extract_langfield(std::string const& s) {
+    return extract_langfield(s.data(), s.length());
+}
+
+#define CACHE_MESSAGE 1
+#define CACHE_ITEM 1
+#define CACHE_BLOCKS 2
+
+// the ways a list of grids can be encoded in a message; readers accept either
+enum class GridEncoding {
+    // field CACHE_ITEM: a packed, delta-encoded list of varints
+    varint,
+    // field CACHE_BLOCKS: a block-packed payload, see block_codec.hpp
+    block
+};
+
+// options for writing a cache out with pack or packMmap
+struct PackOptions {
+    GridEncoding encoding = GridEncoding::varint;
+    // filters to build into the tables written by pack; these are only used
+    // when a RocksDBCache is opened with the same settings, see RocksDBOptions
+    int bloom_bits_per_key = 0;
+    bool prefix_bloom = false;
+    // threads to sort, encode and write with; 0 uses one per core
+    unsigned threads = 0;
+    // once everything is written, compact it into a single sorted level for
+    // read-only serving, rewriting every table with bottommost_compression
+    bool finalize = false;
+    // compression for the bottommost level; kDisableCompressionOption uses the
+    // same compression as every other level
+    rocksdb::CompressionType bottommost_compression = rocksdb::kDisableCompressionOption;
+    // bytes of sample data to build a compression dictionary from when
+    // compressing the bottommost level; 0 disables dictionaries
+    uint32_t compression_dict_bytes = 0;
+};
 
+// options for opening a RocksDBCache
+struct RocksDBOptions {
+    // bytes of private block cache for this index; 0 uses the shared block
+    // cache, see configureSharedBlockCache
+    size_t block_cache_size = 0;
+    // read the whole-key bloom filters written by pack with bloom_bits_per_key;
+    // only whether this is non-zero matters when reading
+    int bloom_bits_per_key = 0;
+    // read with the memo prefix extractor, so prefix scans can skip tables
+    // using the prefix blooms written by pack with prefix_bloom
+    bool prefix_bloom = false;
+    int max_open_files = -1;
+    bool mmap_reads = false;
+    // bytes of cache for decoded getmatching results; 0 disables it, see
+    // DecodedGridCache
+    size_t decoded_cache_size = 0;
+};
+
+// sorted grids are stored as a protobuf message holding either a packed,
+// delta-encoded list of varints or a block-packed payload; this is the format
+// of every value in both the RocksDBCache and the MmapCache
+inline void encodeMessage(intarray const& varr, std::string& message, GridEncoding encoding = GridEncoding::varint) {
     protozero::pbf_writer item_writer(message);
 
+    if (encoding == GridEncoding::block) {
+        std::string blocks;
+        encodeGridBlocks(varr, blocks);
+        item_writer.add_bytes(CACHE_BLOCKS, blocks);
+        return;
+    }
+
     {
         // Using new (in protozero 1.3.0) packed writing API
         // https://github.com/mapbox/protozero/commit/4e7e32ac5350ea6d3dcf78ff5e74faeee513a6e1
-        protozero::packed_field_uint64 field{item_writer, 1};
+        protozero::packed_field_uint64 field{item_writer, CACHE_ITEM};
         uint64_t lastval = 0;
         for (auto const& vitem : varr) {
             if (lastval == 0) {
@@ -299,24 +472,142 @@ inline void packVec(intarray const& varr, std::unique_ptr<rocksdb::DB> const& db
             lastval = vitem;
         }
     }
+}
 
+inline void packVec(intarray const& varr, std::unique_ptr<rocksdb::DB> const& db, std::string const& key, GridEncoding encoding = GridEncoding::varint) {
+    std::string message;
+    encodeMessage(varr, message, encoding);
     db->Put(rocksdb::WriteOptions(), key, message);
 }
 
+// the prefix extractor used for prefix blooms; see cpp_util.cpp for how it
+// splits up keys
+std::shared_ptr<const rocksdb::SliceTransform> memoPrefixExtractor();
+
+// Every RocksDBCache that isn't given its own block_cache_size shares one
+// process-wide block cache, so memory use is bounded by a single budget rather
+// than growing with the number of indexes loaded.
+constexpr size_t DEFAULT_SHARED_BLOCK_CACHE_SIZE = 256 * 1024 * 1024;
+
+struct BlockCacheStats {
+    std::string type;
+    size_t capacity;
+    size_t usage;
+    size_t pinned_usage;
+    // counted across every RocksDBCache, whichever block cache it uses
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// sets the shared block cache's capacity, and its type ("lru" or "clock") if
+// it hasn't been created yet; the type can't be changed once any cache is open
+void configureSharedBlockCache(size_t capacity, std::string const& type);
+BlockCacheStats sharedBlockCacheStats();
+
+// rocksdb options for writing or reading a cache with the given settings
+rocksdb::Options packRocksDBOptions(PackOptions const& pack_options);
+rocksdb::Options loadRocksDBOptions(RocksDBOptions const& load_options);
+
+// compacts a packed database as asked for by pack_options.finalize
+void finalizePackedDB(rocksdb::DB& db, PackOptions const& pack_options);
+
+// the number of threads a pack with these options should use
+size_t packThreads(PackOptions const& pack_options);
+
+// Runs fn(i) for every i in [0, shards), each on its own thread (the calling
+// thread takes shard 0), and rethrows the first exception any of them threw
+// once all of them have finished.
+template <typename Fn>
+void parallelShards(size_t shards, Fn&& fn) {
+    std::vector<std::exception_ptr> errors(shards);
+    auto run = [&fn, &errors](size_t i) {
+        try {
+            fn(i);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(shards > 0 ? shards - 1 : 0);
+    try {
+        for (size_t i = 1; i < shards; i++) {
+            threads.emplace_back(run, i);
+        }
+    } catch (...) {
+        // couldn't start a thread; run whatever didn't get one on this thread
+        for (size_t i = threads.size() + 1; i < shards; i++) {
+            run(i);
+        }
+    }
+    if (shards > 0) run(0);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (auto const& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+}
+
+// a key and its encoded value, as written by pack
+typedef std::pair<std::string, std::string> PackedEntry;
+
+// the size at which SstFileSequence moves on to a new file
+constexpr uint64_t PACK_SST_FILE_SIZE = 256 * 1024 * 1024;
+
+// Writes entries, which must be added in strictly increasing key order, into
+// a series of SST files named <path_prefix>-<n>.sst, moving on to a new file
+// every PACK_SST_FILE_SIZE bytes or whenever split() is called. Files are
+// only staged here; whatever is still on disk when the sequence is destroyed
+// (i.e. wasn't moved into a database by ingestSstFiles) is removed.
+class SstFileSequence : noncopyable {
+  public:
+    SstFileSequence(rocksdb::Options const& options, std::string const& path_prefix);
+    ~SstFileSequence();
+
+    void add(rocksdb::Slice const& key, rocksdb::Slice const& value);
+    // finishes the current file, so that the next entry starts a new one
+    void split();
+    // finishes the last file and returns the path of every file written
+    std::vector<std::string> const& finish();
+
+  private:
+    rocksdb::Options options_;
+    std::string path_prefix_;
+    std::unique_ptr<rocksdb::SstFileWriter> writer_;
+    std::vector<std::string> paths_;
+};
+
+// moves a set of non-overlapping SST files into db in one step
+void ingestSstFiles(rocksdb::DB& db, std::vector<std::string> const& paths);
+
+// Merges runs of entries (each sorted by key) into sorted SST files, written
+// in parallel by up to threads threads, and ingests them into db in one step.
+// This skips the memtable, the WAL and the compactions that writing the same
+// entries with Put would go through. directory is where the files are staged
+// before they're moved into the database, normally the database itself.
+void ingestPackedEntries(rocksdb::DB& db, rocksdb::Options const& options, std::string const& directory, std::vector<std::vector<PackedEntry>> const& runs, size_t threads);
+
 // rocksdb is also used in memorycache
 rocksdb::Status OpenDB(const rocksdb::Options& options, const std::string& name, std::unique_ptr<rocksdb::DB>& dbptr);
 rocksdb::Status OpenForReadOnlyDB(const rocksdb::Options& options, const std::string& name, std::unique_ptr<rocksdb::DB>& dbptr);
 
 #define TYPE_MEMORY 1
 #define TYPE_ROCKSDB 2
-
-#define CACHE_MESSAGE 1
-#define CACHE_ITEM 1
+#define TYPE_MMAP 3
 
 #define MEMO_PREFIX_LENGTH_T1 3
 #define MEMO_PREFIX_LENGTH_T2 6
 #define PREFIX_MAX_GRID_LENGTH 500000
 
+// RocksDBCaches store a small metadata record for every key under this prefix
+// plus the key, and a marker under the bare prefix to show that they do
+#define METADATA_PREFIX "=m"
+#define METADATA_VERSION 1
+#define METADATA_MAX_GRID 1
+#define METADATA_COUNT 2
+
 } // namespace carmen
 
 #endif // __CARMEN_CPP_UTIL_HPP__
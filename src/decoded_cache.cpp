@@ -0,0 +1,133 @@
+#include "decoded_cache.hpp"
+
+#include <functional>
+
+namespace carmen {
+
+constexpr size_t DecodedGridCache::SHARDS;
+constexpr size_t DecodedGridCache::LARGE_ENTRY_SHARE;
+constexpr size_t DecodedGridCache::MAX_ENTRY_SHARE;
+constexpr size_t DecodedGridCache::DOORKEEPER_SIZE;
+
+// a rough allowance for the list node, index node and allocator overhead of
+// each entry, so that lots of tiny lists are still bounded by the capacity
+constexpr size_t ENTRY_OVERHEAD = 128;
+
+DecodedGridCache::DecodedGridCache(size_t _capacity)
+    : capacity(_capacity),
+      shard_capacity(_capacity / SHARDS),
+      shards(),
+      hits(0),
+      misses(0),
+      rejected(0),
+      evictions(0) {}
+
+std::string DecodedGridCache::key(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::string out = phrase;
+    out.push_back('\0');
+    out.push_back(static_cast<char>(match_prefixes));
+    out.append(reinterpret_cast<const char*>(&langfield), sizeof(langfield));
+    out.append(reinterpret_cast<const char*>(&max_results), sizeof(max_results));
+    return out;
+}
+
+DecodedGridCache::Shard& DecodedGridCache::shardFor(size_t hash) {
+    // the low bits pick the bucket inside the shard's map, so use high ones
+    return shards[(hash >> 16) % SHARDS];
+}
+
+std::shared_ptr<const intarray> DecodedGridCache::lookup(std::string const& key) {
+    Shard& shard = shardFor(std::hash<std::string>()(key));
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto found = shard.index.find(key);
+    if (found == shard.index.end()) {
+        misses++;
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    hits++;
+    return found->second->grids;
+}
+
+void DecodedGridCache::insert(std::string const& key, std::shared_ptr<const intarray> grids) {
+    size_t hash = std::hash<std::string>()(key);
+    size_t cost = grids->size() * sizeof(uint64_t) + key.size() * 2 + ENTRY_OVERHEAD;
+    Shard& shard = shardFor(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    if (cost > shard_capacity / MAX_ENTRY_SHARE) {
+        rejected++;
+        return;
+    }
+    if (cost > shard_capacity / LARGE_ENTRY_SHARE && shard.doorkeeper.count(hash) == 0) {
+        if (shard.doorkeeper.size() >= DOORKEEPER_SIZE) shard.doorkeeper.clear();
+        shard.doorkeeper.insert(hash);
+        rejected++;
+        return;
+    }
+    shard.doorkeeper.erase(hash);
+
+    // another thread may have decoded the same list at the same time
+    if (shard.index.find(key) != shard.index.end()) return;
+
+    while (shard.usage + cost > shard_capacity && !shard.lru.empty()) {
+        Entry& last = shard.lru.back();
+        shard.usage -= last.cost;
+        shard.index.erase(last.key);
+        shard.lru.pop_back();
+        evictions++;
+    }
+
+    shard.lru.push_front(Entry{key, std::move(grids), cost});
+    shard.index.emplace(key, shard.lru.begin());
+    shard.usage += cost;
+}
+
+DecodedCacheStats DecodedGridCache::stats() const {
+    DecodedCacheStats out{};
+    out.capacity = capacity;
+    for (Shard const& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        out.usage += shard.usage;
+        out.entries += shard.index.size();
+    }
+    out.hits = hits;
+    out.misses = misses;
+    out.rejected = rejected;
+    out.evictions = evictions;
+    return out;
+}
+
+SharedGridCursor::SharedGridCursor(std::shared_ptr<const intarray> _grids)
+    : grids(std::move(_grids)),
+      pos(0),
+      unboosted(std::any_of(grids->begin(), grids->end(), [](uint64_t grid) {
+          return (grid & LANGUAGE_MATCH_BOOST) == 0u;
+      })) {}
+
+bool SharedGridCursor::next(uint64_t& grid) {
+    if (pos == grids->size()) return false;
+    grid = (*grids)[pos++];
+    return true;
+}
+
+CachingGridCursor::CachingGridCursor(std::unique_ptr<GridCursor> _inner, std::shared_ptr<DecodedGridCache> _cache, std::string _key)
+    : inner(std::move(_inner)),
+      cache(std::move(_cache)),
+      key(std::move(_key)),
+      seen(),
+      done(false) {}
+
+bool CachingGridCursor::next(uint64_t& grid) {
+    if (done) return false;
+    if (!inner->next(grid)) {
+        done = true;
+        cache->insert(key, std::make_shared<const intarray>(std::move(seen)));
+        return false;
+    }
+    seen.push_back(grid);
+    return true;
+}
+
+} // namespace carmen
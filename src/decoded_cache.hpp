@@ -0,0 +1,119 @@
+#ifndef __CARMEN_DECODED_CACHE_HPP__
+#define __CARMEN_DECODED_CACHE_HPP__
+
+#include "cpp_util.hpp"
+
+#include <array>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace carmen {
+
+struct DecodedCacheStats {
+    size_t capacity;
+    size_t usage;
+    size_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t rejected;
+    uint64_t evictions;
+};
+
+// A bounded LRU of decoded getmatching results, so that hot phrases (common
+// street words, city names) aren't read and decoded from rocksdb on every
+// query. It's split into shards, each with its own lock and its own share of
+// the capacity, so that lookups from different threadpool threads rarely
+// contend.
+//
+// Admission depends on size, so that a few huge prefix lists can't flush
+// everything else out: lists that would take more than 1/MAX_ENTRY_SHARE of
+// a shard are never kept, and lists that would take more than
+// 1/LARGE_ENTRY_SHARE of a shard are only kept once they've missed twice.
+class DecodedGridCache : noncopyable {
+  public:
+    explicit DecodedGridCache(size_t _capacity);
+
+    // the key for a getmatching query
+    static std::string key(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+
+    // the cached grids for key, or nullptr on a miss
+    std::shared_ptr<const intarray> lookup(std::string const& key);
+
+    // offers the grids for key to the cache, which may decline them
+    void insert(std::string const& key, std::shared_ptr<const intarray> grids);
+
+    DecodedCacheStats stats() const;
+
+  private:
+    static constexpr size_t SHARDS = 16;
+    static constexpr size_t LARGE_ENTRY_SHARE = 64;
+    static constexpr size_t MAX_ENTRY_SHARE = 8;
+    // how many large keys a shard remembers having missed before forgetting
+    // them all and starting again
+    static constexpr size_t DOORKEEPER_SIZE = 1024;
+
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const intarray> grids;
+        size_t cost;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // most recently used first
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        std::unordered_set<size_t> doorkeeper;
+        size_t usage = 0;
+    };
+
+    Shard& shardFor(size_t hash);
+
+    size_t capacity;
+    size_t shard_capacity;
+    std::array<Shard, SHARDS> shards;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> evictions;
+};
+
+// reads cached grids in order; holding the list keeps it alive even if it's
+// evicted in the meantime
+class SharedGridCursor : public GridCursor {
+  public:
+    explicit SharedGridCursor(std::shared_ptr<const intarray> _grids);
+
+    bool next(uint64_t& grid) override;
+    bool mayProduceUnboosted() const override { return unboosted; }
+
+  private:
+    std::shared_ptr<const intarray> grids;
+    size_t pos;
+    bool unboosted;
+};
+
+// passes through the grids of another cursor, and offers them to the cache
+// if they're read to the end; cursors that are abandoned early don't have a
+// complete list, so they don't
+class CachingGridCursor : public GridCursor {
+  public:
+    CachingGridCursor(std::unique_ptr<GridCursor> _inner, std::shared_ptr<DecodedGridCache> _cache, std::string _key);
+
+    bool next(uint64_t& grid) override;
+    bool mayProduceUnboosted() const override { return inner->mayProduceUnboosted(); }
+
+  private:
+    std::unique_ptr<GridCursor> inner;
+    std::shared_ptr<DecodedGridCache> cache;
+    std::string key;
+    intarray seen;
+    bool done;
+};
+
+} // namespace carmen
+
+#endif // __CARMEN_DECODED_CACHE_HPP__
@@ -0,0 +1,120 @@
+#ifndef __CARMEN_FLAT_HASH_MAP_HPP__
+#define __CARMEN_FLAT_HASH_MAP_HPP__
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace carmen {
+
+// An open-addressing hash map from uint64_t keys to small values, for the
+// hot loops in coalesce where std::map's per-node allocations and pointer
+// chasing dominate. Keys and values live in two flat arrays, collisions are
+// resolved by linear probing, and the table doubles when it's half full.
+// There is no erase; clear() empties the table but keeps its memory, so one
+// map can be reused across requests.
+//
+// UINT64_MAX is reserved to mark empty slots and can't be used as a key;
+// none of the keys coalesce uses (packed zxy, tmpid) can reach it.
+template <typename Value>
+class FlatHashMap {
+  public:
+    static constexpr uint64_t EMPTY_KEY = ~static_cast<uint64_t>(0);
+
+    FlatHashMap()
+        : keys_(),
+          values_(),
+          size_(0),
+          mask_(0) {}
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // returns the value stored for key, or nullptr if there isn't one
+    Value* find(uint64_t key) {
+        if (size_ == 0) return nullptr;
+        for (size_t slot = slotFor(key);; slot = (slot + 1) & mask_) {
+            if (keys_[slot] == key) return &values_[slot];
+            if (keys_[slot] == EMPTY_KEY) return nullptr;
+        }
+    }
+
+    Value const* find(uint64_t key) const {
+        return const_cast<FlatHashMap*>(this)->find(key);
+    }
+
+    // returns the value stored for key, inserting a value-initialized one if
+    // there isn't one; the bool is true if the value was inserted. The pointer
+    // is only valid until the next insert.
+    std::pair<Value*, bool> emplace(uint64_t key) {
+        assert(key != EMPTY_KEY);
+        if ((size_ + 1) * 2 > keys_.size()) grow();
+
+        size_t slot = slotFor(key);
+        for (; keys_[slot] != EMPTY_KEY; slot = (slot + 1) & mask_) {
+            if (keys_[slot] == key) return std::make_pair(&values_[slot], false);
+        }
+        keys_[slot] = key;
+        values_[slot] = Value();
+        size_++;
+        return std::make_pair(&values_[slot], true);
+    }
+
+    // calls fn(key, value) for every entry, in no particular order
+    template <typename Fn>
+    void forEach(Fn&& fn) {
+        for (size_t slot = 0; slot < keys_.size(); slot++) {
+            if (keys_[slot] != EMPTY_KEY) fn(keys_[slot], values_[slot]);
+        }
+    }
+
+    void clear() {
+        if (size_ == 0) return;
+        std::fill(keys_.begin(), keys_.end(), EMPTY_KEY);
+        size_ = 0;
+    }
+
+  private:
+    static constexpr size_t MIN_CAPACITY = 64;
+
+    // fibonacci hashing: multiplying by 2^64 / phi spreads the sequential,
+    // low-entropy keys coalesce uses across the whole table
+    size_t slotFor(uint64_t key) const {
+        return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+    }
+
+    void grow() {
+        std::vector<uint64_t> old_keys(keys_.empty() ? MIN_CAPACITY : keys_.size() * 2, EMPTY_KEY);
+        std::vector<Value> old_values(old_keys.size());
+        old_keys.swap(keys_);
+        old_values.swap(values_);
+        mask_ = keys_.size() - 1;
+
+        for (size_t i = 0; i < old_keys.size(); i++) {
+            if (old_keys[i] == EMPTY_KEY) continue;
+            size_t slot = slotFor(old_keys[i]);
+            while (keys_[slot] != EMPTY_KEY) {
+                slot = (slot + 1) & mask_;
+            }
+            keys_[slot] = old_keys[i];
+            values_[slot] = std::move(old_values[i]);
+        }
+    }
+
+    std::vector<uint64_t> keys_;
+    std::vector<Value> values_;
+    size_t size_;
+    size_t mask_;
+};
+
+template <typename Value>
+constexpr uint64_t FlatHashMap<Value>::EMPTY_KEY;
+template <typename Value>
+constexpr size_t FlatHashMap<Value>::MIN_CAPACITY;
+
+} // namespace carmen
+
+#endif // __CARMEN_FLAT_HASH_MAP_HPP__
@@ -0,0 +1,141 @@
+#include "frozen_index.hpp"
+
+#include <algorithm>
+
+namespace carmen {
+
+constexpr size_t FrozenGridIndex::KEY_BLOCK_SIZE;
+constexpr size_t FrozenGridIndex::npos;
+
+namespace {
+
+void appendVarint(std::string& out, size_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+size_t readVarint(std::string const& in, size_t& pos) {
+    size_t value = 0;
+    unsigned shift = 0;
+    while (true) {
+        auto byte = static_cast<unsigned char>(in[pos++]);
+        value |= static_cast<size_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return value;
+        shift += 7;
+    }
+}
+
+} // namespace
+
+FrozenGridIndex::FrozenGridIndex(arraycache& cache)
+    : keys(),
+      block_offsets(),
+      postings(),
+      offsets() {
+    size_t total = 0;
+    for (auto const& item : cache) {
+        total += item.second.size();
+    }
+    postings.reserve(total);
+    offsets.reserve(cache.size() + 1);
+    offsets.push_back(0);
+
+    std::string previous;
+    for (auto item = cache.begin(); item != cache.end(); item = cache.erase(item)) {
+        key_type const& key = item->first;
+        size_t shared = 0;
+        if (size() % KEY_BLOCK_SIZE == 0) {
+            block_offsets.push_back(keys.size());
+        } else {
+            size_t limit = std::min(previous.size(), key.size());
+            while (shared < limit && previous[shared] == key[shared]) shared++;
+        }
+        appendVarint(keys, shared);
+        appendVarint(keys, key.size() - shared);
+        keys.append(key, shared, std::string::npos);
+        previous = key;
+
+        intarray& grids = item->second;
+        std::sort(grids.begin(), grids.end(), std::greater<uint64_t>());
+        grids.erase(std::unique(grids.begin(), grids.end()), grids.end());
+        postings.insert(postings.end(), grids.begin(), grids.end());
+        offsets.push_back(postings.size());
+    }
+    // deduplicating may have left room to spare
+    postings.shrink_to_fit();
+    keys.shrink_to_fit();
+}
+
+void FrozenGridIndex::decodeKey(size_t& pos, std::string& key) const {
+    size_t shared = readVarint(keys, pos);
+    size_t length = readVarint(keys, pos);
+    key.resize(shared);
+    key.append(keys, pos, length);
+    pos += length;
+}
+
+std::string FrozenGridIndex::blockKey(size_t block) const {
+    std::string key;
+    size_t pos = block_offsets[block];
+    decodeKey(pos, key);
+    return key;
+}
+
+size_t FrozenGridIndex::lowerBound(std::string const& key) const {
+    // the last block whose first key is not greater than key; the answer is
+    // in that block, or is the first key of the next one
+    size_t low = 0;
+    size_t high = block_offsets.size();
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (blockKey(mid) <= key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) return 0;
+
+    size_t found = std::min(low * KEY_BLOCK_SIZE, size());
+    scan((low - 1) * KEY_BLOCK_SIZE, [&](size_t i, std::string const& candidate) {
+        if (i >= low * KEY_BLOCK_SIZE) return false;
+        if (candidate >= key) {
+            found = i;
+            return false;
+        }
+        return true;
+    });
+    return found;
+}
+
+size_t FrozenGridIndex::find(std::string const& key) const {
+    size_t i = lowerBound(key);
+    if (i == size()) return npos;
+    size_t match = npos;
+    scan(i, [&](size_t j, std::string const& candidate) {
+        if (candidate == key) match = j;
+        return false;
+    });
+    return match;
+}
+
+size_t FrozenGridIndex::memoryUsage() const {
+    return keys.capacity() +
+           block_offsets.capacity() * sizeof(size_t) +
+           postings.capacity() * sizeof(uint64_t) +
+           offsets.capacity() * sizeof(size_t);
+}
+
+arraycache FrozenGridIndex::thaw() const {
+    arraycache out;
+    scan(0, [&](size_t i, std::string const& key) {
+        out.emplace_hint(out.end(), key, intarray(gridsBegin(i), gridsEnd(i)));
+        return true;
+    });
+    return out;
+}
+
+} // namespace carmen
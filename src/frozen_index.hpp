@@ -0,0 +1,85 @@
+#ifndef __CARMEN_FROZEN_INDEX_HPP__
+#define __CARMEN_FROZEN_INDEX_HPP__
+
+#include "cpp_util.hpp"
+
+namespace carmen {
+
+// the grids of one key, read in place, and whether the key matched the
+// langfield of the lookup that found it
+struct GridRange {
+    const uint64_t* begin;
+    const uint64_t* end;
+    bool matches_language;
+};
+
+// An immutable, compact copy of a MemoryCache's contents, made by
+// MemoryCache::freeze once an index has been loaded.
+//
+// Every key's grids are sorted in descending order, deduplicated, and stored
+// back to back in one contiguous postings buffer, with an offset table saying
+// where each key's grids start. Keys are kept in the same order as the map
+// they came from, front-coded in blocks of KEY_BLOCK_SIZE: each key is stored
+// as the length of the prefix it shares with the key before it, then the rest
+// of it, so the long runs of keys that share a phrase (and differ only in
+// their langfield) take little more than their suffixes. The first key of
+// each block shares nothing, so lookups binary search the blocks by their
+// first key and then decode at most one block.
+class FrozenGridIndex : noncopyable {
+  public:
+    static constexpr size_t KEY_BLOCK_SIZE = 16;
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    // empties cache as it goes, so the map and the frozen copy are never both
+    // fully in memory
+    explicit FrozenGridIndex(arraycache& cache);
+
+    // the number of keys
+    size_t size() const { return offsets.size() - 1; }
+
+    // the index of key, or npos if there's no such key
+    size_t find(std::string const& key) const;
+    // the index of the first key not less than key, or size() if there's none
+    size_t lowerBound(std::string const& key) const;
+
+    // the grids of key i, sorted in descending order without duplicates
+    const uint64_t* gridsBegin(size_t i) const { return postings.data() + offsets[i]; }
+    const uint64_t* gridsEnd(size_t i) const { return postings.data() + offsets[i + 1]; }
+
+    // Calls fn(i, key) for the keys from index start on, in order, for as
+    // long as it returns true.
+    template <class Fn>
+    void scan(size_t start, Fn&& fn) const {
+        if (start >= size()) return;
+        std::string key;
+        size_t block = start / KEY_BLOCK_SIZE;
+        size_t pos = block_offsets[block];
+        for (size_t i = block * KEY_BLOCK_SIZE; i < size(); i++) {
+            decodeKey(pos, key);
+            if (i >= start && !fn(i, key)) return;
+        }
+    }
+
+    // the bytes the index takes up
+    size_t memoryUsage() const;
+
+    // the map the index was made from, with the grids sorted and deduplicated
+    arraycache thaw() const;
+
+  private:
+    void decodeKey(size_t& pos, std::string& key) const;
+    // the first key of a block
+    std::string blockKey(size_t block) const;
+
+    std::string keys;
+    // where each block of keys starts in keys
+    std::vector<size_t> block_offsets;
+    intarray postings;
+    // size() + 1 entries; key i's grids are postings[offsets[i]] up to
+    // postings[offsets[i + 1]]
+    std::vector<size_t> offsets;
+};
+
+} // namespace carmen
+
+#endif // __CARMEN_FROZEN_INDEX_HPP__
@@ -0,0 +1,327 @@
+#include "grid_dump.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace carmen {
+
+namespace {
+
+// grids are read this many at a time, so that a corrupt count fails as a
+// truncated record rather than as one huge allocation
+constexpr size_t GRID_READ_CHUNK = 65536;
+// and phrases this many bytes at a time, for the same reason
+constexpr size_t PHRASE_READ_CHUNK = 65536;
+
+// skipped JSON values are skipped recursively, so nesting is limited to keep a
+// malicious or broken line from overflowing the stack
+constexpr size_t MAX_JSON_DEPTH = 64;
+
+uint64_t readLittleEndian(const unsigned char* bytes, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = size; i-- > 0;) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// Parses one line of an NDJSON grid dump. Only as much of JSON as the format
+// needs is understood in detail; values under any other key are skipped.
+class JSONLineParser {
+  public:
+    JSONLineParser(std::string const& _text, size_t _line)
+        : text(_text),
+          pos(0),
+          line(_line) {}
+
+    void parse(GridDumpRecord& record) {
+        bool has_id = false;
+        bool has_grids = false;
+        record.langfield = ALL_LANGUAGES;
+        record.grids.clear();
+
+        expect('{');
+        if (!consume('}')) {
+            do {
+                std::string key = string();
+                expect(':');
+                if (key == "id") {
+                    record.phrase = string();
+                    has_id = true;
+                } else if (key == "grids") {
+                    grids(record.grids);
+                    has_grids = true;
+                } else if (key == "languages") {
+                    record.langfield = languages();
+                } else {
+                    skipValue();
+                }
+            } while (consume(','));
+            expect('}');
+        }
+        skipSpace();
+        if (pos != text.size()) fail("unexpected characters after the object");
+        if (!has_id || record.phrase.empty()) fail("id must be a non-empty string");
+        if (!has_grids) fail("missing grids");
+    }
+
+  private:
+    [[noreturn]] void fail(std::string const& message) const {
+        throw std::invalid_argument("line " + std::to_string(line) + ": " + message);
+    }
+
+    void skipSpace() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n')) pos++;
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c) {
+        if (!consume(c)) fail(std::string("expected '") + c + "'");
+    }
+
+    bool consumeLiteral(const char* literal) {
+        skipSpace();
+        size_t length = strlen(literal);
+        if (text.compare(pos, length, literal) != 0) return false;
+        pos += length;
+        return true;
+    }
+
+    unsigned hex4() {
+        if (pos + 4 > text.size()) fail("truncated \\u escape");
+        unsigned value = 0;
+        for (size_t end = pos + 4; pos < end; pos++) {
+            char c = text[pos];
+            value <<= 4;
+            if (c >= '0' && c <= '9') {
+                value |= static_cast<unsigned>(c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                value |= static_cast<unsigned>(c - 'a' + 10);
+            } else if (c >= 'A' && c <= 'F') {
+                value |= static_cast<unsigned>(c - 'A' + 10);
+            } else {
+                fail("bad \\u escape");
+            }
+        }
+        return value;
+    }
+
+    static void appendUTF8(std::string& out, unsigned code) {
+        if (code < 0x80) {
+            out.push_back(static_cast<char>(code));
+        } else if (code < 0x800) {
+            out.push_back(static_cast<char>(0xc0 | (code >> 6)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        } else if (code < 0x10000) {
+            out.push_back(static_cast<char>(0xe0 | (code >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        } else {
+            out.push_back(static_cast<char>(0xf0 | (code >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (code & 0x3f)));
+        }
+    }
+
+    std::string string() {
+        expect('"');
+        std::string out;
+        while (true) {
+            if (pos >= text.size()) fail("unterminated string");
+            char c = text[pos++];
+            if (c == '"') return out;
+            if (c != '\\') {
+                out.push_back(c);
+                continue;
+            }
+            if (pos >= text.size()) fail("unterminated string");
+            switch (text[pos++]) {
+            case '"': out.push_back('"'); break;
+            case '\\': out.push_back('\\'); break;
+            case '/': out.push_back('/'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                unsigned code = hex4();
+                // a surrogate pair encodes one code point outside the BMP
+                if (code >= 0xd800 && code < 0xdc00 && text.compare(pos, 2, "\\u") == 0) {
+                    pos += 2;
+                    unsigned low = hex4();
+                    if (low < 0xdc00 || low >= 0xe000) fail("bad surrogate pair");
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                appendUTF8(out, code);
+                break;
+            }
+            default:
+                fail("bad escape");
+            }
+        }
+    }
+
+    // a non-negative integer, exact up to 2^64 - 1
+    uint64_t integer(const char* what) {
+        skipSpace();
+        size_t start = pos;
+        uint64_t value = 0;
+        while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+            uint64_t digit = static_cast<uint64_t>(text[pos] - '0');
+            if (value > (std::numeric_limits<uint64_t>::max() - digit) / 10) fail(std::string(what) + " out of range");
+            value = value * 10 + digit;
+            pos++;
+        }
+        if (pos == start || (pos < text.size() && (text[pos] == '.' || text[pos] == 'e' || text[pos] == 'E'))) {
+            fail(std::string(what) + " must be non-negative integers");
+        }
+        return value;
+    }
+
+    void grids(intarray& out) {
+        expect('[');
+        if (consume(']')) return;
+        do {
+            out.push_back(integer("grids"));
+        } while (consume(','));
+        expect(']');
+    }
+
+    langfield_type languages() {
+        if (consumeLiteral("null")) return ALL_LANGUAGES;
+        langfield_type out = 0;
+        expect('[');
+        if (consume(']')) return out;
+        do {
+            uint64_t language = integer("languages");
+            if (language > MAX_LANG) fail("languages must be at most " + std::to_string(MAX_LANG));
+            out |= static_cast<langfield_type>(1) << language;
+        } while (consume(','));
+        expect(']');
+        return out;
+    }
+
+    void skipValue(size_t depth = 0) {
+        skipSpace();
+        if (pos >= text.size()) fail("expected a value");
+        char c = text[pos];
+        if (c == '"') {
+            string();
+        } else if (c == '[' || c == '{') {
+            if (depth >= MAX_JSON_DEPTH) fail("values nested more than " + std::to_string(MAX_JSON_DEPTH) + " deep");
+            char close = c == '[' ? ']' : '}';
+            pos++;
+            if (consume(close)) return;
+            do {
+                if (close == '}') {
+                    string();
+                    expect(':');
+                }
+                skipValue(depth + 1);
+            } while (consume(','));
+            expect(close);
+        } else if (!(consumeLiteral("true") || consumeLiteral("false") || consumeLiteral("null"))) {
+            size_t start = pos;
+            while (pos < text.size() && strchr("+-0123456789.eE", text[pos]) != nullptr) pos++;
+            if (pos == start) fail("expected a value");
+        }
+    }
+
+    std::string const& text;
+    size_t pos;
+    size_t line;
+};
+
+} // namespace
+
+GridDumpReader::GridDumpReader(std::string const& filename)
+    : in(filename, std::ios::in | std::ios::binary),
+      binary(false),
+      position(1),
+      line() {
+    if (!in) {
+        throw std::invalid_argument("unable to open grid dump " + filename);
+    }
+    char magic[GRID_DUMP_MAGIC_LENGTH];
+    in.read(magic, GRID_DUMP_MAGIC_LENGTH);
+    if (in.gcount() == static_cast<std::streamsize>(GRID_DUMP_MAGIC_LENGTH) && memcmp(magic, GRID_DUMP_MAGIC, GRID_DUMP_MAGIC_LENGTH) == 0) {
+        binary = true;
+    } else {
+        in.clear();
+        in.seekg(0);
+    }
+}
+
+bool GridDumpReader::next(GridDumpRecord& record) {
+    return binary ? nextBinary(record) : nextJSON(record);
+}
+
+bool GridDumpReader::nextJSON(GridDumpRecord& record) {
+    while (std::getline(in, line)) {
+        size_t current = position++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        JSONLineParser(line, current).parse(record);
+        return true;
+    }
+    if (in.bad()) throw std::invalid_argument("error reading grid dump");
+    return false;
+}
+
+bool GridDumpReader::nextBinary(GridDumpRecord& record) {
+    size_t current = position;
+    auto read = [&](void* out, size_t size) {
+        in.read(static_cast<char*>(out), static_cast<std::streamsize>(size));
+        if (in.gcount() != static_cast<std::streamsize>(size)) {
+            throw std::invalid_argument("record " + std::to_string(current) + ": truncated");
+        }
+    };
+
+    unsigned char header[4];
+    in.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (in.gcount() == 0 && in.eof()) return false;
+    if (in.gcount() != sizeof(header)) {
+        throw std::invalid_argument("record " + std::to_string(current) + ": truncated");
+    }
+    position++;
+
+    size_t phrase_length = static_cast<size_t>(readLittleEndian(header, 4));
+    if (phrase_length == 0) {
+        throw std::invalid_argument("record " + std::to_string(current) + ": empty phrase");
+    }
+    record.phrase.clear();
+    while (record.phrase.size() < phrase_length) {
+        size_t start = record.phrase.size();
+        record.phrase.resize(start + std::min(phrase_length - start, PHRASE_READ_CHUNK));
+        read(&record.phrase[start], record.phrase.size() - start);
+    }
+
+    unsigned char languages[16];
+    read(languages, sizeof(languages));
+    record.langfield = (static_cast<langfield_type>(readLittleEndian(languages + 8, 8)) << 64) | readLittleEndian(languages, 8);
+
+    read(header, sizeof(header));
+    size_t count = static_cast<size_t>(readLittleEndian(header, 4));
+    record.grids.clear();
+    std::vector<unsigned char> bytes;
+    while (record.grids.size() < count) {
+        size_t chunk = std::min(count - record.grids.size(), GRID_READ_CHUNK);
+        bytes.resize(chunk * sizeof(uint64_t));
+        read(bytes.data(), bytes.size());
+        for (size_t i = 0; i < chunk; i++) {
+            record.grids.push_back(readLittleEndian(&bytes[i * sizeof(uint64_t)], sizeof(uint64_t)));
+        }
+    }
+    return true;
+}
+
+} // namespace carmen
@@ -0,0 +1,60 @@
+#ifndef __CARMEN_GRID_DUMP_HPP__
+#define __CARMEN_GRID_DUMP_HPP__
+
+#include "cpp_util.hpp"
+
+#include <fstream>
+
+namespace carmen {
+
+// the first bytes of a binary grid dump
+constexpr const char GRID_DUMP_MAGIC[] = "CMGRIDS1";
+constexpr size_t GRID_DUMP_MAGIC_LENGTH = sizeof(GRID_DUMP_MAGIC) - 1;
+
+// one record of a grid dump: the grids of a phrase for a set of languages, as
+// they'd be passed to MemoryCache::_set
+struct GridDumpRecord {
+    std::string phrase;
+    langfield_type langfield;
+    intarray grids;
+};
+
+// Reads the grid dumps MemoryCache::loadFile accepts, a record at a time, so
+// a dump never has to fit in memory at once. There are two formats, told
+// apart by the first bytes of the file:
+//
+// binary, which starts with GRID_DUMP_MAGIC and is followed by records of
+//   uint32 phrase length, then the phrase
+//   uint8  languages[16], the 128-bit language bitmask (all 0xff for every
+//          language)
+//   uint32 grid count, then uint64 grids[count]
+// with every integer little-endian;
+//
+// or NDJSON, with one object per line:
+//   {"id": "phrase", "grids": [grid, ...], "languages": [0, 3]}
+// where languages is optional, as for _set, and grids are read as exact
+// 64-bit integers rather than doubles. Blank lines are skipped.
+//
+// Malformed input throws std::invalid_argument, naming the line or record.
+class GridDumpReader : noncopyable {
+  public:
+    explicit GridDumpReader(std::string const& filename);
+
+    // fills record with the next record and returns true, or returns false
+    // at the end of the file
+    bool next(GridDumpRecord& record);
+
+  private:
+    bool nextBinary(GridDumpRecord& record);
+    bool nextJSON(GridDumpRecord& record);
+
+    std::ifstream in;
+    bool binary;
+    // the line or record next reads
+    size_t position;
+    std::string line;
+};
+
+} // namespace carmen
+
+#endif // __CARMEN_GRID_DUMP_HPP__
@@ -1,6 +1,11 @@
 
 #include "memorycache.hpp"
 #include "cpp_util.hpp"
+#include "grid_dump.hpp"
+#include "mmapcache.hpp"
+
+#include <deque>
+#include <iterator>
 
 namespace carmen {
 
@@ -10,6 +15,14 @@ intarray MemoryCache::__get(const std::string& phrase, langfield_type langfield)
     std::string phrase_with_langfield = phrase;
 
     add_langfield(phrase_with_langfield, langfield);
+    if (frozen_) {
+        // frozen lists are stored sorted, so they're just copied out
+        size_t i = frozen_->find(phrase_with_langfield);
+        if (i != FrozenGridIndex::npos) {
+            array.assign(frozen_->gridsBegin(i), frozen_->gridsEnd(i));
+        }
+        return array;
+    }
     auto aitr = cache.find(phrase_with_langfield);
     if (aitr != cache.end()) {
         array = aitr->second;
@@ -18,144 +31,391 @@ intarray MemoryCache::__get(const std::string& phrase, langfield_type langfield)
     return array;
 }
 
-intarray MemoryCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
-    intarray array;
+// returns the grids of every key matching the phrase, in key order, pointing
+// into whichever of cache_ and frozen_ holds them
+std::vector<GridRange> MemoryCache::matchingRanges(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, Interrupt const* interrupt) const {
     std::string phrase = phrase_ref;
+    std::vector<GridRange> ranges;
+    size_t polls = 0;
 
     if (match_prefixes == PrefixMatch::disabled) phrase.push_back(LANGFIELD_SEPARATOR);
     size_t phrase_length = phrase.length();
     const char* phrase_data = phrase.data();
-    // Load values from memory cache
 
-    for (auto const& item : this->cache_) {
-        const char* item_data = item.first.data();
-        size_t item_length = item.first.length();
+    // returns false once past the keys that start with the phrase
+    auto visit = [&](key_type const& key, const uint64_t* begin, const uint64_t* end) {
+        const char* item_data = key.data();
+        size_t item_length = key.length();
+
+        if (item_length < phrase_length || memcmp(phrase_data, item_data, phrase_length) != 0) return false;
+        if (interrupt != nullptr) interrupt->poll(polls);
+
+        if (match_prefixes == PrefixMatch::word_boundary) {
+            // keys always contain a LANGFIELD_SEPARATOR after the phrase, and we
+            // only get here if the key is at least as long as the input, so
+            // it's safe to read one character beyond it
+            size_t end_of_phrase = phrase_length;
+            if (item_data[end_of_phrase] != LANGFIELD_SEPARATOR && item_data[end_of_phrase] != ' ') {
+                return true;
+            }
+        }
+        langfield_type message_langfield = extract_langfield(key);
+        ranges.push_back(GridRange{begin, end, (message_langfield & langfield) != 0u});
+        return true;
+    };
+
+    // both are ordered, so every key that starts with the phrase sits in one
+    // contiguous run beginning at the lower bound of the phrase; walk just
+    // that run instead of comparing against every key in the cache
+    if (frozen_) {
+        frozen_->scan(frozen_->lowerBound(phrase), [&](size_t i, key_type const& key) {
+            return visit(key, frozen_->gridsBegin(i), frozen_->gridsEnd(i));
+        });
+    } else {
+        for (auto itr = this->cache_.lower_bound(phrase); itr != this->cache_.end(); ++itr) {
+            intarray const& grids = itr->second;
+            if (!visit(itr->first, grids.data(), grids.data() + grids.size())) break;
+        }
+    }
+    return ranges;
+}
 
-        if (item_length < phrase_length) continue;
+// appends the grids of every key matching the phrase to array, unsorted, and
+// returns whether any of them came from a key that doesn't match langfield
+bool MemoryCache::collectMatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, intarray& array, Interrupt const* interrupt) {
+    bool unboosted = false;
 
-        if (memcmp(phrase_data, item_data, phrase_length) == 0) {
-            if (match_prefixes == PrefixMatch::word_boundary) {
-                size_t end = phrase_length;
-                if (item_data[end] != LANGFIELD_SEPARATOR && item_data[end] != ' ') {
-                    continue;
-                }
+    for (GridRange const& range : matchingRanges(phrase_ref, match_prefixes, langfield, interrupt)) {
+        if (range.matches_language) {
+            array.reserve(array.size() + static_cast<size_t>(range.end - range.begin));
+            for (const uint64_t* grid = range.begin; grid != range.end; ++grid) {
+                array.emplace_back(*grid | LANGUAGE_MATCH_BOOST);
             }
-            langfield_type message_langfield = extract_langfield(item.first);
-
-            if ((message_langfield & langfield) != 0u) {
-                array.reserve(array.size() + item.second.size());
-                for (auto const& grid : item.second) {
-                    array.emplace_back(grid | LANGUAGE_MATCH_BOOST);
-                }
-            } else {
-                array.insert(array.end(), item.second.begin(), item.second.end());
+        } else {
+            array.insert(array.end(), range.begin, range.end);
+            unboosted = unboosted || range.begin != range.end;
+        }
+    }
+    return unboosted;
+}
+
+// Merges the already-sorted lists of a frozen cache, a grid at a time, with a
+// heap holding the head of each list, so no list is ever copied or re-sorted.
+//
+// Grids set from a BigUint64Array can already have LANGUAGE_MATCH_BOOST set,
+// and a list sorted in descending order holds those first. Setting the boost
+// on every grid of a list keeps each of those two runs sorted, but not the
+// list as a whole, so the lists of keys that match the language are merged
+// as two runs each.
+class FrozenGridCursor : public GridCursor {
+  public:
+    FrozenGridCursor(std::vector<GridRange>&& _ranges, size_t _max_results)
+        : ranges(),
+          heap(),
+          remaining(_max_results),
+          unboosted(false) {
+        ranges.reserve(_ranges.size());
+        for (GridRange const& range : _ranges) {
+            if (!range.matches_language) {
+                ranges.push_back(range);
+                continue;
             }
+            const uint64_t* split = std::partition_point(range.begin, range.end, [](uint64_t grid) {
+                return (grid & LANGUAGE_MATCH_BOOST) != 0;
+            });
+            ranges.push_back(GridRange{range.begin, split, true});
+            ranges.push_back(GridRange{split, range.end, true});
+        }
+        heap.reserve(ranges.size());
+        for (size_t i = 0; i < ranges.size(); i++) {
+            if (ranges[i].begin == ranges[i].end) continue;
+            unboosted = unboosted || !ranges[i].matches_language;
+            heap.emplace_back(head(i), i);
+        }
+        std::make_heap(heap.begin(), heap.end());
+    }
+
+    bool next(uint64_t& grid) override {
+        if (remaining == 0 || heap.empty()) return false;
+        std::pop_heap(heap.begin(), heap.end());
+        grid = heap.back().first;
+        size_t i = heap.back().second;
+        heap.pop_back();
+        remaining--;
+
+        if (++ranges[i].begin != ranges[i].end) {
+            heap.emplace_back(head(i), i);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        return true;
+    }
+
+    bool mayProduceUnboosted() const override { return unboosted; }
+
+  private:
+    uint64_t head(size_t i) const {
+        return ranges[i].matches_language ? (*ranges[i].begin | LANGUAGE_MATCH_BOOST) : *ranges[i].begin;
+    }
+
+    std::vector<GridRange> ranges;
+    // the head of each list that isn't used up, and which list it's from
+    std::vector<std::pair<uint64_t, size_t>> heap;
+    size_t remaining;
+    bool unboosted;
+};
+
+intarray MemoryCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, Interrupt const* interrupt) {
+    intarray array;
+    if (frozen_) {
+        std::vector<GridRange> ranges = matchingRanges(phrase_ref, match_prefixes, langfield, interrupt);
+        size_t total = 0;
+        for (GridRange const& range : ranges) {
+            total += static_cast<size_t>(range.end - range.begin);
+        }
+        array.reserve(std::min(total, max_results));
+
+        FrozenGridCursor cursor(std::move(ranges), max_results);
+        uint64_t grid;
+        size_t polls = 0;
+        while (cursor.next(grid)) {
+            if (interrupt != nullptr) interrupt->poll(polls);
+            array.push_back(grid);
         }
+        return array;
     }
+    collectMatching(phrase_ref, match_prefixes, langfield, array, interrupt);
     std::sort(array.begin(), array.end(), std::greater<uint64_t>());
     if (array.size() > max_results) array.resize(max_results);
     return array;
 }
 
+std::vector<intarray> MemoryCache::__getmatchingMany(std::vector<MatchingQuery> const& queries, Interrupt const* interrupt) {
+    std::vector<intarray> results;
+    results.reserve(queries.size());
+    for (MatchingQuery const& query : queries) {
+        if (interrupt != nullptr) interrupt->check();
+        results.push_back(__getmatching(query.phrase, query.match_prefixes, query.langfield, query.max_results, interrupt));
+    }
+    return results;
+}
+
+// Rather than sorting every matching grid up front, the cursor heapifies them
+// (which is linear) and pops them off one at a time, so a caller that stops
+// after k grids only pays O(k log n) for ordering them.
+class MemoryGridCursor : public GridCursor {
+  public:
+    MemoryGridCursor(intarray&& _grids, size_t _max_results, bool _unboosted)
+        : heap(std::move(_grids)),
+          remaining(_max_results),
+          unboosted(_unboosted) {
+        std::make_heap(heap.begin(), heap.end());
+    }
+
+    bool next(uint64_t& grid) override {
+        if (remaining == 0 || heap.empty()) return false;
+        std::pop_heap(heap.begin(), heap.end());
+        grid = heap.back();
+        heap.pop_back();
+        remaining--;
+        return true;
+    }
+
+    bool mayProduceUnboosted() const override { return unboosted; }
+
+  private:
+    intarray heap;
+    size_t remaining;
+    bool unboosted;
+};
+
+std::unique_ptr<GridCursor> MemoryCache::__getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    if (frozen_) {
+        return std::unique_ptr<GridCursor>(new FrozenGridCursor(matchingRanges(phrase_ref, match_prefixes, langfield, nullptr), max_results));
+    }
+    intarray array;
+    bool unboosted = collectMatching(phrase_ref, match_prefixes, langfield, array);
+    return std::unique_ptr<GridCursor>(new MemoryGridCursor(std::move(array), max_results, unboosted));
+}
+
 MemoryCache::MemoryCache() = default;
 
 MemoryCache::~MemoryCache() = default;
 
-bool MemoryCache::pack(const std::string& filename) {
-    std::unique_ptr<rocksdb::DB> db;
-    rocksdb::Options options;
-    options.create_if_missing = true;
-    rocksdb::Status status = OpenDB(options, filename, db);
+typedef std::map<key_type, std::deque<value_type>> memoized_prefix_map;
 
-    if (!status.ok()) {
-        throw std::invalid_argument("unable to open rocksdb file for packing");
+// adds a key's grids to the memoized prefix lists for the first
+// MEMO_PREFIX_LENGTH_T1 and MEMO_PREFIX_LENGTH_T2 characters of its phrase
+void addMemoizedPrefixes(memoized_prefix_map& memoized_prefixes, key_type const& key, intarray const& varr) {
+    std::string prefix_t1;
+    std::string prefix_t2;
+
+    // add this to the memoized prefix array too, maybe
+    auto phrase_length = key.find(LANGFIELD_SEPARATOR);
+    // use the full string for things shorter than the limit
+    // or the prefix otherwise
+    if (phrase_length < MEMO_PREFIX_LENGTH_T1) {
+        prefix_t1 = "=1" + key;
+    } else {
+        // get the prefix, then append the langfield back onto it again
+        langfield_type langfield = extract_langfield(key);
+
+        prefix_t1 = "=1" + key.substr(0, MEMO_PREFIX_LENGTH_T1);
+        add_langfield(prefix_t1, langfield);
+
+        if (phrase_length < MEMO_PREFIX_LENGTH_T2) {
+            prefix_t2 = "=2" + key;
+        } else {
+            prefix_t2 = "=2" + key.substr(0, MEMO_PREFIX_LENGTH_T2);
+            add_langfield(prefix_t2, langfield);
+        }
     }
 
-    std::map<key_type, std::deque<value_type>> memoized_prefixes;
+    if (!prefix_t1.empty()) {
+        std::deque<value_type>& buf = memoized_prefixes[prefix_t1];
+        buf.insert(buf.end(), varr.begin(), varr.end());
+    }
+    if (!prefix_t2.empty()) {
+        std::deque<value_type>& buf = memoized_prefixes[prefix_t2];
+        buf.insert(buf.end(), varr.begin(), varr.end());
+    }
+}
+
+// sorts a list in descending order and removes duplicates, then appends its
+// encoded message (and metadata record, if wanted) to out
+void appendPackedList(std::vector<PackedEntry>& out, key_type const& key, intarray& varr, PackOptions const& pack_options, bool with_metadata) {
+    // delta-encode values, sorted in descending order.
+    std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
+    // remove duplicates
+    varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+
+    std::string message;
+    encodeMessage(varr, message, pack_options.encoding);
+    out.emplace_back(key, std::move(message));
+
+    if (with_metadata) {
+        std::string metadata;
+        encodeMetadata(intarrayMetadata(varr), metadata);
+        out.emplace_back(METADATA_PREFIX + key, std::move(metadata));
+    }
+}
+
+// Both pack formats store the same lists: every key's grids sorted in
+// descending order with duplicates removed, plus the memoized prefix lists
+// used for short autocomplete queries. This returns them as runs of entries,
+// each sorted by key.
+//
+// The work is done in two parallel passes. The first splits the cache into
+// contiguous ranges of keys, one per thread, and each thread encodes its own
+// keys and collects the prefix lists they belong to. Those are then merged
+// (a prefix can span ranges), and the second pass encodes the merged prefix
+// lists the same way.
+std::vector<std::vector<PackedEntry>> packedRuns(arraycache const& cache, PackOptions const& pack_options, bool with_metadata) {
+    size_t shards = std::max(std::min(packThreads(pack_options), cache.size()), static_cast<size_t>(1));
+
+    std::vector<arraycache::const_iterator> bounds;
+    auto itr = cache.begin();
+    for (size_t i = 0; i < shards; i++) {
+        bounds.push_back(itr);
+        std::advance(itr, static_cast<long>(cache.size() * (i + 1) / shards - cache.size() * i / shards));
+    }
+    bounds.push_back(cache.end());
+
+    std::vector<std::vector<PackedEntry>> runs(shards * 2);
+    std::vector<memoized_prefix_map> shard_prefixes(shards);
+    parallelShards(shards, [&](size_t i) {
+        for (auto item = bounds[i]; item != bounds[i + 1]; ++item) {
+            if (item->second.empty()) continue;
 
-    for (auto const& item : this->cache_) {
-        std::size_t array_size = item.second.size();
-        if (array_size > 0) {
             // make copy of intarray so we can sort without
             // modifying the original array
-            intarray varr = item.second;
-
-            // delta-encode values, sorted in descending order.
-            std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
-            // remove duplicates
-            varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
-
-            packVec(varr, db, item.first);
-
-            std::string prefix_t1;
-            std::string prefix_t2;
-
-            // add this to the memoized prefix array too, maybe
-            auto phrase_length = item.first.find(LANGFIELD_SEPARATOR);
-            // use the full string for things shorter than the limit
-            // or the prefix otherwise
-            if (phrase_length < MEMO_PREFIX_LENGTH_T1) {
-                prefix_t1 = "=1" + item.first;
-            } else {
-                // get the prefix, then append the langfield back onto it again
-                langfield_type langfield = extract_langfield(item.first);
-
-                prefix_t1 = "=1" + item.first.substr(0, MEMO_PREFIX_LENGTH_T1);
-                add_langfield(prefix_t1, langfield);
-
-                if (phrase_length < MEMO_PREFIX_LENGTH_T2) {
-                    prefix_t2 = "=2" + item.first;
-                } else {
-                    prefix_t2 = "=2" + item.first.substr(0, MEMO_PREFIX_LENGTH_T2);
-                    add_langfield(prefix_t2, langfield);
-                }
-            }
+            intarray varr = item->second;
+            appendPackedList(runs[i], item->first, varr, pack_options, with_metadata);
+            addMemoizedPrefixes(shard_prefixes[i], item->first, varr);
+        }
+        // metadata keys are interleaved with the others, so restore the order
+        std::sort(runs[i].begin(), runs[i].end());
+    });
+
+    std::map<key_type, intarray> memoized_prefixes;
+    for (auto& prefixes : shard_prefixes) {
+        for (auto& item : prefixes) {
+            intarray& varr = memoized_prefixes[item.first];
+            varr.insert(varr.end(), item.second.begin(), item.second.end());
+        }
+        prefixes.clear();
+    }
 
-            if (!prefix_t1.empty()) {
-                std::map<key_type, std::deque<value_type>>::const_iterator mitr = memoized_prefixes.find(prefix_t1);
-                if (mitr == memoized_prefixes.end()) {
-                    memoized_prefixes.emplace(prefix_t1, std::deque<value_type>());
-                }
-                std::deque<value_type>& buf = memoized_prefixes[prefix_t1];
+    std::vector<std::map<key_type, intarray>::iterator> prefix_bounds;
+    auto pitr = memoized_prefixes.begin();
+    for (size_t i = 0; i < shards; i++) {
+        prefix_bounds.push_back(pitr);
+        std::advance(pitr, static_cast<long>(memoized_prefixes.size() * (i + 1) / shards - memoized_prefixes.size() * i / shards));
+    }
+    prefix_bounds.push_back(memoized_prefixes.end());
 
-                buf.insert(buf.end(), varr.begin(), varr.end());
-            }
-            if (!prefix_t2.empty()) {
-                std::map<key_type, std::deque<value_type>>::const_iterator mitr = memoized_prefixes.find(prefix_t2);
-                if (mitr == memoized_prefixes.end()) {
-                    memoized_prefixes.emplace(prefix_t2, std::deque<value_type>());
-                }
-                std::deque<value_type>& buf = memoized_prefixes[prefix_t2];
-
-                buf.insert(buf.end(), varr.begin(), varr.end());
-            }
+    parallelShards(shards, [&](size_t i) {
+        std::vector<PackedEntry>& run = runs[shards + i];
+        for (auto item = prefix_bounds[i]; item != prefix_bounds[i + 1]; ++item) {
+            appendPackedList(run, item->first, item->second, pack_options, with_metadata);
         }
+        std::sort(run.begin(), run.end());
+    });
+
+    return runs;
+}
+
+bool MemoryCache::pack(const std::string& filename, PackOptions const& pack_options) {
+    rocksdb::Options options = packRocksDBOptions(pack_options);
+    std::unique_ptr<rocksdb::DB> db;
+    rocksdb::Status status = OpenDB(options, filename, db);
+
+    if (!status.ok()) {
+        throw std::invalid_argument("unable to open rocksdb file for packing: " + status.ToString());
     }
 
-    for (auto const& item : memoized_prefixes) {
-        // copy the deque into a vector so we can sort without
-        // modifying the original array
-        intarray varr(item.second.begin(), item.second.end());
+    // a frozen cache is thawed for the length of the pack, which sorting and
+    // encoding every list would roughly double memory use for anyway
+    arraycache thawed;
+    if (frozen_) thawed = frozen_->thaw();
+    std::vector<std::vector<PackedEntry>> runs = packedRuns(frozen_ ? thawed : this->cache_, pack_options, true);
+    runs.push_back({PackedEntry(METADATA_PREFIX, std::to_string(METADATA_VERSION))});
+    ingestPackedEntries(*db, options, filename, runs, packThreads(pack_options));
+    finalizePackedDB(*db, pack_options);
+
+    return true;
+}
 
-        // delta-encode values, sorted in descending order.
-        std::sort(varr.begin(), varr.end(), std::greater<uint64_t>());
-        // remove duplicates
-        varr.erase(std::unique(varr.begin(), varr.end()), varr.end());
+bool MemoryCache::packMmap(const std::string& filename, PackOptions const& options) {
+    std::vector<std::pair<std::string, std::string>> entries;
 
-        packVec(varr, db, item.first);
+    arraycache thawed;
+    if (frozen_) thawed = frozen_->thaw();
+    for (auto& run : packedRuns(frozen_ ? thawed : this->cache_, options, false)) {
+        std::move(run.begin(), run.end(), std::back_inserter(entries));
     }
 
+    writeMmapIndex(filename, entries);
     return true;
 }
 
 std::vector<std::pair<std::string, langfield_type>> MemoryCache::list() {
     std::vector<std::pair<std::string, langfield_type>> out;
-
-    for (auto const& item : this->cache_) {
-        std::string phrase = item.first.substr(0, item.first.find(LANGFIELD_SEPARATOR));
-        langfield_type langfield = extract_langfield(item.first);
+    auto add = [&out](key_type const& key) {
+        std::string phrase = key.substr(0, key.find(LANGFIELD_SEPARATOR));
+        langfield_type langfield = extract_langfield(key);
 
         out.emplace_back(phrase, langfield);
+    };
+
+    if (frozen_) {
+        frozen_->scan(0, [&add](size_t, key_type const& key) {
+            add(key);
+            return true;
+        });
+    } else {
+        for (auto const& item : this->cache_) {
+            add(item.first);
+        }
     }
 
     return out;
@@ -183,25 +443,34 @@ std::vector<std::pair<std::string, langfield_type>> MemoryCache::list() {
  */
 
 void MemoryCache::_set(std::string key_id, std::vector<uint64_t> data, langfield_type langfield, bool append) {
-    arraycache& arrc = this->cache_;
+    if (frozen_) {
+        throw std::invalid_argument("MemoryCache is frozen");
+    }
     add_langfield(key_id, langfield);
+    intarray& vv = cache_[key_id];
 
-    auto itr2 = arrc.find(key_id);
-    if (itr2 == arrc.end()) {
-        arrc.emplace(key_id, intarray());
+    if (append && !vv.empty()) {
+        vv.insert(vv.end(), data.begin(), data.end());
+    } else {
+        // callers hand over their vector, so a new list is never copied
+        vv = std::move(data);
     }
-    intarray& vv = arrc[key_id];
-
-    size_t array_size = data.size();
+}
 
-    if (append) {
-        vv.reserve(vv.size() + array_size);
-    } else {
-        if (itr2 != arrc.end()) vv.clear();
-        vv.reserve(array_size);
+size_t MemoryCache::loadFile(const std::string& filename) {
+    GridDumpReader reader(filename);
+    GridDumpRecord record;
+    size_t records = 0;
+    while (reader.next(record)) {
+        _set(record.phrase, std::move(record.grids), record.langfield, true);
+        records++;
     }
+    return records;
+}
 
-    vv.insert(vv.end(), data.begin(), data.end());
+void MemoryCache::freeze() {
+    if (frozen_) return;
+    frozen_.reset(new FrozenGridIndex(this->cache_));
 }
 
 } // namespace carmen
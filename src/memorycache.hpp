@@ -2,6 +2,7 @@
 #define __CARMEN_MEMORYCACHE_HPP__
 
 #include "cpp_util.hpp"
+#include "frozen_index.hpp"
 
 namespace carmen {
 
@@ -9,19 +10,40 @@ class MemoryCache {
   public:
     MemoryCache();
     ~MemoryCache();
+    MemoryCache(MemoryCache&&) = default;
+    MemoryCache& operator=(MemoryCache&&) = default;
 
-    bool pack(const std::string& filename);
+    bool pack(const std::string& filename, PackOptions const& options = PackOptions());
+    bool packMmap(const std::string& filename, PackOptions const& options = PackOptions());
     std::vector<std::pair<std::string, langfield_type>> list();
 
     void _set(std::string key_id, std::vector<uint64_t>, langfield_type langfield, bool append);
+    // appends every record of a grid dump (see GridDumpReader) to the cache,
+    // and returns how many there were
+    size_t loadFile(const std::string& filename);
+
+    // Moves the contents of the cache into a FrozenGridIndex, after which
+    // lookups read its sorted lists in place and _set and loadFile throw.
+    // Freezing a frozen cache does nothing.
+    void freeze();
+    bool frozen() const { return frozen_ != nullptr; }
 
     std::vector<uint64_t> _get(std::string& phrase, std::vector<uint64_t> languages);
     std::vector<uint64_t> _getmatching(std::string phrase, PrefixMatch match_prefixes, std::vector<uint64_t> languages);
 
     std::vector<uint64_t> __get(const std::string& phrase, langfield_type langfield);
-    std::vector<uint64_t> __getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+    std::vector<uint64_t> __getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, Interrupt const* interrupt = nullptr);
+    // __getmatching for each query, in order
+    std::vector<intarray> __getmatchingMany(std::vector<MatchingQuery> const& queries, Interrupt const* interrupt = nullptr);
+    std::unique_ptr<GridCursor> __getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
 
     arraycache cache_;
+
+  private:
+    std::vector<GridRange> matchingRanges(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, Interrupt const* interrupt) const;
+    bool collectMatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, intarray& array, Interrupt const* interrupt = nullptr);
+
+    std::unique_ptr<FrozenGridIndex> frozen_;
 };
 
 } // namespace carmen
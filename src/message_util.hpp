@@ -0,0 +1,412 @@
+#ifndef __CARMEN_MESSAGE_UTIL_HPP__
+#define __CARMEN_MESSAGE_UTIL_HPP__
+
+#include "cpp_util.hpp"
+
+// this is an external library, so squash this warning
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#include "radix_max_heap.h"
+#pragma clang diagnostic pop
+
+#include <limits>
+#include <tuple>
+
+// helpers for reading the packed grid messages stored as values in both
+// the RocksDBCache and the MmapCache; both store the same message format,
+// and differ only in how they find and load the messages for a given key
+
+namespace carmen {
+
+// the grids in a message, in whichever encoding it was packed with
+struct MessageGrids {
+    GridEncoding encoding = GridEncoding::varint;
+    protozero::const_varint_iterator<uint64_t> begin{};
+    protozero::const_varint_iterator<uint64_t> end{};
+    protozero::data_view blocks{};
+};
+
+inline MessageGrids readMessage(protozero::data_view const& message) {
+    MessageGrids grids;
+    protozero::pbf_reader item(message);
+    while (item.next()) {
+        if (item.tag() == CACHE_ITEM) {
+            auto vals = item.get_packed_uint64();
+            grids.begin = vals.first;
+            grids.end = vals.second;
+            return grids;
+        }
+        if (item.tag() == CACHE_BLOCKS) {
+            grids.encoding = GridEncoding::block;
+            grids.blocks = item.get_view();
+            return grids;
+        }
+        item.skip();
+    }
+    return grids;
+}
+
+// walks the grids in a message one at a time, in descending order; block
+// messages are decoded a whole block at a time
+class GridIterator {
+  public:
+    explicit GridIterator(protozero::data_view const& message)
+        : grids(readMessage(message)),
+          blocks(),
+          buffer(),
+          pos(0),
+          buffered(0),
+          current(0),
+          valid_(false) {
+        if (grids.encoding == GridEncoding::block) {
+            blocks = GridBlockReader(grids.blocks.data(), grids.blocks.size());
+            buffer.resize(GRID_BLOCK_SIZE);
+        } else if (grids.begin != grids.end) {
+            current = *grids.begin;
+            valid_ = true;
+            return;
+        }
+        next();
+    }
+
+    bool valid() const { return valid_; }
+    value_type value() const { return current; }
+
+    void next() {
+        if (grids.encoding == GridEncoding::varint) {
+            ++grids.begin;
+            valid_ = grids.begin != grids.end;
+            if (valid_) current -= *grids.begin;
+            return;
+        }
+        if (pos == buffered) {
+            buffered = blocks.next(buffer.data());
+            pos = 0;
+        }
+        valid_ = pos < buffered;
+        if (valid_) current = buffer[pos++];
+    }
+
+  private:
+    MessageGrids grids;
+    GridBlockReader blocks;
+    intarray buffer;
+    size_t pos;
+    size_t buffered;
+    value_type current;
+    bool valid_;
+};
+
+struct sortableGrid {
+    sortableGrid(GridIterator&& _it,
+                 bool _matches_language)
+        : it(std::move(_it)),
+          matches_language(_matches_language) {
+    }
+    GridIterator it;
+    bool matches_language;
+    sortableGrid() = delete;
+    sortableGrid(sortableGrid const& c) = delete;
+    sortableGrid& operator=(sortableGrid const& c) = delete;
+    sortableGrid& operator=(sortableGrid&& c) = default;
+    sortableGrid(sortableGrid&& c) = default;
+};
+
+// a message found by a getmatching scan, along with whether or not the key it
+// was found under matches the requested languages
+typedef std::tuple<protozero::data_view, bool> matchedMessage;
+
+// unpacks a whole message, or at least its first limit grids, ORing boost
+// into each grid
+inline void decodeGrids(protozero::data_view const& message, intarray& array, size_t limit, uint64_t boost) {
+    MessageGrids grids = readMessage(message);
+
+    if (grids.encoding == GridEncoding::block) {
+        GridBlockReader reader(grids.blocks.data(), grids.blocks.size());
+        while (reader.remaining() > 0 && array.size() < limit) {
+            size_t start = array.size();
+            array.resize(start + std::min(GRID_BLOCK_SIZE, reader.remaining()));
+            reader.next(array.data() + start);
+            if (boost != 0) {
+                for (size_t i = start; i < array.size(); i++) {
+                    array[i] |= boost;
+                }
+            }
+        }
+        if (array.size() > limit) array.resize(limit);
+        return;
+    }
+
+    uint64_t lastval = 0;
+    // delta decode values.
+    for (auto it = grids.begin; it != grids.end && array.size() < limit; ++it) {
+        if (lastval == 0) {
+            lastval = *it;
+            array.emplace_back(lastval | boost);
+        } else {
+            lastval = lastval - *it;
+            array.emplace_back(lastval | boost);
+        }
+    }
+}
+
+// this is a basic decoding operation that unpacks a whole protobuff message
+inline void decodeMessage(protozero::data_view const& message, intarray& array, size_t limit) {
+    decodeGrids(message, array, limit, 0);
+}
+
+// this function is as above, but also modifies the output of the protobuf message
+// to set the language-match bit to true, effectively boosting its sort order
+inline void decodeAndBoostMessage(protozero::data_view const& message, intarray& array, size_t limit) {
+    decodeGrids(message, array, limit, LANGUAGE_MATCH_BOOST);
+}
+
+inline bool inplaceBboxCheck(uint64_t val, const uint64_t box[4]) {
+    uint64_t inplaceX = val & X_MASK;
+    uint64_t inplaceY = val & Y_MASK;
+    return (inplaceX >= box[0] && inplaceX <= box[2] && inplaceY >= box[1] && inplaceY <= box[3]);
+}
+
+// This is a modified decode operation used in RocksDBCache::__getmatchingBboxFiltered.
+// it takes the boost-y-ness as an argument (which we could likely do above as well
+// if we wanted, but would need to evaluate performance) and also takes a bounding box
+// parameter to allow for pre-filtering results by bounding box before they're later
+// sorted inside getmatching; this makes sense to do in this order in circumstances
+// where we expect the bounding box filter to filter out lots of things, as it does
+// more work at O(n) for a potential big savings on an O(n log n) operation if the
+// second n can be significantly reduced by the linear filter.
+//
+// The format of the box is in [minX, minY, maxX, maxY] tile coordinate order,
+// except that the X's and Y's need to have already been shifted into same positions
+// as they occupy in encoded grids (20 bits left and 34 bits left, respectively)
+// so that we can efficiently compare them to the X and Y coordinates within each
+// grid without shifting, to keep this whole operation as fast as possible.
+inline void decodeAndBboxFilter(protozero::data_view const& message, intarray& array, uint64_t boost, const uint64_t box[4]) {
+    MessageGrids grids = readMessage(message);
+
+    if (grids.encoding == GridEncoding::block) {
+        // block messages are unpacked and filtered together by the SIMD kernels
+        GridBlockReader reader(grids.blocks.data(), grids.blocks.size());
+        uint64_t matched[GRID_BLOCK_SIZE];
+        while (reader.remaining() > 0) {
+            size_t count = reader.nextInBbox(matched, box);
+            for (size_t i = 0; i < count; i++) {
+                array.emplace_back(matched[i] | boost);
+            }
+        }
+        return;
+    }
+
+    // delta decode values.
+    auto it = grids.begin;
+    if (grids.begin != grids.end) {
+        uint64_t lastval = *it;
+        if (inplaceBboxCheck(lastval, box)) array.emplace_back(lastval | boost);
+        it++;
+        for (; it != grids.end; ++it) {
+            lastval = lastval - *it;
+            if (inplaceBboxCheck(lastval, box)) array.emplace_back(lastval | boost);
+        }
+    }
+}
+
+// re-encodes a message with the given encoding, or copies it as-is if it
+// already uses it
+inline void transcodeMessage(protozero::data_view const& message, GridEncoding encoding, std::string& out) {
+    if (readMessage(message).encoding == encoding) {
+        out.assign(message.data(), message.size());
+        return;
+    }
+    intarray grids;
+    decodeMessage(message, grids, std::numeric_limits<size_t>::max());
+    out.clear();
+    encodeMessage(grids, out, encoding);
+}
+
+// the metadata record stored for each key of a RocksDBCache: the largest grid
+// in its message, which is enough to decide whether it's worth loading the
+// message at all, and how many grids the message holds
+struct KeyMetadata {
+    uint64_t max_grid = 0;
+    uint64_t count = 0;
+};
+
+inline void encodeMetadata(KeyMetadata const& metadata, std::string& out) {
+    protozero::pbf_writer writer(out);
+    writer.add_uint64(METADATA_MAX_GRID, metadata.max_grid);
+    writer.add_uint64(METADATA_COUNT, metadata.count);
+}
+
+inline KeyMetadata decodeMetadata(protozero::data_view const& record) {
+    KeyMetadata metadata;
+    protozero::pbf_reader reader(record);
+    while (reader.next()) {
+        if (reader.tag() == METADATA_MAX_GRID) {
+            metadata.max_grid = reader.get_uint64();
+        } else if (reader.tag() == METADATA_COUNT) {
+            metadata.count = reader.get_uint64();
+        } else {
+            reader.skip();
+        }
+    }
+    return metadata;
+}
+
+inline KeyMetadata intarrayMetadata(intarray const& sorted_grids) {
+    KeyMetadata metadata;
+    if (!sorted_grids.empty()) metadata.max_grid = sorted_grids.front();
+    metadata.count = sorted_grids.size();
+    return metadata;
+}
+
+inline KeyMetadata messageMetadata(protozero::data_view const& message) {
+    KeyMetadata metadata;
+    GridIterator it(message);
+    if (it.valid()) metadata.max_grid = it.value();
+    for (; it.valid(); it.next()) {
+        metadata.count++;
+    }
+    return metadata;
+}
+
+// getmatching scans don't seek to the phrase itself when doing autocomplete:
+// short prefixes are answered from the memoized prefix lists (prefixed with
+// =1 or =2) written at pack time. This returns the key to seek to for a
+// given phrase and prefix mode.
+inline std::string getmatchingSeekKey(const std::string& phrase_ref, PrefixMatch match_prefixes) {
+    std::string phrase = phrase_ref;
+
+    if (match_prefixes == PrefixMatch::disabled) {
+        phrase.push_back(LANGFIELD_SEPARATOR);
+    }
+
+    size_t phrase_length = phrase.length();
+    if (match_prefixes == PrefixMatch::word_boundary) {
+        // If we're looking for a word boundary we need have one more character
+        // available than the phrase is long. Incrementing this lengh ensures we
+        // don't use a prefix cache that could cut off the word break.
+        phrase_length++;
+    }
+
+    if (match_prefixes != PrefixMatch::disabled) {
+        // if this is an autocomplete scan, use the prefix cache
+        if (phrase_length <= MEMO_PREFIX_LENGTH_T1) {
+            phrase = "=1" + phrase.substr(0, MEMO_PREFIX_LENGTH_T1);
+        } else if (phrase_length <= MEMO_PREFIX_LENGTH_T2) {
+            phrase = "=2" + phrase.substr(0, MEMO_PREFIX_LENGTH_T2);
+        }
+    }
+
+    return phrase;
+}
+
+// word boundary scans only match keys where the phrase is followed by a space
+// or the end of the phrase; keys always contain a LANGFIELD_SEPARATOR after
+// the phrase, so a key no longer than the seek key can only be a memo key
+// that ends right at it
+inline bool matchesWordBoundary(const char* key, size_t key_size, size_t phrase_size) {
+    char endChar = key_size > phrase_size ? key[phrase_size] : LANGFIELD_SEPARATOR;
+    return endChar == LANGFIELD_SEPARATOR || endChar == ' ';
+}
+
+// Merges the grids of several messages into one stream, in descending order
+// with adjacent duplicates removed, a grid at a time; messages are decoded
+// lazily, so the tails of long messages are never read if they aren't
+// reached. Messages can be added after grids have been taken, as long as none
+// of their grids (with any boost applied) is larger than the last grid taken.
+class MessageMerger {
+  public:
+    MessageMerger()
+        : grids(),
+          rh(),
+          last(0),
+          started(false) {}
+
+    void add(protozero::data_view const& message, bool matches_language) {
+        GridIterator it(message);
+        if (it.valid()) {
+            value_type unadjusted_lastval = it.value();
+            grids.emplace_back(std::move(it), matches_language);
+            rh.push(matches_language ? unadjusted_lastval | LANGUAGE_MATCH_BOOST : unadjusted_lastval, grids.size() - 1);
+        }
+    }
+
+    void reserve(size_t messages) { grids.reserve(messages); }
+
+    bool empty() const { return rh.empty(); }
+
+    // the grid the next call to next will produce, if it isn't a duplicate;
+    // only valid if the merger isn't empty
+    uint64_t top() { return rh.top_key(); }
+
+    // sets grid to the next grid and returns true, or returns false if every
+    // message has been exhausted; beforePop is called before each grid is
+    // taken off the heap, and may add messages
+    template <typename BeforePop>
+    bool next(uint64_t& grid, BeforePop&& beforePop) {
+        for (beforePop(); !rh.empty(); beforePop()) {
+            size_t gridIdx = rh.top_value();
+            uint64_t gridId = rh.top_key();
+            rh.pop();
+
+            sortableGrid* sg = &(grids[gridIdx]);
+            sg->it.next();
+            if (sg->it.valid()) {
+                rh.push(
+                    sg->matches_language ? sg->it.value() | LANGUAGE_MATCH_BOOST : sg->it.value(),
+                    gridIdx);
+            }
+
+            if (!started || last != gridId) {
+                started = true;
+                last = gridId;
+                grid = gridId;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool next(uint64_t& grid) {
+        return next(grid, []() {});
+    }
+
+  private:
+    std::vector<sortableGrid> grids;
+    radix_max_heap::pair_radix_max_heap<uint64_t, size_t> rh;
+    uint64_t last;
+    bool started;
+};
+
+// merge the grids from all the messages found by a getmatching scan into a
+// single list sorted in descending order, stopping once max_results grids
+// have been produced
+inline void mergeMessages(std::vector<matchedMessage> const& messages, intarray& array, size_t max_results, Interrupt const* interrupt = nullptr) {
+    // short-circuit the priority queue merging logic if we only found one message
+    // as will be the norm for exact matches in translationless indexes
+    if (messages.size() == 1) {
+        if (std::get<1>(messages[0])) {
+            decodeAndBoostMessage(std::get<0>(messages[0]), array, max_results);
+        } else {
+            decodeMessage(std::get<0>(messages[0]), array, max_results);
+        }
+        return;
+    }
+
+    MessageMerger merger;
+    merger.reserve(messages.size());
+    for (matchedMessage const& message : messages) {
+        merger.add(std::get<0>(message), std::get<1>(message));
+    }
+
+    uint64_t grid;
+    size_t polls = 0;
+    while (array.size() < max_results && merger.next(grid)) {
+        array.emplace_back(grid);
+        if (interrupt != nullptr) interrupt->poll(polls);
+    }
+}
+
+} // namespace carmen
+
+#endif // __CARMEN_MESSAGE_UTIL_HPP__
@@ -0,0 +1,325 @@
+#include "mmapcache.hpp"
+#include "cpp_util.hpp"
+
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace carmen {
+
+MappedFile::MappedFile(const std::string& filename)
+    : data(nullptr),
+      size(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::invalid_argument("unable to open mmap file for loading");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(MmapHeader))) {
+        close(fd);
+        throw std::invalid_argument("mmap file is too small to be a valid index");
+    }
+    size = static_cast<size_t>(st.st_size);
+
+    // MAP_SHARED so that every process on the host that loads the same index
+    // reads it out of the same page cache pages
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::invalid_argument("unable to mmap file for loading");
+    }
+    data = static_cast<const char*>(mapped);
+}
+
+MappedFile::~MappedFile() {
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+void writeMmapIndex(const std::string& filename, std::vector<std::pair<std::string, std::string>>& entries) {
+    std::sort(entries.begin(), entries.end(), [](std::pair<std::string, std::string> const& a, std::pair<std::string, std::string> const& b) {
+        return a.first < b.first;
+    });
+
+    uint64_t count = entries.size();
+    std::vector<uint64_t> key_offsets;
+    std::vector<uint64_t> value_offsets;
+    key_offsets.reserve(count + 1);
+    value_offsets.reserve(count + 1);
+
+    uint64_t key_length = 0;
+    uint64_t value_length = 0;
+    for (auto const& entry : entries) {
+        key_offsets.emplace_back(key_length);
+        value_offsets.emplace_back(value_length);
+        key_length += entry.first.size();
+        value_length += entry.second.size();
+    }
+    key_offsets.emplace_back(key_length);
+    value_offsets.emplace_back(value_length);
+
+    MmapHeader header{};
+    memcpy(header.magic, MMAP_MAGIC, sizeof(header.magic));
+    header.version = MMAP_VERSION;
+    header.flags = 0;
+    header.count = count;
+    header.key_offsets = sizeof(MmapHeader);
+    header.value_offsets = header.key_offsets + (count + 1) * sizeof(uint64_t);
+    header.key_data = header.value_offsets + (count + 1) * sizeof(uint64_t);
+    header.value_data = header.key_data + key_length;
+    header.size = header.value_data + value_length;
+
+    std::ofstream out(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::invalid_argument("unable to open mmap file for packing");
+    }
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(key_offsets.data()), static_cast<std::streamsize>(key_offsets.size() * sizeof(uint64_t)));
+    out.write(reinterpret_cast<const char*>(value_offsets.data()), static_cast<std::streamsize>(value_offsets.size() * sizeof(uint64_t)));
+    for (auto const& entry : entries) {
+        out.write(entry.first.data(), static_cast<std::streamsize>(entry.first.size()));
+    }
+    for (auto const& entry : entries) {
+        out.write(entry.second.data(), static_cast<std::streamsize>(entry.second.size()));
+    }
+    out.close();
+
+    if (!out) {
+        throw std::invalid_argument("unable to write mmap file for packing");
+    }
+}
+
+inline int compareKeys(protozero::data_view const& a, protozero::data_view const& b) {
+    int result = memcmp(a.data(), b.data(), std::min(a.size(), b.size()));
+    if (result != 0) return result;
+    if (a.size() < b.size()) return -1;
+    if (a.size() > b.size()) return 1;
+    return 0;
+}
+
+inline bool startsWith(protozero::data_view const& key, std::string const& prefix) {
+    return key.size() >= prefix.size() && memcmp(key.data(), prefix.data(), prefix.size()) == 0;
+}
+
+protozero::data_view MmapCache::keyAt(size_t i) const {
+    return {key_data + key_offsets[i], static_cast<size_t>(key_offsets[i + 1] - key_offsets[i])};
+}
+
+protozero::data_view MmapCache::valueAt(size_t i) const {
+    return {value_data + value_offsets[i], static_cast<size_t>(value_offsets[i + 1] - value_offsets[i])};
+}
+
+// index of the first key that is not less than the target, or count if there isn't one
+size_t MmapCache::lowerBound(protozero::data_view const& target) const {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compareKeys(keyAt(mid), target) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+intarray MmapCache::__get(const std::string& phrase, langfield_type langfield) {
+    intarray array;
+    std::string phrase_with_langfield = phrase;
+
+    add_langfield(phrase_with_langfield, langfield);
+    protozero::data_view target(phrase_with_langfield);
+    size_t i = lowerBound(target);
+    if (i < count && compareKeys(keyAt(i), target) == 0) {
+        decodeMessage(valueAt(i), array, std::numeric_limits<size_t>::max());
+    }
+
+    return array;
+}
+
+// values are read in place out of the mapping, so no copies are made before
+// the merge
+std::vector<matchedMessage> MmapCache::scanMessages(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield) const {
+    std::vector<matchedMessage> messages;
+    for (size_t i = lowerBound(phrase); i < count; i++) {
+        protozero::data_view key = keyAt(i);
+        if (!startsWith(key, phrase)) break;
+
+        if (match_prefixes == PrefixMatch::word_boundary && !matchesWordBoundary(key.data(), key.size(), phrase.size())) {
+            continue;
+        }
+
+        // grab the langfield from the end of the key
+        langfield_type message_langfield = extract_langfield(key.data(), key.size());
+        auto matches_language = static_cast<bool>(message_langfield & langfield);
+
+        messages.emplace_back(valueAt(i), matches_language);
+    }
+    return messages;
+}
+
+intarray MmapCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, Interrupt const* interrupt) {
+    intarray array;
+    std::string phrase = getmatchingSeekKey(phrase_ref, match_prefixes);
+
+    mergeMessages(scanMessages(phrase, match_prefixes, langfield), array, max_results, interrupt);
+    return array;
+}
+
+std::vector<intarray> MmapCache::__getmatchingMany(std::vector<MatchingQuery> const& queries, Interrupt const* interrupt) {
+    std::vector<intarray> results;
+    results.reserve(queries.size());
+    for (MatchingQuery const& query : queries) {
+        if (interrupt != nullptr) interrupt->check();
+        results.push_back(__getmatching(query.phrase, query.match_prefixes, query.langfield, query.max_results, interrupt));
+    }
+    return results;
+}
+
+// produces the merged grids of a getmatching scan one at a time; the cursor
+// keeps the mapping alive for as long as it's reading from it
+class MmapGridCursor : public GridCursor {
+  public:
+    MmapGridCursor(std::shared_ptr<MappedFile> _file, std::vector<matchedMessage> const& messages, size_t _max_results)
+        : file(std::move(_file)),
+          merger(),
+          remaining(_max_results),
+          unboosted(false) {
+        merger.reserve(messages.size());
+        for (matchedMessage const& message : messages) {
+            merger.add(std::get<0>(message), std::get<1>(message));
+            unboosted = unboosted || !std::get<1>(message);
+        }
+    }
+
+    bool next(uint64_t& grid) override {
+        if (remaining == 0 || !merger.next(grid)) return false;
+        remaining--;
+        return true;
+    }
+
+    bool mayProduceUnboosted() const override { return unboosted; }
+
+  private:
+    std::shared_ptr<MappedFile> file;
+    MessageMerger merger;
+    size_t remaining;
+    bool unboosted;
+};
+
+std::unique_ptr<GridCursor> MmapCache::__getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::string phrase = getmatchingSeekKey(phrase_ref, match_prefixes);
+    return std::unique_ptr<GridCursor>(new MmapGridCursor(file, scanMessages(phrase, match_prefixes, langfield), max_results));
+}
+
+// see RocksDBCache::__getmatchingBboxFiltered
+intarray MmapCache::__getmatchingBboxFiltered(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, const uint64_t box[4], Interrupt const* interrupt) {
+    intarray array;
+    std::string phrase = getmatchingSeekKey(phrase_ref, match_prefixes);
+
+    for (size_t i = lowerBound(phrase); i < count; i++) {
+        protozero::data_view key = keyAt(i);
+        if (!startsWith(key, phrase)) break;
+        if (interrupt != nullptr) interrupt->check();
+
+        if (match_prefixes == PrefixMatch::word_boundary && !matchesWordBoundary(key.data(), key.size(), phrase.size())) {
+            continue;
+        }
+
+        // grab the langfield from the end of the key
+        langfield_type message_langfield = extract_langfield(key.data(), key.size());
+        auto matches_language = static_cast<bool>(message_langfield & langfield);
+
+        uint64_t boost = matches_language ? LANGUAGE_MATCH_BOOST : 0;
+        decodeAndBboxFilter(valueAt(i), array, boost, box);
+    }
+
+    std::sort(array.begin(), array.end(), std::greater<uint64_t>());
+    array.erase(std::unique(array.begin(), array.end()), array.end());
+    if (array.size() > max_results) array.resize(max_results);
+    return array;
+}
+
+std::vector<std::pair<std::string, langfield_type>> MmapCache::list() {
+    std::vector<std::pair<std::string, langfield_type>> out;
+    for (size_t i = 0; i < count; i++) {
+        protozero::data_view key = keyAt(i);
+        if (key.size() > 0 && key.data()[0] == '=') continue;
+
+        std::string key_id(key.data(), key.size());
+        std::string phrase = key_id.substr(0, key_id.find(LANGFIELD_SEPARATOR));
+        langfield_type langfield = extract_langfield(key_id);
+
+        out.emplace_back(phrase, langfield);
+    }
+    return out;
+}
+
+MmapCache::MmapCache()
+    : file(),
+      count(0),
+      key_offsets(nullptr),
+      value_offsets(nullptr),
+      key_data(nullptr),
+      value_data(nullptr) {}
+
+MmapCache::~MmapCache() = default;
+
+MmapCache::MmapCache(const std::string& filename)
+    : MmapCache() {
+    std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>(filename);
+
+    MmapHeader header;
+    memcpy(&header, mapped->data, sizeof(header));
+    if (memcmp(header.magic, MMAP_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::invalid_argument("file is not a carmen mmap index");
+    }
+    if (header.version != MMAP_VERSION) {
+        throw std::invalid_argument("unsupported carmen mmap index version");
+    }
+
+    // make sure every section lies inside the file, and every offset inside
+    // its section, before trusting any of them; the count is bounded first so
+    // the size of the offset tables can't overflow
+    if (header.size != mapped->size ||
+        header.count > (header.size - sizeof(MmapHeader)) / (2 * sizeof(uint64_t))) {
+        throw std::invalid_argument("corrupt carmen mmap index");
+    }
+    uint64_t offsets_size = (header.count + 1) * sizeof(uint64_t);
+    if (header.key_offsets != sizeof(MmapHeader) ||
+        header.value_offsets != header.key_offsets + offsets_size ||
+        header.key_data != header.value_offsets + offsets_size ||
+        header.value_data < header.key_data ||
+        header.value_data > header.size) {
+        throw std::invalid_argument("corrupt carmen mmap index");
+    }
+
+    key_offsets = reinterpret_cast<const uint64_t*>(mapped->data + header.key_offsets);
+    value_offsets = reinterpret_cast<const uint64_t*>(mapped->data + header.value_offsets);
+    // offsets start at 0 and never decrease, and the last one is the length
+    // of its section, so every key and value lies inside its section
+    auto validOffsets = [&header](const uint64_t* offsets, uint64_t section_size) {
+        if (offsets[0] != 0 || offsets[header.count] != section_size) return false;
+        for (uint64_t i = 0; i < header.count; i++) {
+            if (offsets[i] > offsets[i + 1]) return false;
+        }
+        return true;
+    };
+    if (!validOffsets(key_offsets, header.value_data - header.key_data) ||
+        !validOffsets(value_offsets, header.size - header.value_data)) {
+        throw std::invalid_argument("corrupt carmen mmap index");
+    }
+
+    count = static_cast<size_t>(header.count);
+    key_data = mapped->data + header.key_data;
+    value_data = mapped->data + header.value_data;
+    file = std::move(mapped);
+}
+
+} // namespace carmen
@@ -0,0 +1,84 @@
+#ifndef __CARMEN_MMAPCACHE_HPP__
+#define __CARMEN_MMAPCACHE_HPP__
+
+#include "cpp_util.hpp"
+#include "message_util.hpp"
+
+namespace carmen {
+
+// An mmap index is a single read-only file that is mapped into memory and read
+// in place. All integers are stored little-endian (the langfield encoding
+// already assumes a little-endian host), and the file is laid out as:
+//
+//   header          an MmapHeader, below
+//   key offsets     uint64_t[count + 1], relative to the start of the key data
+//   value offsets   uint64_t[count + 1], relative to the start of the value data
+//   key data        every key, concatenated in ascending byte order
+//   value data      every value, concatenated in the same order as the keys
+//
+// Keys and values are exactly what would be stored in the equivalent RocksDB
+// index, including the =1/=2 memoized prefix lists, so the same scan and
+// decode logic applies to both.
+struct MmapHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t key_offsets;
+    uint64_t value_offsets;
+    uint64_t key_data;
+    uint64_t value_data;
+    uint64_t size;
+};
+
+constexpr char MMAP_MAGIC[8] = {'C', 'A', 'R', 'M', 'M', 'M', 'A', 'P'};
+constexpr uint32_t MMAP_VERSION = 1;
+
+// owns a read-only mapping of a whole file, shared between all copies of the
+// MmapCache that loaded it
+class MappedFile : noncopyable {
+  public:
+    explicit MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    const char* data;
+    size_t size;
+};
+
+// writes a set of key/message pairs out as an mmap index; the pairs are sorted
+// by key first, so callers can supply them in any order
+void writeMmapIndex(const std::string& filename, std::vector<std::pair<std::string, std::string>>& entries);
+
+class MmapCache {
+  public:
+    MmapCache(const std::string& filename);
+    MmapCache();
+    ~MmapCache();
+
+    std::vector<std::pair<std::string, langfield_type>> list();
+
+    std::vector<uint64_t> __get(const std::string& phrase, langfield_type langfield);
+    std::vector<uint64_t> __getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, Interrupt const* interrupt = nullptr);
+    // __getmatching for each query, in order
+    std::vector<intarray> __getmatchingMany(std::vector<MatchingQuery> const& queries, Interrupt const* interrupt = nullptr);
+    std::vector<uint64_t> __getmatchingBboxFiltered(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, const uint64_t box[4], Interrupt const* interrupt = nullptr);
+    std::unique_ptr<GridCursor> __getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results);
+
+    std::shared_ptr<MappedFile> file;
+
+  private:
+    std::vector<matchedMessage> scanMessages(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield) const;
+    size_t lowerBound(protozero::data_view const& target) const;
+    protozero::data_view keyAt(size_t i) const;
+    protozero::data_view valueAt(size_t i) const;
+
+    size_t count;
+    const uint64_t* key_offsets;
+    const uint64_t* value_offsets;
+    const char* key_data;
+    const char* value_data;
+};
+
+} // namespace carmen
+
+#endif // __CARMEN_MMAPCACHE_HPP__
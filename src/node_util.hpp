@@ -25,10 +25,16 @@ namespace carmen {
 
 using namespace v8;
 
+// BigUint64Array (and BigInt) only exist from V8 6.7 on
+#if V8_MAJOR_VERSION > 6 || (V8_MAJOR_VERSION == 6 && V8_MINOR_VERSION >= 7)
+#define CARMEN_HAVE_BIGUINT64ARRAY 1
+#else
+#define CARMEN_HAVE_BIGUINT64ARRAY 0
+#endif
+
 Local<Object> coverToObject(Cover const& cover);
 Local<Array> contextToArray(Context const& context);
 
-constexpr unsigned MAX_LANG = (sizeof(langfield_type) * 8) - 1;
 // convert from a JS array of language IDs to a bitmask where the bits corresponding
 // to those IDs are set to 1
 inline langfield_type langarrayToLangfield(Local<v8::Array> const& array) {
@@ -59,6 +65,100 @@ inline Local<v8::Array> langfieldToLangarray(langfield_type langfield) {
     return langs;
 }
 
+// read an optional non-negative integer property of an options object
+template <typename T>
+inline bool jsOptionalUnsigned(Local<Object> const& object, const char* name, T& out) {
+    if (!object->Has(Nan::New(name).ToLocalChecked())) return false;
+    Local<Value> prop_val = object->Get(Nan::New(name).ToLocalChecked());
+    if (!prop_val->IsNumber()) {
+        throw std::invalid_argument(std::string(name) + " must be a number");
+    }
+    double number = prop_val->NumberValue();
+    if (number < 0 || number > static_cast<double>(std::numeric_limits<T>::max())) {
+        throw std::invalid_argument(std::string(name) + " is out of range");
+    }
+    out = static_cast<T>(number);
+    return true;
+}
+
+// read an optional boolean property of an options object
+inline bool jsOptionalBoolean(Local<Object> const& object, const char* name, bool& out) {
+    if (!object->Has(Nan::New(name).ToLocalChecked())) return false;
+    Local<Value> prop_val = object->Get(Nan::New(name).ToLocalChecked());
+    if (!prop_val->IsBoolean()) {
+        throw std::invalid_argument(std::string(name) + " must be a boolean");
+    }
+    out = prop_val->BooleanValue();
+    return true;
+}
+
+// options arguments are optional, so undefined is treated as an empty object
+inline Local<Object> jsOptionsObject(Local<Value> const& value) {
+    if (value->IsUndefined()) return Nan::New<Object>();
+    if (!value->IsObject()) {
+        throw std::invalid_argument("options must be an object");
+    }
+    return value->ToObject();
+}
+
+// convert from the optional options object accepted by the RocksDBCache
+// constructor
+inline RocksDBOptions jsToRocksDBOptions(Local<Value> const& value) {
+    RocksDBOptions options;
+    Local<Object> object = jsOptionsObject(value);
+
+    jsOptionalUnsigned(object, "blockCacheSize", options.block_cache_size);
+    jsOptionalUnsigned(object, "bloomBitsPerKey", options.bloom_bits_per_key);
+    jsOptionalBoolean(object, "prefixBloom", options.prefix_bloom);
+    jsOptionalUnsigned(object, "maxOpenFiles", options.max_open_files);
+    jsOptionalBoolean(object, "mmapReads", options.mmap_reads);
+    jsOptionalUnsigned(object, "decodedCacheSize", options.decoded_cache_size);
+    return options;
+}
+
+// convert from the optional options object accepted by pack and packMmap
+inline PackOptions jsToPackOptions(Local<Value> const& value) {
+    PackOptions options;
+    Local<Object> object = jsOptionsObject(value);
+
+    if (object->Has(Nan::New("encoding").ToLocalChecked())) {
+        Local<Value> prop_val = object->Get(Nan::New("encoding").ToLocalChecked());
+        std::string encoding = prop_val->IsString() ? *Nan::Utf8String(prop_val) : "";
+        if (encoding == "varint") {
+            options.encoding = GridEncoding::varint;
+        } else if (encoding == "block") {
+            options.encoding = GridEncoding::block;
+        } else {
+            throw std::invalid_argument("encoding must be 'varint' or 'block'");
+        }
+    }
+    jsOptionalUnsigned(object, "bloomBitsPerKey", options.bloom_bits_per_key);
+    jsOptionalBoolean(object, "prefixBloom", options.prefix_bloom);
+    jsOptionalUnsigned(object, "threads", options.threads);
+    jsOptionalBoolean(object, "finalize", options.finalize);
+    if (object->Has(Nan::New("bottommostCompression").ToLocalChecked())) {
+        Local<Value> prop_val = object->Get(Nan::New("bottommostCompression").ToLocalChecked());
+        std::string compression = prop_val->IsString() ? *Nan::Utf8String(prop_val) : "";
+        if (compression == "none") {
+            options.bottommost_compression = rocksdb::kNoCompression;
+        } else if (compression == "snappy") {
+            options.bottommost_compression = rocksdb::kSnappyCompression;
+        } else if (compression == "zlib") {
+            options.bottommost_compression = rocksdb::kZlibCompression;
+        } else if (compression == "lz4") {
+            options.bottommost_compression = rocksdb::kLZ4Compression;
+        } else if (compression == "lz4hc") {
+            options.bottommost_compression = rocksdb::kLZ4HCCompression;
+        } else if (compression == "zstd") {
+            options.bottommost_compression = rocksdb::kZSTD;
+        } else {
+            throw std::invalid_argument("bottommostCompression must be 'none', 'snappy', 'zlib', 'lz4', 'lz4hc' or 'zstd'");
+        }
+    }
+    jsOptionalUnsigned(object, "compressionDictBytes", options.compression_dict_bytes);
+    return options;
+}
+
 } // namespace carmen
 
 #endif // __CARMEN_NODE_UTIL_HPP__
@@ -1,6 +1,9 @@
 
 #include "rocksdbcache.hpp"
 #include "cpp_util.hpp"
+#include "mmapcache.hpp"
+
+#include <deque>
 
 namespace carmen {
 
@@ -9,164 +12,310 @@ intarray RocksDBCache::__get(const std::string& phrase, langfield_type langfield
     std::string phrase_with_langfield = phrase;
 
     add_langfield(phrase_with_langfield, langfield);
-    std::string message;
-    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), phrase_with_langfield, &message);
+    // a PinnableSlice points straight into the block cache when it can,
+    // rather than copying the value out
+    rocksdb::PinnableSlice message;
+    rocksdb::Status s = db->Get(rocksdb::ReadOptions(), db->DefaultColumnFamily(), phrase_with_langfield, &message);
     if (s.ok()) {
-        decodeMessage(message, array, std::numeric_limits<size_t>::max());
+        decodeMessage(protozero::data_view(message.data(), message.size()), array, std::numeric_limits<size_t>::max());
     }
 
     return array;
 }
 
-intarray RocksDBCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
-    intarray array;
-    std::string phrase = phrase_ref;
-
-    if (match_prefixes == PrefixMatch::disabled) {
-        phrase.push_back(LANGFIELD_SEPARATOR);
-    }
+// The metadata records of the keys matching a phrase, sorted by their
+// largest grid. Metadata records are small, so reading them costs much less
+// than reading the messages they describe.
+std::vector<lazyMessage> RocksDBCache::scanMetadata(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield) {
+    std::vector<lazyMessage> candidates;
+
+    std::string metadata_phrase = METADATA_PREFIX + phrase;
+    size_t prefix_length = strlen(METADATA_PREFIX);
+    std::unique_ptr<rocksdb::Iterator> rit(db->NewIterator(scanOptions(metadata_phrase)));
+    for (rit->Seek(metadata_phrase); rit->Valid() && rit->key().starts_with(metadata_phrase); rit->Next()) {
+        rocksdb::Slice key = rit->key();
+        key.remove_prefix(prefix_length);
+
+        if (match_prefixes == PrefixMatch::word_boundary && !matchesWordBoundary(key.data(), key.size(), phrase.size())) {
+            continue;
+        }
 
-    size_t phrase_length = phrase.length();
-    if (match_prefixes == PrefixMatch::word_boundary) {
-        // If we're looking for a word boundary we need have one more character
-        // available than the phrase is long. Incrementing this lengh ensures we
-        // don't use a prefix cache that could cut off the word break.
-        phrase_length++;
-    }
+        // grab the langfield from the end of the key
+        langfield_type message_langfield = extract_langfield(key.data(), key.size());
+        auto matches_language = static_cast<bool>(message_langfield & langfield);
 
-    // Load values from message cache
-    std::vector<std::tuple<std::string, bool>> messages;
-    std::vector<sortableGrid> grids;
+        rocksdb::Slice record = rit->value();
+        KeyMetadata metadata = decodeMetadata(protozero::data_view(record.data(), record.size()));
+        if (metadata.count == 0) continue;
 
-    if (match_prefixes != PrefixMatch::disabled) {
-        // if this is an autocomplete scan, use the prefix cache
-        if (phrase_length <= MEMO_PREFIX_LENGTH_T1) {
-            phrase = "=1" + phrase.substr(0, MEMO_PREFIX_LENGTH_T1);
-        } else if (phrase_length <= MEMO_PREFIX_LENGTH_T2) {
-            phrase = "=2" + phrase.substr(0, MEMO_PREFIX_LENGTH_T2);
-        }
+        uint64_t max_grid = matches_language ? metadata.max_grid | LANGUAGE_MATCH_BOOST : metadata.max_grid;
+        candidates.push_back(lazyMessage{key.ToString(), max_grid, matches_language});
     }
 
-    radix_max_heap::pair_radix_max_heap<uint64_t, size_t> rh;
-
-    std::unique_ptr<rocksdb::Iterator> rit(db->NewIterator(rocksdb::ReadOptions()));
-    for (rit->Seek(phrase); rit->Valid() && rit->key().ToString().compare(0, phrase.size(), phrase) == 0; rit->Next()) {
-        std::string key = rit->key().ToString();
+    std::sort(candidates.begin(), candidates.end(), [](lazyMessage const& a, lazyMessage const& b) {
+        return a.max_grid > b.max_grid;
+    });
+    return candidates;
+}
 
-        if (match_prefixes == PrefixMatch::word_boundary) {
-            // Read one character beyond the input prefix length, should always
-            // be safe because of the LANGFIELD_SEPARATOR
-            char endChar = key.at(phrase.length());
-            if (endChar != LANGFIELD_SEPARATOR && endChar != ' ') {
-                continue;
-            }
+// Finds the messages of the keys matching a phrase. The returned iterator
+// keeps the blocks the messages were read from pinned, and has to outlive
+// them.
+std::unique_ptr<rocksdb::Iterator> RocksDBCache::scanMessages(const std::string& phrase, PrefixMatch match_prefixes, langfield_type langfield, std::vector<matchedMessage>& messages) {
+    // pin_data keeps every block the iterator visits alive until the iterator
+    // is destroyed, so the values can be merged in place once the scan is
+    // done instead of being copied out one by one. Only keys can be
+    // delta-encoded (and so rebuilt in a scratch buffer that
+    // rocksdb.iterator.is-key-pinned reports); values are always slices of
+    // the pinned blocks, so they're safe to keep whatever that says.
+    rocksdb::ReadOptions read_options = scanOptions(phrase);
+    read_options.pin_data = true;
+    std::unique_ptr<rocksdb::Iterator> rit(db->NewIterator(read_options));
+
+    for (rit->Seek(phrase); rit->Valid() && rit->key().starts_with(phrase); rit->Next()) {
+        rocksdb::Slice key = rit->key();
+
+        if (match_prefixes == PrefixMatch::word_boundary && !matchesWordBoundary(key.data(), key.size(), phrase.size())) {
+            continue;
         }
 
         // grab the langfield from the end of the key
-        langfield_type message_langfield = extract_langfield(key);
+        langfield_type message_langfield = extract_langfield(key.data(), key.size());
         auto matches_language = static_cast<bool>(message_langfield & langfield);
 
-        messages.emplace_back(std::make_tuple(rit->value().ToString(), matches_language));
+        rocksdb::Slice value = rit->value();
+        messages.emplace_back(protozero::data_view(value.data(), value.size()), matches_language);
+    }
+    return rit;
+}
+
+// Produces the merged grids of a getmatching scan one at a time.
+//
+// For caches with metadata records, only the metadata is read up front, and
+// messages are loaded in order of their largest grid, each only once the
+// merge reaches the point where that grid could be next in line. Caches
+// packed before metadata records were added have every matching message
+// found up front instead, although they're still decoded lazily.
+class RocksDBGridCursor : public GridCursor {
+  public:
+    RocksDBGridCursor(std::shared_ptr<rocksdb::DB> _db, size_t _max_results)
+        : db(std::move(_db)),
+          iterator(),
+          candidates(),
+          next_candidate(0),
+          values(),
+          merger(),
+          remaining(_max_results),
+          unboosted(false) {}
+
+    // takes the result of RocksDBCache::scanMessages
+    void addMessages(std::unique_ptr<rocksdb::Iterator>&& _iterator, std::vector<matchedMessage> const& messages) {
+        iterator = std::move(_iterator);
+        merger.reserve(messages.size());
+        for (matchedMessage const& message : messages) {
+            merger.add(std::get<0>(message), std::get<1>(message));
+            unboosted = unboosted || !std::get<1>(message);
+        }
     }
 
-    // short-circuit the priority queue merging logic if we only found one message
-    // as will be the norm for exact matches in translationless indexes
-    if (messages.size() == 1) {
-        if (std::get<1>(messages[0])) {
-            decodeAndBoostMessage(std::get<0>(messages[0]), array, max_results);
-        } else {
-            decodeMessage(std::get<0>(messages[0]), array, max_results);
+    // takes the result of RocksDBCache::scanMetadata
+    void addCandidates(std::vector<lazyMessage>&& _candidates) {
+        candidates = std::move(_candidates);
+        merger.reserve(candidates.size());
+        for (lazyMessage const& candidate : candidates) {
+            unboosted = unboosted || !candidate.matches_language;
         }
-        return array;
     }
 
-    for (std::tuple<std::string, bool>& message : messages) {
-        protozero::pbf_reader item(std::get<0>(message));
-        bool matches_language = std::get<1>(message);
+    bool next(uint64_t& grid) override {
+        if (remaining == 0) return false;
+        if (!merger.next(grid, [this]() { loadReachable(); })) return false;
+        remaining--;
+        return true;
+    }
+
+    bool mayProduceUnboosted() const override { return unboosted; }
 
-        item.next(CACHE_ITEM);
-        auto vals = item.get_packed_uint64();
+  private:
+    // loads the next candidates for as long as their largest grid is at least
+    // as large as anything left to merge; this keeps every message added to
+    // the merger from holding grids larger than one already taken
+    void loadReachable() {
+        while (next_candidate < candidates.size() && (merger.empty() || candidates[next_candidate].max_grid >= merger.top())) {
+            lazyMessage const& candidate = candidates[next_candidate++];
+            values.emplace_back();
+            rocksdb::Status s = db->Get(rocksdb::ReadOptions(), db->DefaultColumnFamily(), candidate.key, &values.back());
+            if (!s.ok()) continue;
 
-        if (vals.first != vals.second) {
-            value_type unadjusted_lastval = *(vals.first);
-            grids.emplace_back(
-                vals.first,
-                vals.second,
-                unadjusted_lastval,
-                matches_language);
-            rh.push(matches_language ? unadjusted_lastval | LANGUAGE_MATCH_BOOST : unadjusted_lastval, grids.size() - 1);
+            merger.add(protozero::data_view(values.back().data(), values.back().size()), candidate.matches_language);
         }
     }
 
-    while (!rh.empty() && array.size() < max_results) {
-        size_t gridIdx = rh.top_value();
-        uint64_t gridId = rh.top_key();
-        rh.pop();
+    std::shared_ptr<rocksdb::DB> db;
+    std::unique_ptr<rocksdb::Iterator> iterator;
+    std::vector<lazyMessage> candidates;
+    size_t next_candidate;
+    // loaded messages have to stay put while their grids are being merged
+    std::deque<rocksdb::PinnableSlice> values;
+    MessageMerger merger;
+    size_t remaining;
+    bool unboosted;
+};
+
+std::unique_ptr<GridCursor> RocksDBCache::getmatchingCursorUncached(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    std::string phrase = getmatchingSeekKey(phrase_ref, match_prefixes);
+    std::unique_ptr<RocksDBGridCursor> cursor(new RocksDBGridCursor(db, max_results));
+
+    if (has_metadata) {
+        cursor->addCandidates(scanMetadata(phrase, match_prefixes, langfield));
+    } else {
+        std::vector<matchedMessage> messages;
+        std::unique_ptr<rocksdb::Iterator> rit = scanMessages(phrase, match_prefixes, langfield, messages);
+        cursor->addMessages(std::move(rit), messages);
+    }
+    return std::unique_ptr<GridCursor>(std::move(cursor));
+}
+
+intarray RocksDBCache::getmatchingUncached(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, Interrupt const* interrupt) {
+    intarray array;
 
-        if (array.empty() || array.back() != gridId) array.emplace_back(gridId);
-        sortableGrid* sg = &(grids[gridIdx]);
-        sg->it++;
-        if (sg->it != sg->end) {
-            sg->unadjusted_lastval -= *(grids[gridIdx].it);
-            rh.push(
-                sg->matches_language ? sg->unadjusted_lastval | LANGUAGE_MATCH_BOOST : sg->unadjusted_lastval,
-                gridIdx);
+    if (has_metadata) {
+        std::unique_ptr<GridCursor> cursor = getmatchingCursorUncached(phrase_ref, match_prefixes, langfield, max_results);
+        uint64_t grid;
+        size_t polls = 0;
+        while (cursor->next(grid)) {
+            array.emplace_back(grid);
+            if (interrupt != nullptr) interrupt->poll(polls);
         }
+        return array;
     }
 
+    // caches packed before metadata records were added read every matching
+    // message up front
+    std::string phrase = getmatchingSeekKey(phrase_ref, match_prefixes);
+    std::vector<matchedMessage> messages;
+    std::unique_ptr<rocksdb::Iterator> rit = scanMessages(phrase, match_prefixes, langfield, messages);
+
+    mergeMessages(messages, array, max_results, interrupt);
     return array;
 }
 
-// This is an alternative version of getmatching specifically intended for the
-// address/partial-number case that parses grid data eagerly rather than lazily
-// and does bbox filtering before sorting. At present we only use it from
-// coalesceSingle, and it's only defined for the RocksDBCache; this filtering is
-// not necessary for correctness, just for performance, so the MemoryCache
-// doesn't need it in order to produce the correct results (and it's slow anyway)
-intarray RocksDBCache::__getmatchingBboxFiltered(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, const uint64_t box[4]) {
-    intarray array;
-    std::string phrase = phrase_ref;
+std::unique_ptr<GridCursor> RocksDBCache::__getmatchingCursor(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results) {
+    if (!decoded_cache) return getmatchingCursorUncached(phrase_ref, match_prefixes, langfield, max_results);
 
-    if (match_prefixes == PrefixMatch::disabled) {
-        phrase.push_back(LANGFIELD_SEPARATOR);
-    }
+    std::string key = DecodedGridCache::key(phrase_ref, match_prefixes, langfield, max_results);
+    std::shared_ptr<const intarray> cached = decoded_cache->lookup(key);
+    if (cached) return std::unique_ptr<GridCursor>(new SharedGridCursor(std::move(cached)));
+
+    return std::unique_ptr<GridCursor>(new CachingGridCursor(getmatchingCursorUncached(phrase_ref, match_prefixes, langfield, max_results), decoded_cache, std::move(key)));
+}
+
+intarray RocksDBCache::__getmatching(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, Interrupt const* interrupt) {
+    if (!decoded_cache) return getmatchingUncached(phrase_ref, match_prefixes, langfield, max_results, interrupt);
+
+    std::string key = DecodedGridCache::key(phrase_ref, match_prefixes, langfield, max_results);
+    std::shared_ptr<const intarray> cached = decoded_cache->lookup(key);
+    if (cached) return *cached;
+
+    // an interrupted decode throws, so only complete lists are cached
+    intarray array = getmatchingUncached(phrase_ref, match_prefixes, langfield, max_results, interrupt);
+    decoded_cache->insert(key, std::make_shared<const intarray>(array));
+    return array;
+}
 
-    size_t phrase_length = phrase.length();
-    if (match_prefixes == PrefixMatch::word_boundary) {
-        // If we're looking for a word boundary we need have one more character
-        // available than the phrase is long. Incrementing this lengh ensures we
-        // don't use a prefix cache that could cut off the word break.
-        phrase_length++;
+// Exact matches on caches with metadata records know every key they need from
+// their metadata scan, so the messages for all of them are read with a single
+// MultiGet, which batches the lookups that land in the same table and block
+// instead of walking the read path once per key. Prefix scans, and caches
+// packed before metadata records were added, are looked up one at a time.
+std::vector<intarray> RocksDBCache::__getmatchingMany(std::vector<MatchingQuery> const& queries, Interrupt const* interrupt) {
+    std::vector<intarray> results(queries.size());
+
+    // the queries left for the MultiGet, and the keys of their messages
+    std::vector<size_t> batched;
+    std::vector<std::vector<lazyMessage>> candidates;
+    std::vector<std::string> cache_keys;
+    for (size_t i = 0; i < queries.size(); i++) {
+        MatchingQuery const& query = queries[i];
+        if (interrupt != nullptr) interrupt->check();
+        if (!has_metadata || query.match_prefixes != PrefixMatch::disabled) {
+            results[i] = __getmatching(query.phrase, query.match_prefixes, query.langfield, query.max_results, interrupt);
+            continue;
+        }
+        if (decoded_cache) {
+            std::string key = DecodedGridCache::key(query.phrase, query.match_prefixes, query.langfield, query.max_results);
+            std::shared_ptr<const intarray> cached = decoded_cache->lookup(key);
+            if (cached) {
+                results[i] = *cached;
+                continue;
+            }
+            cache_keys.push_back(std::move(key));
+        }
+        batched.push_back(i);
+        candidates.push_back(scanMetadata(getmatchingSeekKey(query.phrase, query.match_prefixes), query.match_prefixes, query.langfield));
     }
+    if (batched.empty()) return results;
 
-    if (match_prefixes != PrefixMatch::disabled) {
-        // if this is an autocomplete scan, use the prefix cache
-        if (phrase_length <= MEMO_PREFIX_LENGTH_T1) {
-            phrase = "=1" + phrase.substr(0, MEMO_PREFIX_LENGTH_T1);
-        } else if (phrase_length <= MEMO_PREFIX_LENGTH_T2) {
-            phrase = "=2" + phrase.substr(0, MEMO_PREFIX_LENGTH_T2);
+    std::vector<rocksdb::Slice> keys;
+    for (auto const& query_candidates : candidates) {
+        for (lazyMessage const& candidate : query_candidates) {
+            keys.emplace_back(candidate.key);
+        }
+    }
+    std::vector<std::string> values;
+    std::vector<rocksdb::Status> statuses = db->MultiGet(rocksdb::ReadOptions(), keys, &values);
+
+    size_t k = 0;
+    for (size_t j = 0; j < batched.size(); j++) {
+        MatchingQuery const& query = queries[batched[j]];
+        std::vector<matchedMessage> messages;
+        for (lazyMessage const& candidate : candidates[j]) {
+            if (statuses[k].ok()) {
+                messages.emplace_back(protozero::data_view(values[k].data(), values[k].size()), candidate.matches_language);
+            }
+            k++;
         }
+        intarray& array = results[batched[j]];
+        mergeMessages(messages, array, query.max_results, interrupt);
+        if (decoded_cache) decoded_cache->insert(cache_keys[j], std::make_shared<const intarray>(array));
     }
+    return results;
+}
 
-    std::unique_ptr<rocksdb::Iterator> rit(db->NewIterator(rocksdb::ReadOptions()));
-    for (rit->Seek(phrase); rit->Valid() && rit->key().ToString().compare(0, phrase.size(), phrase) == 0; rit->Next()) {
-        std::string key = rit->key().ToString();
+DecodedCacheStats RocksDBCache::decodedCacheStats() const {
+    if (!decoded_cache) return DecodedCacheStats{};
+    return decoded_cache->stats();
+}
 
-        if (match_prefixes == PrefixMatch::word_boundary) {
-            // Read one character beyond the input prefix length, should always
-            // be safe because of the LANGFIELD_SEPARATOR
-            char endChar = key.at(phrase.length());
-            if (endChar != LANGFIELD_SEPARATOR && endChar != ' ') {
-                continue;
-            }
+// This is an alternative version of getmatching specifically intended for the
+// address/partial-number case that parses grid data eagerly rather than lazily
+// and does bbox filtering before sorting. At present we only use it from
+// coalesceSingle, and it's only defined for the RocksDBCache and MmapCache; this
+// filtering is not necessary for correctness, just for performance, so the
+// MemoryCache doesn't need it in order to produce the correct results (and it's
+// slow anyway)
+intarray RocksDBCache::__getmatchingBboxFiltered(const std::string& phrase_ref, PrefixMatch match_prefixes, langfield_type langfield, size_t max_results, const uint64_t box[4], Interrupt const* interrupt) {
+    intarray array;
+    std::string phrase = getmatchingSeekKey(phrase_ref, match_prefixes);
+
+    // each value is decoded before the iterator moves on, so nothing needs
+    // to be pinned or copied here
+    std::unique_ptr<rocksdb::Iterator> rit(db->NewIterator(scanOptions(phrase)));
+    for (rit->Seek(phrase); rit->Valid() && rit->key().starts_with(phrase); rit->Next()) {
+        rocksdb::Slice key = rit->key();
+        if (interrupt != nullptr) interrupt->check();
+
+        if (match_prefixes == PrefixMatch::word_boundary && !matchesWordBoundary(key.data(), key.size(), phrase.size())) {
+            continue;
         }
 
         // grab the langfield from the end of the key
-        langfield_type message_langfield = extract_langfield(key);
+        langfield_type message_langfield = extract_langfield(key.data(), key.size());
         auto matches_language = static_cast<bool>(message_langfield & langfield);
 
         uint64_t boost = matches_language ? LANGUAGE_MATCH_BOOST : 0;
-        decodeAndBboxFilter(rit->value().ToString(), array, boost, box);
+        rocksdb::Slice value = rit->value();
+        decodeAndBboxFilter(protozero::data_view(value.data(), value.size()), array, boost, box);
     }
 
     std::sort(array.begin(), array.end(), std::greater<uint64_t>());
@@ -179,34 +328,90 @@ RocksDBCache::RocksDBCache() = default;
 
 RocksDBCache::~RocksDBCache() = default;
 
-bool RocksDBCache::pack(const std::string& filename) {
+bool RocksDBCache::pack(const std::string& filename, PackOptions const& pack_options) {
     std::shared_ptr<rocksdb::DB> existing = this->db;
 
     if (existing && existing->GetName() == filename) {
         throw std::invalid_argument("rocksdb file is already loaded read-only; unload first");
     }
 
+    rocksdb::Options options = packRocksDBOptions(pack_options);
     std::unique_ptr<rocksdb::DB> clone;
-    rocksdb::Options options;
-    options.create_if_missing = true;
     rocksdb::Status status = OpenDB(options, filename, clone);
 
     if (!status.ok()) {
-        throw std::invalid_argument("unable to open rocksdb file for packing");
+        throw std::invalid_argument("unable to open rocksdb file for packing: " + status.ToString());
     }
 
     // if what we have now is already a rocksdb, and it's a different
-    // one from what we're being asked to pack into, copy from one to the other
-    std::unique_ptr<rocksdb::Iterator> existingIt(existing->NewIterator(rocksdb::ReadOptions()));
+    // one from what we're being asked to pack into, copy from one to the other,
+    // re-encoding any messages that aren't in the requested encoding.
+    //
+    // Messages are streamed in key order straight into SST files, which are
+    // ingested in one step once they're all written. Metadata is rebuilt from
+    // the messages (so caches packed without it gain it when repacked) and
+    // written to a separate sequence of files; the message files are split
+    // around the metadata key range so that the two sequences don't overlap.
+    SstFileSequence messages(options, filename + "/carmen-pack-messages");
+    SstFileSequence metadata(options, filename + "/carmen-pack-metadata");
+    metadata.add(METADATA_PREFIX, std::to_string(METADATA_VERSION));
+
+    std::string message;
+    std::string record;
+    bool past_metadata = false;
+    std::unique_ptr<rocksdb::Iterator> existingIt(existing->NewIterator(fullScanOptions()));
     for (existingIt->SeekToFirst(); existingIt->Valid(); existingIt->Next()) {
-        clone->Put(rocksdb::WriteOptions(), existingIt->key(), existingIt->value());
+        rocksdb::Slice key = existingIt->key();
+        if (key.starts_with(METADATA_PREFIX)) continue;
+        if (!past_metadata && key.compare(METADATA_PREFIX) > 0) {
+            messages.split();
+            past_metadata = true;
+        }
+
+        rocksdb::Slice value = existingIt->value();
+        protozero::data_view view(value.data(), value.size());
+        transcodeMessage(view, pack_options.encoding, message);
+        messages.add(key, message);
+
+        record.clear();
+        encodeMetadata(messageMetadata(view), record);
+        metadata.add(METADATA_PREFIX + key.ToString(), record);
+    }
+    if (!existingIt->status().ok()) {
+        throw std::invalid_argument("unable to read rocksdb file for packing");
+    }
+
+    std::vector<std::string> paths = messages.finish();
+    std::vector<std::string> const& metadata_paths = metadata.finish();
+    paths.insert(paths.end(), metadata_paths.begin(), metadata_paths.end());
+    ingestSstFiles(*clone, paths);
+    finalizePackedDB(*clone, pack_options);
+
+    return true;
+}
+
+bool RocksDBCache::packMmap(const std::string& filename, PackOptions const& options) {
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    // rocksdb iterates in key order, which is the order the mmap index wants
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(fullScanOptions()));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        // mmap indexes read their messages in place, so they have no use for
+        // metadata records
+        if (it->key().starts_with(METADATA_PREFIX)) continue;
+
+        rocksdb::Slice value = it->value();
+        std::string message;
+        transcodeMessage(protozero::data_view(value.data(), value.size()), options.encoding, message);
+        entries.emplace_back(it->key().ToString(), std::move(message));
     }
 
+    writeMmapIndex(filename, entries);
     return true;
 }
 
 std::vector<std::pair<std::string, langfield_type>> RocksDBCache::list() {
-    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(rocksdb::ReadOptions()));
+    std::unique_ptr<rocksdb::Iterator> it(db->NewIterator(fullScanOptions()));
     std::vector<std::pair<std::string, langfield_type>> out;
     for (it->SeekToFirst(); it->Valid(); it->Next()) {
         std::string key_id = it->key().ToString();
@@ -220,16 +425,45 @@ std::vector<std::pair<std::string, langfield_type>> RocksDBCache::list() {
     return out;
 }
 
-RocksDBCache::RocksDBCache(const std::string& filename) {
+// If the cache was opened with a prefix extractor, iterators only see keys
+// sharing the seek key's prefix, which is exactly what a getmatching scan
+// wants and lets rocksdb skip tables whose prefix blooms rule the prefix out.
+// Seek keys outside the extractor's domain need a total order seek instead.
+rocksdb::ReadOptions RocksDBCache::scanOptions(const std::string& seek_key) const {
+    rocksdb::ReadOptions read_options;
+    if (prefix_extractor) {
+        if (prefix_extractor->InDomain(seek_key)) {
+            read_options.prefix_same_as_start = true;
+        } else {
+            read_options.total_order_seek = true;
+        }
+    }
+    return read_options;
+}
+
+// whole-cache iteration (list, pack) has to ignore any prefix extractor
+rocksdb::ReadOptions RocksDBCache::fullScanOptions() const {
+    rocksdb::ReadOptions read_options;
+    read_options.total_order_seek = true;
+    return read_options;
+}
+
+RocksDBCache::RocksDBCache(const std::string& filename, RocksDBOptions const& load_options) {
     std::unique_ptr<rocksdb::DB> _db;
-    rocksdb::Options options;
-    options.create_if_missing = true;
+    rocksdb::Options options = loadRocksDBOptions(load_options);
     rocksdb::Status status = OpenForReadOnlyDB(options, filename, _db);
 
     if (!status.ok()) {
         throw std::invalid_argument("unable to open rocksdb file for loading");
     }
     this->db = std::move(_db);
+    this->prefix_extractor = options.prefix_extractor;
+    if (load_options.decoded_cache_size > 0) {
+        this->decoded_cache = std::make_shared<DecodedGridCache>(load_options.decoded_cache_size);
+    }
+
+    std::string marker;
+    this->has_metadata = this->db->Get(rocksdb::ReadOptions(), METADATA_PREFIX, &marker).ok();
 }
 
 } // namespace carmen
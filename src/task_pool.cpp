@@ -0,0 +1,114 @@
+#include "task_pool.hpp"
+
+#include <algorithm>
+
+namespace carmen {
+
+TaskPool::TaskPool()
+    : mutex(),
+      ready(),
+      jobs(),
+      workers() {}
+
+TaskPool& TaskPool::shared() {
+    static TaskPool* pool = new TaskPool();
+    return *pool;
+}
+
+unsigned TaskPool::threads() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return static_cast<unsigned>(workers.size());
+}
+
+// starts threads until there are count of them, or as many as there are cpus
+// other than the caller's; must be called with mutex held
+void TaskPool::grow(unsigned count) {
+    unsigned cpus = std::thread::hardware_concurrency();
+    if (cpus > 0) count = std::min(count, cpus - 1);
+    while (workers.size() < count) {
+        try {
+            workers.emplace_back(&TaskPool::work, this);
+        } catch (std::system_error const&) {
+            // the callers will just have fewer helpers
+            return;
+        }
+    }
+}
+
+void TaskPool::claim(Job& job) {
+    try {
+        size_t i;
+        while ((i = job.claimed++) < job.partitions) {
+            (*job.fn)(i);
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(job.mutex);
+        if (!job.error) job.error = std::current_exception();
+        // nobody else should start on anything else
+        job.claimed = job.partitions;
+    }
+}
+
+void TaskPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        ready.wait(lock, [this] { return !jobs.empty(); });
+        Job* job = jobs.front();
+        {
+            std::lock_guard<std::mutex> job_lock(job->mutex);
+            job->helpers_joined++;
+            job->helpers_running++;
+            if (job->helpers_joined == job->helpers_wanted) jobs.pop_front();
+        }
+        lock.unlock();
+
+        claim(*job);
+
+        {
+            // notified under the lock: once it's released, run may return
+            // and the job is gone
+            std::lock_guard<std::mutex> job_lock(job->mutex);
+            job->helpers_running--;
+            job->finished.notify_one();
+        }
+        lock.lock();
+    }
+}
+
+void TaskPool::run(size_t partitions, unsigned helpers, std::function<void(size_t)> const& fn) {
+    helpers = static_cast<unsigned>(std::min(static_cast<size_t>(helpers), partitions > 0 ? partitions - 1 : 0));
+
+    Job job;
+    job.fn = &fn;
+    job.partitions = partitions;
+    job.claimed = 0;
+    job.helpers_wanted = helpers;
+    job.helpers_joined = 0;
+    job.helpers_running = 0;
+
+    if (helpers > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        grow(helpers);
+        if (!workers.empty()) {
+            jobs.push_back(&job);
+            ready.notify_all();
+        }
+    }
+
+    claim(job);
+
+    // every partition has been claimed, so helpers that haven't joined yet
+    // never will
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto queued = std::find(jobs.begin(), jobs.end(), &job);
+        if (queued != jobs.end()) jobs.erase(queued);
+    }
+    {
+        std::unique_lock<std::mutex> job_lock(job.mutex);
+        job.finished.wait(job_lock, [&job] { return job.helpers_running == 0; });
+    }
+    if (job.error) std::rethrow_exception(job.error);
+}
+
+} // namespace carmen
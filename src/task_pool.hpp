@@ -0,0 +1,71 @@
+#ifndef __CARMEN_TASK_POOL_HPP__
+#define __CARMEN_TASK_POOL_HPP__
+
+#include "cpp_util.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace carmen {
+
+// A process-wide set of threads that help a single request get through its
+// work faster, as opposed to the worker pool, which runs whole requests.
+//
+// A request splits its work into partitions and calls run, which offers them
+// to the pool and then works through them on the calling thread too. Every
+// thread that joins claims the next unclaimed partition from a shared
+// counter, so threads that finish early simply take more of them; nobody
+// waits on a partition that's stuck behind a slow one on another thread. If
+// every helper is busy with other requests, the caller does all of the work
+// itself, so run never waits for a thread to become free.
+class TaskPool : noncopyable {
+  public:
+    // the pool every request shares; it only starts threads once a request
+    // asks for them, and is never destroyed, since its threads may still be
+    // running when static destructors are
+    static TaskPool& shared();
+
+    // Calls fn(i) for every i in [0, partitions), on the calling thread and
+    // on at most helpers pool threads, and returns once all of them have
+    // returned. Partitions are claimed in ascending order, but may finish in
+    // any order. The first exception any call throws is rethrown here.
+    void run(size_t partitions, unsigned helpers, std::function<void(size_t)> const& fn);
+
+    // how many threads the pool has started
+    unsigned threads() const;
+
+  private:
+    struct Job {
+        std::function<void(size_t)> const* fn;
+        size_t partitions;
+        std::atomic<size_t> claimed;
+        // the rest are guarded by mutex
+        unsigned helpers_wanted;
+        unsigned helpers_joined;
+        unsigned helpers_running;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+
+    TaskPool();
+
+    void grow(unsigned count);
+    void work();
+    static void claim(Job& job);
+
+    mutable std::mutex mutex;
+    std::condition_variable ready;
+    // jobs that still want helpers
+    std::deque<Job*> jobs;
+    std::vector<std::thread> workers;
+};
+
+} // namespace carmen
+
+#endif // __CARMEN_TASK_POOL_HPP__
@@ -0,0 +1,321 @@
+#include "worker_pool.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace carmen {
+
+WorkerPool::WorkerPool(uv_loop_t* loop, WorkerPoolOptions const& options)
+    : thread_count(options.threads),
+      max_queued(options.max_queued),
+      mutex(),
+      ready(),
+      pending(),
+      done(),
+      stopping(false),
+      active(0),
+      completed(0),
+      rejected(0),
+      total_wait_ms(0),
+      max_wait_ms(0),
+      outstanding(0),
+      accepted(0),
+      async(new uv_async_t),
+      workers() {
+    uv_async_init(loop, async, onComplete);
+    async->data = this;
+    // an idle pool shouldn't keep the process alive
+    uv_unref(reinterpret_cast<uv_handle_t*>(async));
+
+    for (unsigned i = 0; i < thread_count; i++) {
+        workers.emplace_back(&WorkerPool::run, this);
+#ifdef __linux__
+        if (!options.affinity.empty()) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(options.affinity[i % options.affinity.size()], &cpus);
+            pthread_setaffinity_np(workers.back().native_handle(), sizeof(cpus), &cpus);
+        }
+#endif
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    uv_close(reinterpret_cast<uv_handle_t*>(async), [](uv_handle_t* handle) {
+        delete reinterpret_cast<uv_async_t*>(handle);
+    });
+}
+
+void WorkerPool::queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after) {
+    if (outstanding++ == 0) uv_ref(reinterpret_cast<uv_handle_t*>(async));
+
+    Job job{req, work, after, std::chrono::steady_clock::now(), 0};
+    // a free thread takes a job straight away, so only jobs beyond the
+    // threads count as waiting. A job holds its place until its after
+    // callback runs, and that only changes on the loop thread, so whether a
+    // job fits never depends on how far the workers have got.
+    if (accepted < thread_count || accepted - thread_count < max_queued) {
+        accepted++;
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(job);
+        ready.notify_one();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // like uv_cancel, a rejected job's after callback still runs, later
+        // on the loop thread, rather than from inside queue
+        job.status = UV_ECANCELED;
+        rejected++;
+    }
+    complete(job);
+}
+
+void WorkerPool::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        ready.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) return;
+
+        Job job = pending.front();
+        pending.pop_front();
+        std::chrono::duration<double, std::milli> wait = std::chrono::steady_clock::now() - job.queued_at;
+        total_wait_ms += wait.count();
+        max_wait_ms = std::max(max_wait_ms, wait.count());
+        active++;
+        lock.unlock();
+
+        job.work(job.req);
+
+        lock.lock();
+        active--;
+        completed++;
+        done.push_back(job);
+        uv_async_send(async);
+    }
+}
+
+void WorkerPool::complete(Job const& job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.push_back(job);
+    }
+    uv_async_send(async);
+}
+
+// uv_async_send calls can be coalesced, so every completed job is run here,
+// not just one
+void WorkerPool::onComplete(uv_async_t* handle) {
+    WorkerPool* pool = static_cast<WorkerPool*>(handle->data);
+    std::vector<Job> finished;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        finished.swap(pool->done);
+    }
+    for (Job const& job : finished) {
+        if (job.status == 0) pool->accepted--;
+        job.after(job.req, job.status);
+    }
+    pool->outstanding -= finished.size();
+    if (pool->outstanding == 0) uv_unref(reinterpret_cast<uv_handle_t*>(handle));
+}
+
+WorkerPoolStats WorkerPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    WorkerPoolStats out{};
+    out.threads = thread_count;
+    out.max_queued = max_queued;
+    out.queued = pending.size();
+    out.active = active;
+    out.completed = completed;
+    out.rejected = rejected;
+    out.total_wait_ms = total_wait_ms;
+    out.max_wait_ms = max_wait_ms;
+    return out;
+}
+
+// Only touched from the loop thread. The pool is never destroyed at exit:
+// by the time static destructors run the loop it was made on is gone.
+inline WorkerPool*& coalescePool() {
+    static WorkerPool* pool = nullptr;
+    return pool;
+}
+
+void configureCoalescePool(WorkerPoolOptions const& options) {
+    WorkerPool*& pool = coalescePool();
+    if (pool != nullptr && !pool->idle()) {
+        throw std::invalid_argument("the worker pool can't be reconfigured while coalesce jobs are running");
+    }
+    unsigned cpus = std::thread::hardware_concurrency();
+    for (unsigned cpu : options.affinity) {
+        if (cpus > 0 && cpu >= cpus) {
+            throw std::invalid_argument("affinity cpu " + std::to_string(cpu) + " is out of range");
+        }
+    }
+
+    delete pool;
+    pool = nullptr;
+    if (options.threads > 0) {
+        pool = new WorkerPool(uv_default_loop(), options);
+    }
+}
+
+WorkerPoolStats coalescePoolStats() {
+    WorkerPool* pool = coalescePool();
+    if (pool == nullptr) return WorkerPoolStats{};
+    return pool->stats();
+}
+
+// hands an admitted job to the pool if there is one, or the libuv
+// threadpool if not
+void dispatchCoalesceWork(uv_work_t* req, uv_work_cb work, uv_after_work_cb after) {
+    WorkerPool* pool = coalescePool();
+    if (pool != nullptr) {
+        pool->queue(req, work, after);
+    } else {
+        uv_queue_work(uv_default_loop(), req, work, after);
+    }
+}
+
+// Only touched from the loop thread, and never destroyed at exit, for the
+// same reason as the pool.
+inline AdmissionControl& coalesceAdmission() {
+    static AdmissionControl* admission = new AdmissionControl(uv_default_loop());
+    return *admission;
+}
+
+AdmissionControl::AdmissionControl(uv_loop_t* loop)
+    : max_in_flight(0),
+      max_queued(AdmissionOptions().max_queued),
+      queues(max_queued.size()),
+      in_flight(0),
+      admitted(0),
+      rejected(0),
+      running(),
+      rejected_jobs(),
+      async(new uv_async_t) {
+    uv_async_init(loop, async, onRejected);
+    async->data = this;
+    uv_unref(reinterpret_cast<uv_handle_t*>(async));
+}
+
+AdmissionControl::~AdmissionControl() {
+    uv_close(reinterpret_cast<uv_handle_t*>(async), [](uv_handle_t* handle) {
+        delete reinterpret_cast<uv_async_t*>(handle);
+    });
+}
+
+void AdmissionControl::configure(AdmissionOptions const& options) {
+    if (options.max_queued.empty()) {
+        throw std::invalid_argument("there must be at least one lane");
+    }
+    if (options.max_queued.size() != queues.size()) {
+        for (auto const& waiting : queues) {
+            if (!waiting.empty()) {
+                throw std::invalid_argument("the number of lanes can't change while coalesce jobs are waiting");
+            }
+        }
+        queues.resize(options.max_queued.size());
+    }
+    max_in_flight = options.max_in_flight;
+    max_queued = options.max_queued;
+    // a higher limit may have room for jobs that are waiting
+    admitWaiting();
+}
+
+void AdmissionControl::queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, size_t lane) {
+    Job job{req, work, after};
+    if (hasRoom()) {
+        admit(job);
+        return;
+    }
+    if (queues[lane].size() < max_queued[lane]) {
+        queues[lane].push_back(job);
+        return;
+    }
+
+    rejected++;
+    if (rejected_jobs.empty()) uv_ref(reinterpret_cast<uv_handle_t*>(async));
+    rejected_jobs.push_back(job);
+    uv_async_send(async);
+}
+
+void AdmissionControl::admit(Job const& job) {
+    running.emplace(job.req, job.after);
+    in_flight++;
+    admitted++;
+    dispatchCoalesceWork(job.req, job.work, onDone);
+}
+
+void AdmissionControl::admitWaiting() {
+    for (auto& waiting : queues) {
+        while (!waiting.empty() && hasRoom()) {
+            Job job = waiting.front();
+            waiting.pop_front();
+            admit(job);
+        }
+    }
+}
+
+// waiting jobs are admitted before the finished job's callback runs, so that
+// they go ahead of any jobs the callback queues
+void AdmissionControl::onDone(uv_work_t* req, int status) {
+    AdmissionControl& admission = coalesceAdmission();
+    auto found = admission.running.find(req);
+    uv_after_work_cb after = found->second;
+    admission.running.erase(found);
+    admission.in_flight--;
+    admission.admitWaiting();
+    after(req, status);
+}
+
+void AdmissionControl::onRejected(uv_async_t* handle) {
+    AdmissionControl* admission = static_cast<AdmissionControl*>(handle->data);
+    std::vector<Job> jobs;
+    jobs.swap(admission->rejected_jobs);
+    uv_unref(reinterpret_cast<uv_handle_t*>(handle));
+    for (Job const& job : jobs) {
+        job.after(job.req, UV_ECANCELED);
+    }
+}
+
+AdmissionStats AdmissionControl::stats() const {
+    AdmissionStats out{};
+    out.max_in_flight = max_in_flight;
+    out.in_flight = in_flight;
+    out.max_queued = max_queued;
+    for (auto const& waiting : queues) {
+        out.queued.push_back(waiting.size());
+    }
+    out.admitted = admitted;
+    out.rejected = rejected;
+    return out;
+}
+
+void configureCoalesceAdmission(AdmissionOptions const& options) {
+    coalesceAdmission().configure(options);
+}
+
+AdmissionStats coalesceAdmissionStats() {
+    return coalesceAdmission().stats();
+}
+
+size_t coalesceLanes() {
+    return coalesceAdmission().lanes();
+}
+
+void queueCoalesceWork(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, size_t lane) {
+    coalesceAdmission().queue(req, work, after, lane);
+}
+
+} // namespace carmen
@@ -0,0 +1,181 @@
+#ifndef __CARMEN_WORKER_POOL_HPP__
+#define __CARMEN_WORKER_POOL_HPP__
+
+#include "cpp_util.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <uv.h>
+
+namespace carmen {
+
+// options for the coalesce worker pool; see configureCoalescePool
+struct WorkerPoolOptions {
+    // 0 sends coalesce work back to the libuv threadpool
+    unsigned threads = 0;
+    // jobs waiting for a thread beyond this are rejected; a job that a free
+    // thread can take straight away isn't waiting, so 0 only rejects jobs
+    // that arrive while every thread has a job whose after callback hasn't
+    // run yet
+    size_t max_queued = 1024;
+    // if not empty, worker i is pinned to cpu affinity[i % affinity.size()]
+    // (only on linux; ignored elsewhere)
+    std::vector<unsigned> affinity;
+};
+
+struct WorkerPoolStats {
+    unsigned threads;
+    size_t max_queued;
+    size_t queued;
+    size_t active;
+    uint64_t completed;
+    uint64_t rejected;
+    double total_wait_ms;
+    double max_wait_ms;
+};
+
+// A fixed set of threads, owned by carmen-cache, that runs uv_work_t jobs in
+// place of the libuv threadpool, so that coalesce neither competes with fs
+// and dns work for libuv's threads nor depends on UV_THREADPOOL_SIZE.
+//
+// Jobs are queued and completed the way uv_queue_work does it: work runs on
+// a pool thread, and after runs on the loop thread (woken through a
+// uv_async_t) with status 0, or UV_ECANCELED if the queue was full and the
+// work never ran. Everything but work is called on the loop thread.
+class WorkerPool : noncopyable {
+  public:
+    WorkerPool(uv_loop_t* loop, WorkerPoolOptions const& options);
+    // finishes the queued jobs, then stops the threads; only call it once
+    // the pool is idle
+    ~WorkerPool();
+
+    void queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after);
+
+    // whether every job queued has had its after callback run
+    bool idle() const { return outstanding == 0; }
+
+    WorkerPoolStats stats() const;
+
+  private:
+    struct Job {
+        uv_work_t* req;
+        uv_work_cb work;
+        uv_after_work_cb after;
+        std::chrono::steady_clock::time_point queued_at;
+        int status;
+    };
+
+    void run();
+    void complete(Job const& job);
+    static void onComplete(uv_async_t* handle);
+
+    unsigned thread_count;
+    size_t max_queued;
+    mutable std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Job> pending;
+    std::vector<Job> done;
+    bool stopping;
+    size_t active;
+    uint64_t completed;
+    uint64_t rejected;
+    double total_wait_ms;
+    double max_wait_ms;
+    // jobs queued whose after callback hasn't run; loop thread only
+    size_t outstanding;
+    // the jobs of those that weren't rejected; loop thread only
+    size_t accepted;
+    // owned by the loop once initialized, and freed when it's closed
+    uv_async_t* async;
+    std::vector<std::thread> workers;
+};
+
+// (Re)configures the pool coalesce and coalesceBatch run on. The pool can
+// only be replaced while it's idle.
+void configureCoalescePool(WorkerPoolOptions const& options);
+WorkerPoolStats coalescePoolStats();
+
+// options for admitting coalesce jobs; see AdmissionControl
+struct AdmissionOptions {
+    // the most jobs that can be running or queued on a pool at once; 0 for
+    // no limit
+    size_t max_in_flight = 0;
+    // one entry per lane, highest priority first: the most jobs that can wait
+    // in that lane to be admitted
+    std::vector<size_t> max_queued = {std::numeric_limits<size_t>::max()};
+};
+
+struct AdmissionStats {
+    size_t max_in_flight;
+    size_t in_flight;
+    std::vector<size_t> max_queued;
+    std::vector<size_t> queued;
+    uint64_t admitted;
+    uint64_t rejected;
+};
+
+// Limits how many coalesce jobs are handed to the worker pool (or the libuv
+// threadpool) at once. Jobs beyond max_in_flight wait here, in one of several
+// lanes, and whenever a job finishes the next one is admitted from the
+// highest priority lane that has any, so that, say, exact matches needn't
+// wait behind a burst of autocomplete queries. A job that arrives when its
+// lane is full fails straight away, like one the worker pool has no room for:
+// its after callback runs on the next loop iteration with UV_ECANCELED.
+//
+// Everything here happens on the loop thread, so none of it is locked.
+class AdmissionControl : noncopyable {
+  public:
+    explicit AdmissionControl(uv_loop_t* loop);
+    ~AdmissionControl();
+
+    // the number of lanes can only change while no jobs are waiting
+    void configure(AdmissionOptions const& options);
+    size_t lanes() const { return queues.size(); }
+
+    void queue(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, size_t lane);
+
+    AdmissionStats stats() const;
+
+  private:
+    struct Job {
+        uv_work_t* req;
+        uv_work_cb work;
+        uv_after_work_cb after;
+    };
+
+    bool hasRoom() const { return max_in_flight == 0 || in_flight < max_in_flight; }
+    void admit(Job const& job);
+    void admitWaiting();
+    static void onDone(uv_work_t* req, int status);
+    static void onRejected(uv_async_t* handle);
+
+    size_t max_in_flight;
+    std::vector<size_t> max_queued;
+    std::vector<std::deque<Job>> queues;
+    size_t in_flight;
+    uint64_t admitted;
+    uint64_t rejected;
+    // the after callbacks of the jobs in flight
+    std::unordered_map<uv_work_t*, uv_after_work_cb> running;
+    std::vector<Job> rejected_jobs;
+    // owned by the loop once initialized, and freed when it's closed
+    uv_async_t* async;
+};
+
+void configureCoalesceAdmission(AdmissionOptions const& options);
+AdmissionStats coalesceAdmissionStats();
+// the number of lanes jobs can be queued in
+size_t coalesceLanes();
+
+// queues coalesce work in the given lane, to be run on the pool if there is
+// one, or the libuv threadpool if not, once it's admitted
+void queueCoalesceWork(uv_work_t* req, uv_work_cb work, uv_after_work_cb after, size_t lane = 0);
+
+} // namespace carmen
+
+#endif // __CARMEN_WORKER_POOL_HPP__
@@ -20,6 +20,44 @@ const sortedDescending = function(arr) {
     return [].concat(arr).sort((a, b) => { return b - a; });
 };
 
+// a MemoryCache holding two grids for every phrase in every language, and a
+// third in the languages languagesOf(i) gives for the ith phrase
+const phraseCache = function(phrases, languagesOf) {
+    const cache = new carmenCache.MemoryCache('a');
+    phrases.forEach((phrase, i) => {
+        cache._set(phrase, [i * 10 + 1, i * 10 + 2]);
+        cache._set(phrase, [i * 10 + 3], languagesOf(i));
+    });
+    return cache;
+};
+
+// packs cache with packOptions and opens the result with loaderOptions
+const packed = function(cache, id, packOptions, loaderOptions) {
+    const pack = tmpfile();
+    cache.pack(pack, packOptions);
+    return new carmenCache.RocksDBCache(id, pack, loaderOptions);
+};
+
+// checks that actual lists the same keys as expected, and returns the same
+// _get and _getMatching results for every query, set of languages and prefix
+// mode
+const assertSameLookups = function(t, actual, expected, queries, languages) {
+    const scan = carmenCache.PREFIX_SCAN;
+    t.deepEqual(sorted(actual.list().map(JSON.stringify)), sorted(expected.list().map(JSON.stringify)), actual.id + ': list matches');
+    queries.forEach((query) => {
+        languages.forEach((langs) => {
+            t.deepEqual(actual._get(query, langs), expected._get(query, langs), actual.id + ': _get ' + query + ' ' + JSON.stringify(langs));
+            [scan.disabled, scan.enabled, scan.word_boundary].forEach((prefix) => {
+                t.deepEqual(
+                    actual._getMatching(query, prefix, langs),
+                    expected._getMatching(query, prefix, langs),
+                    actual.id + ': _getMatching ' + query + ' ' + prefix + ' ' + JSON.stringify(langs)
+                );
+            });
+        });
+    });
+};
+
 test('list', (t) => {
     const cache = new carmenCache.MemoryCache('a');
     cache._set('5', [0,1,2]);
@@ -169,3 +207,343 @@ test('pack', (t) => {
 
     t.end();
 });
+
+test('RocksDBCache options', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    const pack = tmpfile();
+    cache._set('main st', [1, 2, 3]);
+    cache.pack(pack);
+
+    t.throws(() => { new carmenCache.RocksDBCache('a', pack, 1); }, /options must be an object/, 'throws on non-object options');
+    t.throws(() => { new carmenCache.RocksDBCache('a', pack, { blockCacheSize: -1 }); }, /blockCacheSize is out of range/, 'throws on negative blockCacheSize');
+    t.throws(() => { new carmenCache.RocksDBCache('a', pack, { bloomBitsPerKey: 'a' }); }, /bloomBitsPerKey must be a number/, 'throws on non-numeric bloomBitsPerKey');
+    t.throws(() => { new carmenCache.RocksDBCache('a', pack, { prefixBloom: 1 }); }, /prefixBloom must be a boolean/, 'throws on non-boolean prefixBloom');
+    t.throws(() => { new carmenCache.RocksDBCache('a', pack, { mmapReads: 'yes' }); }, /mmapReads must be a boolean/, 'throws on non-boolean mmapReads');
+    t.throws(() => { cache.pack(tmpfile(), { prefixBloom: 'yes' }); }, /prefixBloom must be a boolean/, 'pack throws on non-boolean prefixBloom');
+
+    const loader = new carmenCache.RocksDBCache('a', pack, { blockCacheSize: 1024 * 1024, maxOpenFiles: 100, mmapReads: true });
+    t.deepEqual(loader._get('main st'), [3, 2, 1], 'reads with options');
+    t.end();
+});
+
+test('RocksDBCache bloom filters', (t) => {
+    const phrases = ['a', 'ab', 'abc', 'abc d', 'abcd', 'abcdef', 'abcdefgh', 'abcdefgh ij', 'b', 'main st', 'main street', 'maine'];
+    const cache = phraseCache(phrases, (i) => [i % 3]);
+
+    const plain = packed(cache, 'plain');
+    const bloom = packed(cache, 'bloom', { bloomBitsPerKey: 10, prefixBloom: true }, { bloomBitsPerKey: 10, prefixBloom: true });
+
+    const queries = phrases.concat(['abcdefg', 'abcdefgh i', 'ma', 'mai', 'main', 'main s', 'z', 'zzzzzzzz']);
+    assertSameLookups(t, bloom, plain, queries, [undefined, [0], [1], [2]]);
+    t.end();
+});
+
+test('pack with threads', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 500; i++) {
+        // shared leading characters, so memoized prefixes span the shards
+        const phrase = ['ab', 'abc', 'abcdefg', 'b'][i % 4] + ' ' + i;
+        cache._set(phrase, [i * 3 + 2, i * 3 + 1, i * 3 + 2]);
+        cache._set(phrase, [i * 3 + 3], [i % 2]);
+    }
+
+    const serial = packed(cache, 'serial', { threads: 1 });
+    const parallel = packed(cache, 'parallel', { threads: 7 });
+
+    t.equal(serial.list().length, 1000, 'every key is packed');
+    assertSameLookups(t, parallel, serial, ['a', 'ab', 'abc', 'abcd', 'abcdefg', 'b', 'ab 12', 'b 3'], [undefined, [0], [1]]);
+
+    const empty = new carmenCache.MemoryCache('empty');
+    t.deepEqual(packed(empty, 'empty', { threads: 4 }).list(), [], 'packs an empty cache');
+
+    t.throws(() => { cache.pack(tmpfile(), { threads: -1 }); }, /threads is out of range/, 'throws on negative threads');
+    t.end();
+});
+
+test('RocksDBCache repack', (t) => {
+    // phrases on both sides of the =m metadata keys, and memoized prefixes
+    // below them
+    const phrases = ['1 main', '12', '<', '=', '>', 'ab', 'abcdef', 'main st', 'zz'];
+    const loader = packed(phraseCache(phrases, () => [1]), 'a');
+
+    const block = packed(loader, 'block', { encoding: 'block' });
+    const varint = packed(block, 'varint');
+
+    [block, varint].forEach((repacked) => {
+        assertSameLookups(t, repacked, loader, phrases.concat(['1', 'a', 'mai']), [undefined, [1]]);
+    });
+    t.end();
+});
+
+test('pack finalize', (t) => {
+    const phrases = ['a', 'ab', 'abc', 'abcdefg', 'main st', 'main street'];
+    const cache = phraseCache(phrases, () => [1]);
+
+    const plain = packed(cache, 'plain');
+    const final = packed(cache, 'final', { finalize: true, bottommostCompression: 'none', compressionDictBytes: 16384 });
+    const repacked = packed(plain, 'repacked', { finalize: true });
+
+    [final, repacked].forEach((c) => {
+        assertSameLookups(t, c, plain, phrases.concat(['m', 'main']), [[1]]);
+    });
+
+    t.throws(() => { cache.pack(tmpfile(), { bottommostCompression: 'lzma' }); }, /bottommostCompression must be/, 'throws on unknown compression');
+    t.throws(() => { cache.pack(tmpfile(), { finalize: 'yes' }); }, /finalize must be a boolean/, 'throws on non-boolean finalize');
+    t.end();
+});
+
+test('RocksDBCache decoded result cache', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 100; i++) cache._set('street' + i, [i, i + 1, i + 2]);
+    const pack = tmpfile();
+    cache.pack(pack);
+
+    const plain = new carmenCache.RocksDBCache('a', pack);
+    t.deepEqual(plain.decodedCacheStats().capacity, 0, 'disabled by default');
+
+    const cached = new carmenCache.RocksDBCache('a', pack, { decodedCacheSize: 16 * 1024 * 1024 });
+    for (let pass = 0; pass < 2; pass++) {
+        t.deepEqual(cached._getMatching('street', 1), plain._getMatching('street', 1), 'prefix scan, pass ' + pass);
+        t.deepEqual(cached._getMatching('street1', 0), plain._getMatching('street1', 0), 'exact match, pass ' + pass);
+    }
+    t.deepEqual(cached._getMatching('street1', 1), plain._getMatching('street1', 1), 'prefix mode is part of the key');
+
+    const stats = cached.decodedCacheStats();
+    ['capacity', 'usage', 'entries', 'hits', 'misses', 'rejected', 'evictions'].forEach((key) => {
+        t.ok(stats.hasOwnProperty(key), 'stats include ' + key);
+    });
+    t.equal(stats.hits, 2, 'second pass hits');
+    t.equal(stats.misses, 3, 'first lookups miss');
+    t.equal(stats.entries, 3, 'results are kept');
+    t.ok(stats.usage > 0 && stats.usage <= stats.capacity, 'usage is bounded');
+    t.end();
+});
+
+test('shared block cache', (t) => {
+    t.throws(() => { carmenCache.configureBlockCache(); }, /expected an options object/, 'throws without options');
+    t.throws(() => { carmenCache.configureBlockCache({}); }, /missing size/, 'throws without size');
+    t.throws(() => { carmenCache.configureBlockCache({ size: -1 }); }, /size is out of range/, 'throws on negative size');
+    t.throws(() => { carmenCache.configureBlockCache({ size: 1024, type: 'fifo' }); }, /must be 'lru' or 'clock'/, 'throws on unknown type');
+
+    const cache = new carmenCache.MemoryCache('a');
+    for (let i = 0; i < 100; i++) cache._set('key' + i, [i, i + 1, i + 2]);
+    const pack = tmpfile();
+    cache.pack(pack);
+
+    const before = carmenCache.blockCacheStats();
+    ['type', 'capacity', 'usage', 'pinnedUsage', 'hits', 'misses'].forEach((key) => {
+        t.ok(before.hasOwnProperty(key), 'stats include ' + key);
+    });
+
+    const a = new carmenCache.RocksDBCache('a', pack);
+    const b = new carmenCache.RocksDBCache('b', pack);
+    for (let i = 0; i < 100; i++) {
+        t.deepEqual(a._get('key' + i), [i + 2, i + 1, i], 'a reads key' + i);
+        t.deepEqual(b._get('key' + i), [i + 2, i + 1, i], 'b reads key' + i);
+    }
+
+    const after = carmenCache.blockCacheStats();
+    t.ok(after.hits + after.misses > before.hits + before.misses, 'lookups are counted');
+    t.ok(after.usage > 0, 'shared cache is in use');
+
+    carmenCache.configureBlockCache({ size: 64 * 1024 * 1024 });
+    t.equal(carmenCache.blockCacheStats().capacity, 64 * 1024 * 1024, 'capacity can be changed after opening caches');
+    const otherType = after.type === 'lru' ? 'clock' : 'lru';
+    t.throws(() => { carmenCache.configureBlockCache({ size: 1024, type: otherType }); }, /can't be changed/, 'type can\'t be changed after opening caches');
+    t.end();
+});
+
+test('async _get', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    cache._set('key', [1, 2, 3]);
+    cache._set('key', [4, 5], [1]);
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('a', pack);
+
+    let pending = 0;
+    [cache, loader].forEach((c) => {
+        [[undefined], [[1]], [[2]]].forEach((args) => {
+            pending++;
+            c._get.apply(c, ['key'].concat(args, (err, grids) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(grids, c._get.apply(c, ['key'].concat(args)), c.id + ' matches sync _get for ' + JSON.stringify(args));
+                if (--pending === 0) t.end();
+            }));
+        });
+    });
+});
+
+test('no writes during async lookups', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    cache._set('key', [1, 2, 3]);
+    const dump = tmpfile();
+    fs.writeFileSync(dump, JSON.stringify({ id: 'key', grids: [4] }) + '\n');
+
+    cache._get('key', (err, grids) => {
+        t.ifError(err, 'no errors');
+        t.deepEqual(grids, [3, 2, 1], 'the lookup saw the cache as it was');
+        cache._set('key', [5], null, true);
+        t.deepEqual(cache._get('key'), [5, 3, 2, 1], '_set works once the lookup is done');
+        t.end();
+    });
+    t.throws(() => { cache._set('key', [4], null, true); }, /cannot modify a MemoryCache while lookups or coalesce calls are using it/, '_set throws while a lookup is running');
+    t.throws(() => { cache.loadFile(dump); }, /cannot modify a MemoryCache while lookups or coalesce calls are using it/, 'loadFile throws while a lookup is running');
+});
+
+test('_getGrids', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    const grids = [3, 1, Math.pow(2, 40) + 5, Math.pow(2, 52) + 2];
+    cache._set('key', grids);
+    t.equal(cache._getGrids('missing'), undefined, 'undefined without grids');
+
+    const raw = cache._getGrids('key');
+    let values;
+    if (typeof BigUint64Array !== 'undefined') {
+        t.ok(raw instanceof BigUint64Array, 'returns a BigUint64Array');
+        values = Array.from(raw, Number);
+    } else {
+        t.ok(Buffer.isBuffer(raw), 'returns a Buffer');
+        values = [];
+        for (let i = 0; i < raw.length; i += 8) values.push(raw.readUInt32LE(i + 4) * Math.pow(2, 32) + raw.readUInt32LE(i));
+    }
+    t.deepEqual(values, cache._get('key'), 'same grids as _get');
+    t.end();
+});
+
+test('_set with typed arrays', (t) => {
+    const cache = new carmenCache.MemoryCache('a');
+    cache._set('float', new Float64Array([1, 2, Math.pow(2, 40)]));
+    t.deepEqual(cache._get('float'), sortedDescending([1, 2, Math.pow(2, 40)]), 'reads a Float64Array');
+
+    // a view into the middle of a larger buffer
+    const view = new Float64Array(new Float64Array([9, 3, 4, 9]).buffer, 8, 2);
+    cache._set('view', view, [1]);
+    cache._set('view', new Float64Array([5]), [1], true);
+    t.deepEqual(cache._get('view', [1]), [5, 4, 3], 'reads views, and appends');
+
+    if (typeof BigUint64Array !== 'undefined') {
+        cache._set('big', new BigUint64Array([BigInt(7), BigInt(1) << BigInt(63)]));
+        t.deepEqual(Array.from(cache._getGrids('big')).map(String), [String(BigInt(1) << BigInt(63)), '7'], 'reads a BigUint64Array exactly');
+    }
+    t.throws(() => { cache._set('bad', new Uint8Array(4)); }, /second arg must be an Array, Float64Array or BigUint64Array/, 'other typed arrays are rejected');
+    t.end();
+});
+
+test('loadFile', (t) => {
+    const ndjson = tmpfile();
+    fs.writeFileSync(ndjson, [
+        JSON.stringify({ id: 'a', grids: [1, 2] }),
+        '',
+        JSON.stringify({ id: 'b', grids: [3], languages: [1], note: { skipped: [true] } }),
+        JSON.stringify({ id: 'a', grids: [4] })
+    ].join('\n') + '\n');
+
+    const cache = new carmenCache.MemoryCache('a');
+    t.equal(cache.loadFile(ndjson), 3, 'counts NDJSON records');
+    t.deepEqual(cache._get('a'), [4, 2, 1], 'records for the same key are appended');
+    t.deepEqual(cache._get('b', [1]), [3], 'languages are read');
+
+    // binary: magic, then per record a length-prefixed phrase, a 16-byte
+    // language bitmask and length-prefixed little-endian uint64 grids
+    const record = (phrase, languages, grids) => {
+        const phraseBytes = Buffer.from(phrase);
+        const head = Buffer.alloc(4);
+        head.writeUInt32LE(phraseBytes.length, 0);
+        const langs = Buffer.alloc(16, languages ? 0 : 0xff);
+        (languages || []).forEach((l) => { langs[l >> 3] |= 1 << (l & 7); });
+        const body = Buffer.alloc(4 + grids.length * 8);
+        body.writeUInt32LE(grids.length, 0);
+        grids.forEach((g, i) => {
+            body.writeUInt32LE(g % Math.pow(2, 32), 4 + i * 8);
+            body.writeUInt32LE(Math.floor(g / Math.pow(2, 32)), 8 + i * 8);
+        });
+        return Buffer.concat([head, phraseBytes, langs, body]);
+    };
+    const binary = tmpfile();
+    fs.writeFileSync(binary, Buffer.concat([
+        Buffer.from('CMGRIDS1'),
+        record('c', null, [5, Math.pow(2, 40) + 1]),
+        record('d', [0, 9], [6])
+    ]));
+    t.equal(cache.loadFile(binary), 2, 'counts binary records');
+    t.deepEqual(cache._get('c'), [Math.pow(2, 40) + 1, 5], 'reads binary grids');
+    t.deepEqual(cache._get('d', [0, 9]), [6], 'reads binary languages');
+
+    const hugePhrase = Buffer.alloc(4);
+    hugePhrase.writeUInt32LE(0xfffffff0, 0);
+    const corrupt = tmpfile();
+    fs.writeFileSync(corrupt, Buffer.concat([Buffer.from('CMGRIDS1'), hugePhrase, Buffer.from('abc')]));
+    t.throws(() => { cache.loadFile(corrupt); }, /record 1: truncated/, 'a corrupt phrase length fails as a truncated record');
+
+    const bad = tmpfile();
+    fs.writeFileSync(bad, JSON.stringify({ id: 'e', grids: [1] }) + '\n{"id": "f", "grids": [1.5]}\n');
+    t.throws(() => { cache.loadFile(bad); }, /line 2: grids must be non-negative integers/, 'reports the bad line');
+    const deep = tmpfile();
+    fs.writeFileSync(deep, '{"id": "g", "grids": [1], "note": ' + '['.repeat(100000) + ']'.repeat(100000) + '}\n');
+    t.throws(() => { cache.loadFile(deep); }, /line 1: values nested more than 64 deep/, 'limits the nesting of skipped values');
+    t.throws(() => { cache.loadFile(tmpdir + '/missing'); }, /unable to open grid dump/, 'throws on missing files');
+    t.end();
+});
+
+test('freeze', (t) => {
+    const fill = (cache) => {
+        cache._set('main st', [3, 1, 2]);
+        cache._set('main st', [7], [1]);
+        cache._set('main', [5, 4]);
+        cache._set('maine', [6], [2]);
+    };
+    const cache = new carmenCache.MemoryCache('a');
+    const frozen = new carmenCache.MemoryCache('a');
+    fill(cache);
+    fill(frozen);
+    frozen.freeze();
+    frozen.freeze();
+
+    [['main st'], ['main st', [1]], ['missing']].forEach((q) => {
+        t.deepEqual(frozen._get.apply(frozen, q), cache._get.apply(cache, q), '_get ' + JSON.stringify(q));
+    });
+    [
+        ['main', carmenCache.PREFIX_SCAN.enabled],
+        ['main', carmenCache.PREFIX_SCAN.word_boundary, [1]],
+        ['main st', carmenCache.PREFIX_SCAN.disabled, [2]]
+    ].forEach((q) => {
+        t.deepEqual(frozen._getMatching.apply(frozen, q), cache._getMatching.apply(cache, q), '_getMatching ' + JSON.stringify(q));
+    });
+    t.deepEqual(sorted(frozen.list()), sorted(cache.list()), 'list');
+
+    const pack = tmpfile();
+    frozen.pack(pack);
+    const loader = new carmenCache.RocksDBCache('a', pack);
+    t.deepEqual(loader._get('main st'), cache._get('main st'), 'packs from the frozen cache');
+    t.deepEqual(loader._getMatching('main', carmenCache.PREFIX_SCAN.enabled), cache._getMatching('main', carmenCache.PREFIX_SCAN.enabled), 'packed prefix matches agree');
+
+    const dupes = new carmenCache.MemoryCache('a');
+    dupes._set('a', [2, 1, 2]);
+    dupes.freeze();
+    t.deepEqual(dupes._get('a'), [2, 1], 'duplicate grids are removed');
+
+    // grids from a BigUint64Array can already have the language match boost
+    // (bit 63) set, so boosting doesn't keep a frozen list in order
+    if (typeof BigUint64Array !== 'undefined') {
+        const high = BigInt(1) << BigInt(63);
+        const fillBoosted = (c) => {
+            c._set('boost', new BigUint64Array([high | BigInt(1), high | BigInt(5), BigInt(7), BigInt(3)]), [1]);
+            c._set('boost', new BigUint64Array([high | BigInt(2), BigInt(4)]), [2]);
+            return c;
+        };
+        const plainBoosted = fillBoosted(new carmenCache.MemoryCache('a'));
+        const frozenBoosted = fillBoosted(new carmenCache.MemoryCache('a'));
+        frozenBoosted.freeze();
+        [[1], [2], [3]].forEach((languages) => {
+            t.deepEqual(
+                Array.from(frozenBoosted._getMatchingGrids('boost', carmenCache.PREFIX_SCAN.enabled, languages)).map(String),
+                Array.from(plainBoosted._getMatchingGrids('boost', carmenCache.PREFIX_SCAN.enabled, languages)).map(String),
+                'same order with boosted grids for languages ' + JSON.stringify(languages)
+            );
+        });
+    }
+
+    t.throws(() => { frozen._set('new', [1]); }, /MemoryCache is frozen/, '_set throws');
+    t.end();
+});
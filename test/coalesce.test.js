@@ -3,6 +3,8 @@ const MemoryCache = require('../index.js').MemoryCache;
 const RocksDBCache = require('../index.js').RocksDBCache;
 const Grid = require('./grid.js');
 const coalesce = require('../index.js').coalesce;
+const coalesceBatch = require('../index.js').coalesceBatch;
+const PackedCoalesceResult = require('../index.js').PackedCoalesceResult;
 const scan = require('../index.js').PREFIX_SCAN;
 const test = require('tape');
 const fs = require('fs');
@@ -205,6 +207,10 @@ test('coalesce args', (t) => {
         coalesce([valid_subq], { centerzxy:[0,0,0] }, 5 );
     }, /Arg 3 must be a callback/, 'throws');
 
+    t.throws(() => {
+        coalesce([valid_subq], { pruning: 1 }, () => {});
+    }, /pruning must be a boolean/, 'throws');
+
     t.throws(() => {
         coalesce([{ mask: 1 << 0, idx: 1, zoom: 1, weight: .5, phrase: '1', prefix: 0 }],{},() => {});
     }, /missing/, 'throws');
@@ -1468,3 +1474,449 @@ test('coalesce args', (t) => {
         });
     });
 })();
+
+// Low relevance grids in the last subquery
+(function() {
+    const memA = new MemoryCache('a', 0);
+    const memB = new MemoryCache('b', 0);
+
+    memA._set('1', [
+        Grid.encode({
+            id: 1,
+            x: 0,
+            y: 0,
+            relev: 1,
+            score: 1
+        })
+    ]);
+
+    const grids = [Grid.encode({
+        id: 1,
+        x: 0,
+        y: 0,
+        relev: 1,
+        score: 1
+    })];
+    for (let i = 2; i < 1000; i++) grids.push(Grid.encode({
+        id: i,
+        x: i,
+        y: 1,
+        relev: 0.4,
+        score: 7
+    }));
+    memB._set('1', grids);
+
+    const rocksA = toRocksCache(memA);
+    const rocksB = toRocksCache(memB);
+
+    [[memA, memB], [rocksA, rocksB], [memA, rocksB]].forEach((caches) => {
+        const a = caches[0],
+            b = caches[1];
+
+        test('coalesceMulti low relevance tail: ' + a.id + ', ' + b.id, (t) => {
+            coalesce([{
+                cache: a,
+                mask: 1 << 0,
+                idx: 0,
+                zoom: 10,
+                weight: 0.5,
+                phrase: '1',
+                prefix: scan.disabled
+            }, {
+                cache: b,
+                mask: 1 << 1,
+                idx: 1,
+                zoom: 10,
+                weight: 0.5,
+                phrase: '1',
+                prefix: scan.disabled
+            }], {}, (err, res) => {
+                t.ifError(err, 'no errors');
+                t.equal(res.length, 1, 'res length = 1');
+                t.deepEqual(res[0].map((f) => { return f.id; }), [1, 1], 'stacked context');
+                t.equal(res[0].relev, 1, '0.relev = 1');
+                t.end();
+            });
+        });
+    });
+})();
+
+// Pruning
+(function() {
+    // a small seeded generator, so that failures can be reproduced
+    let seed = 1;
+    const random = function(n) {
+        seed = (seed * 16807) % 2147483647;
+        return seed % n;
+    };
+
+    const stacks = [];
+    for (let s = 0; s < 50; s++) {
+        const depth = 2 + random(3);
+        const span = 2 + random(6);
+        const stack = [];
+        for (let d = 0; d < depth; d++) {
+            const zoom = Math.min(14, 1 + random(3) * 2 + d);
+            const max = Math.min(Math.pow(2, zoom), span * Math.pow(2, Math.max(0, zoom - 3)));
+            const cache = new MemoryCache('pruning.' + s + '.' + d, 0);
+            const grids = [];
+            const count = 1 + random(300);
+            for (let g = 0; g < count; g++) grids.push(Grid.encode({
+                id: d * 100 + random(50),
+                x: random(max),
+                y: random(max),
+                relev: 0.4 + random(4) * 0.2,
+                score: random(8)
+            }));
+            cache._set('1', grids);
+            // overlapping masks, as for phrases that share a token
+            const mask = d > 0 && random(5) === 0 ? (1 << (d - 1)) | (1 << d) : 1 << d;
+            stack.push({
+                cache: d % 2 ? toRocksCache(cache) : cache,
+                mask: mask,
+                idx: d,
+                zoom: zoom,
+                weight: 1 / depth + random(3) * 0.01,
+                phrase: '1',
+                prefix: scan.disabled
+            });
+        }
+        stacks.push(stack);
+    }
+
+    test('coalesceMulti pruning matches unpruned results', (t) => {
+        let pending = stacks.length;
+        stacks.forEach((stack, s) => {
+            coalesce(stack, { pruning: false }, (err, expected) => {
+                t.ifError(err, 'no errors');
+                coalesce(stack, {}, (err, res) => {
+                    t.ifError(err, 'no errors');
+                    t.deepEqual(res, expected, 'stack ' + s);
+                    if (--pending === 0) t.end();
+                });
+            });
+        });
+    });
+})();
+
+// Parallel coalesce
+(function() {
+    // enough grids that the last subquery is split between threads
+    const memA = new MemoryCache('a', 0);
+    const memB = new MemoryCache('b', 0);
+    const gridsA = [];
+    const gridsB = [];
+    for (let i = 0; i < 5000; i++) {
+        gridsA.push(Grid.encode({ id: i, x: i % 13, y: i % 7, relev: [0.4, 0.6, 0.8, 1][i % 4], score: i % 7 }));
+        gridsB.push(Grid.encode({ id: i, x: i % 101, y: i % 57, relev: [0.4, 0.6, 0.8, 1][(i * 7) % 4], score: (i * 3) % 7 }));
+    }
+    memA._set('a', gridsA);
+    memB._set('b', gridsB);
+
+    const single = [{ cache: memB, mask: 1 << 0, idx: 0, zoom: 8, weight: 1, phrase: 'b', prefix: scan.disabled }];
+    const multi = [
+        { cache: memA, mask: 1 << 0, idx: 0, zoom: 4, weight: 0.5, phrase: 'a', prefix: scan.disabled },
+        { cache: memB, mask: 1 << 1, idx: 1, zoom: 8, weight: 0.5, phrase: 'b', prefix: scan.disabled }
+    ];
+
+    test('coalesce parallelism must be a number', (t) => {
+        t.throws(() => {
+            coalesce(single, { parallelism: 'all' }, () => {});
+        }, /parallelism must be a number/, 'throws');
+        t.end();
+    });
+
+    [single, multi].forEach((stack) => {
+        [{ centerzxy: [8, 50, 30] }, {}].forEach((options) => {
+            test('coalesce parallelism matches serial results: ' + stack.length + ' subqueries, ' + JSON.stringify(options), (t) => {
+                coalesce(stack, options, (err, expected) => {
+                    t.ifError(err, 'no errors');
+                    coalesce(stack, Object.assign({ parallelism: 4 }, options), (err, res) => {
+                        t.ifError(err, 'no errors');
+                        t.ok(res.length > 0, 'has results');
+                        t.deepEqual(res, expected, 'same results');
+                        t.end();
+                    });
+                });
+            });
+        });
+    });
+})();
+
+// Packed results
+(function() {
+    const memA = new MemoryCache('a', 0);
+    const memB = new MemoryCache('b', 0);
+    const gridsA = [];
+    const gridsB = [];
+    for (let i = 0; i < 50; i++) {
+        gridsA.push(Grid.encode({ id: i, x: i % 5, y: i % 3, relev: [0.4, 0.6, 0.8, 1][i % 4], score: i % 7 }));
+        gridsB.push(Grid.encode({ id: i + 1000, x: i % 11, y: i % 9, relev: 1, score: (i * 3) % 7 }));
+    }
+    memA._set('a', gridsA);
+    memB._set('b', gridsB);
+
+    const single = [{ cache: memB, mask: 1 << 0, idx: 0, zoom: 6, weight: 1, phrase: 'b', prefix: scan.disabled }];
+    const multi = [
+        { cache: memA, mask: 1 << 0, idx: 0, zoom: 3, weight: 0.5, phrase: 'a', prefix: scan.disabled },
+        { cache: memB, mask: 1 << 1, idx: 1, zoom: 6, weight: 0.5, phrase: 'b', prefix: scan.disabled }
+    ];
+    const unpack = (buffer) => {
+        const packed = new PackedCoalesceResult(buffer);
+        const out = [];
+        for (let i = 0; i < packed.length; i++) out.push(packed.context(i));
+        return out;
+    };
+
+    [single, multi].forEach((stack) => {
+        test('coalesce packed results match: ' + stack.length + ' subqueries', (t) => {
+            coalesce(stack, { centerzxy: [6, 5, 5] }, (err, expected) => {
+                t.ifError(err, 'no errors');
+                coalesce(stack, { centerzxy: [6, 5, 5], packed: true }, (err, res) => {
+                    t.ifError(err, 'no errors');
+                    t.ok(Buffer.isBuffer(res), 'calls back with a Buffer');
+                    const packed = new PackedCoalesceResult(res);
+                    t.ok(packed.length > 0, 'has results');
+                    t.equal(packed.contextOffsets[packed.length], packed.relev.length, 'offsets cover every cover');
+                    t.deepEqual(unpack(res), expected, 'same results');
+                    t.deepEqual(unpack(Buffer.concat([Buffer.alloc(1), res]).slice(1)), expected, 'reads unaligned Buffers');
+                    t.end();
+                });
+            });
+        });
+    });
+
+    test('coalesceBatch packed results match', (t) => {
+        coalesceBatch([single, multi], {}, (err, expected) => {
+            t.ifError(err, 'no errors');
+            coalesceBatch([single, multi], { packed: true }, (err, res) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(res.map(unpack), expected, 'same results');
+                t.end();
+            });
+        });
+    });
+
+    test('coalesce packed results with no matches', (t) => {
+        const none = [{ cache: memB, mask: 1 << 0, idx: 0, zoom: 6, weight: 1, phrase: 'missing', prefix: scan.disabled }];
+        coalesce(none, { packed: true }, (err, res) => {
+            t.ifError(err, 'no errors');
+            t.equal(new PackedCoalesceResult(res).length, 0, 'no contexts');
+            t.end();
+        });
+    });
+})();
+
+// Cancellation and deadlines
+(function() {
+    const mem = new MemoryCache('a', 0);
+    const grids = [];
+    for (let i = 0; i < 5000; i++) {
+        grids.push(Grid.encode({ id: i, x: i % 101, y: i % 57, relev: 1, score: i % 7 }));
+    }
+    mem._set('1', grids);
+    const stack = [{ cache: mem, mask: 1 << 0, idx: 0, zoom: 8, weight: 1, phrase: '1', prefix: scan.disabled }];
+
+    test('coalesce deadlineMs must be a number', (t) => {
+        t.throws(() => {
+            coalesce(stack, { deadlineMs: 'soon' }, () => {});
+        }, /deadlineMs must be a number/, 'throws');
+        t.end();
+    });
+
+    test('coalesce deadline exceeded', (t) => {
+        coalesce(stack, { centerzxy: [8, 50, 30], deadlineMs: 0 }, (err, res) => {
+            t.equal(err && err.message, 'coalesce deadline exceeded', 'fails once the deadline has passed');
+            t.equal(res, undefined, 'no results');
+            t.end();
+        });
+    });
+
+    test('coalesceBatch deadline exceeded', (t) => {
+        coalesceBatch([stack, stack], { deadlineMs: 0 }, (err) => {
+            t.equal(err && err.message, 'coalesce deadline exceeded', 'fails once the deadline has passed');
+            t.end();
+        });
+    });
+
+    test('coalesce with a deadline it meets', (t) => {
+        coalesce(stack, { centerzxy: [8, 50, 30], deadlineMs: 60000 }, (err, res) => {
+            t.ifError(err, 'no errors');
+            t.ok(res.length > 0, 'has results');
+            t.end();
+        });
+    });
+
+    test('coalesce cancel', (t) => {
+        const handle = coalesce(stack, { centerzxy: [8, 50, 30] }, (err, res) => {
+            // the job may have finished before cancel() was called
+            if (err) {
+                t.equal(err.message, 'coalesce cancelled', 'fails once cancelled');
+            } else {
+                t.ok(res.length > 0, 'finished before it was cancelled');
+            }
+            t.doesNotThrow(() => { handle.cancel(); }, 'cancelling a finished job does nothing');
+            t.end();
+        });
+        t.equal(typeof handle.cancel, 'function', 'returns a handle');
+        handle.cancel();
+    });
+})();
+
+// coalesceBatch
+(function() {
+    const memA = new MemoryCache('a', 0);
+    const memB = new MemoryCache('b', 0);
+    for (let i = 1; i < 20; i++) {
+        memA._set(String(i % 3), [Grid.encode({ id: i, x: i % 4, y: 0, relev: 1, score: i % 7 })], null, true);
+        memB._set(String(i % 3), [Grid.encode({ id: i, x: i % 2, y: 0, relev: 0.8, score: 3 })], null, true);
+    }
+    const rocksB = toRocksCache(memB);
+
+    const subq = function(cache, phrase, mask, idx, zoom) {
+        return { cache: cache, mask: mask, idx: idx, zoom: zoom, weight: 0.5, phrase: phrase, prefix: scan.disabled };
+    };
+    const stacks = [
+        [subq(memA, '1', 1 << 0, 0, 2), subq(rocksB, '1', 1 << 1, 1, 1)],
+        [subq(memA, '1', 1 << 0, 0, 2), subq(rocksB, '2', 1 << 1, 1, 1)],
+        [subq(memA, '0', 1 << 0, 0, 2)],
+        [subq(rocksB, '1', 1 << 1, 1, 1), subq(memA, '1', 1 << 0, 0, 2)]
+    ];
+
+    test('coalesceBatch args', (t) => {
+        t.throws(() => {
+            coalesceBatch([stacks[0]], {});
+        }, /Expects 3 arguments/, 'throws');
+        t.throws(() => {
+            coalesceBatch(stacks[0], {}, () => {});
+        }, /Every stack must be an array with one or more PhrasematchSubqObjects/, 'throws');
+        t.throws(() => {
+            coalesceBatch([[]], {}, () => {});
+        }, /Every stack must be an array with one or more PhrasematchSubqObjects/, 'throws');
+        t.throws(() => {
+            coalesceBatch([[{ cache: memA, mask: 1, idx: 0, zoom: 2, weight: 0.5, prefix: 0 }]], {}, () => {});
+        }, /missing phrase property/, 'throws');
+        t.end();
+    });
+
+    test('coalesceBatch matches coalesce', (t) => {
+        coalesceBatch(stacks, { centerzxy: [2, 1, 0] }, (err, batched) => {
+            t.ifError(err, 'no errors');
+            t.equal(batched.length, stacks.length, 'one result set per stack');
+            let pending = stacks.length;
+            stacks.forEach((stack, s) => {
+                coalesce(stack, { centerzxy: [2, 1, 0] }, (err, res) => {
+                    t.ifError(err, 'no errors');
+                    t.deepEqual(batched[s], res, 'stack ' + s);
+                    if (--pending === 0) t.end();
+                });
+            });
+        });
+    });
+})();
+
+// Worker pool
+(function() {
+    const carmenCache = require('../index.js');
+    const mem = new MemoryCache('a', 0);
+    mem._set('1', [Grid.encode({ id: 1, x: 1, y: 1, relev: 1, score: 1 })]);
+    const stack = [{ cache: mem, mask: 1 << 0, idx: 0, zoom: 2, weight: 1, phrase: '1', prefix: scan.disabled }];
+
+    test('coalesce worker pool', (t) => {
+        t.throws(() => { carmenCache.configureWorkerPool(); }, /expected an options object/, 'throws without options');
+        t.throws(() => { carmenCache.configureWorkerPool({}); }, /missing threads/, 'throws without threads');
+        t.throws(() => { carmenCache.configureWorkerPool({ threads: 1, affinity: 0 }); }, /affinity must be an array/, 'throws on bad affinity');
+        t.equal(carmenCache.workerPoolStats().threads, 0, 'no pool by default');
+
+        coalesce(stack, {}, (err, expected) => {
+            t.ifError(err, 'no errors');
+            carmenCache.configureWorkerPool({ threads: 2, maxQueued: 16 });
+            coalesce(stack, {}, (err, res) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(res, expected, 'same results on the pool');
+                const stats = carmenCache.workerPoolStats();
+                t.equal(stats.threads, 2, 'threads');
+                t.equal(stats.maxQueued, 16, 'maxQueued');
+                t.equal(stats.completed, 1, 'completed');
+                ['queued', 'active', 'rejected', 'totalWaitMs', 'maxWaitMs'].forEach((key) => {
+                    t.ok(stats.hasOwnProperty(key), 'stats include ' + key);
+                });
+                setImmediate(() => {
+                    carmenCache.configureWorkerPool({ threads: 1, maxQueued: 0 });
+                    let pending = 2;
+                    const finish = () => {
+                        if (--pending > 0) return;
+                        t.equal(carmenCache.workerPoolStats().rejected, 1, 'rejections are counted');
+                        setImmediate(() => {
+                            carmenCache.configureWorkerPool({ threads: 0 });
+                            t.equal(carmenCache.workerPoolStats().threads, 0, 'pool removed');
+                            t.end();
+                        });
+                    };
+                    // the first job goes to the free thread, and holds it
+                    // until its callback runs, which can't happen before the
+                    // second job is queued in the same tick; that one has no
+                    // room to wait
+                    coalesce(stack, {}, (err, res) => {
+                        t.ifError(err, 'runs on a free thread with maxQueued: 0');
+                        t.deepEqual(res, expected, 'same results');
+                        finish();
+                    });
+                    coalesce(stack, {}, (err) => {
+                        t.ok(/coalesce queue is full/.test(err && err.message), 'rejected when the queue is full');
+                        finish();
+                    });
+                });
+            });
+        });
+    });
+})();
+
+// Admission control
+(function() {
+    const carmenCache = require('../index.js');
+    const mem = new MemoryCache('a', 0);
+    mem._set('1', [Grid.encode({ id: 1, x: 1, y: 1, relev: 1, score: 1 })]);
+    const stack = [{ cache: mem, mask: 1 << 0, idx: 0, zoom: 2, weight: 1, phrase: '1', prefix: scan.disabled }];
+
+    test('coalesce admission control', (t) => {
+        t.throws(() => { carmenCache.configureAdmission(); }, /expected an options object/, 'throws without options');
+        t.throws(() => { carmenCache.configureAdmission({ maxQueued: ['a'] }); }, /maxQueued must be a number or an array of numbers/, 'throws on bad maxQueued');
+        t.throws(() => { carmenCache.configureAdmission({ maxQueued: [] }); }, /there must be at least one lane/, 'throws without lanes');
+        t.throws(() => { coalesce(stack, { lane: 1 }, () => {}); }, /lane 1 doesn't exist/, 'throws on a lane that was never configured');
+
+        let stats = carmenCache.admissionStats();
+        t.equal(stats.maxInFlight, 0, 'no limit by default');
+        t.equal(stats.lanes.length, 1, 'one lane by default');
+
+        carmenCache.configureAdmission({ maxInFlight: 1, maxQueued: [1, 0] });
+        const results = [];
+        let pending = 4;
+        const done = (name) => (err, res) => {
+            results.push([name, err ? err.message : res.length]);
+            if (--pending > 0) return;
+
+            t.deepEqual(results.slice().sort(), [
+                ['first', 1],
+                ['queued', 1],
+                ['second lane full', 'coalesce queue is full'],
+                ['third', 'coalesce queue is full']
+            ], 'jobs beyond the lane limits are rejected');
+            stats = carmenCache.admissionStats();
+            t.equal(stats.inFlight, 0, 'nothing left in flight');
+            t.equal(stats.rejected, 2, 'rejections are counted');
+            carmenCache.configureAdmission({});
+            t.equal(carmenCache.admissionStats().lanes.length, 1, 'back to one lane');
+            t.end();
+        };
+        coalesce(stack, {}, done('first'));
+        coalesce(stack, {}, done('queued'));
+        coalesce(stack, {}, done('third'));
+        coalesce(stack, { lane: 1 }, done('second lane full'));
+
+        stats = carmenCache.admissionStats();
+        t.equal(stats.inFlight, 1, 'one job in flight');
+        t.equal(stats.queued, 1, 'one job waiting');
+        t.deepEqual(stats.lanes, [{ queued: 1, maxQueued: 1 }, { queued: 0, maxQueued: 0 }], 'per-lane counts');
+    });
+})();
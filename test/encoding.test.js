@@ -0,0 +1,114 @@
+'use strict';
+const carmenCache = require('../index.js');
+const MemoryCache = carmenCache.MemoryCache;
+const RocksDBCache = carmenCache.RocksDBCache;
+const MmapCache = carmenCache.MmapCache;
+const scan = carmenCache.PREFIX_SCAN;
+const Grid = require('./grid.js');
+const test = require('tape');
+const fs = require('fs');
+const execFileSync = require('child_process').execFileSync;
+
+// Caches packed with { encoding: 'block' } store their grid lists in a
+// different format, but should read back exactly the same as the default
+// varint encoding.
+
+const tmpdir = '/tmp/temp.' + Math.random().toString(36).substr(2, 5);
+fs.mkdirSync(tmpdir);
+let tmpidx = 0;
+const tmpfile = function() { return tmpdir + '/' + (tmpidx++) + '.dat'; };
+
+const buildCache = function() {
+    const cache = new MemoryCache('a');
+    // enough grids to fill several blocks, with a partial block at the end
+    const many = [];
+    for (let i = 0; i < 1000; i++) {
+        many.push(Grid.encode({
+            id: i,
+            x: (i * 37) % 1000,
+            y: (i * 91) % 1000,
+            relev: [0.4, 0.6, 0.8, 1][i % 4],
+            score: i % 8
+        }));
+    }
+    cache._set('main st', many);
+    cache._set('main st', many.slice(0, 300), [0]);
+    cache._set('main street', many.slice(500, 777), [1]);
+    cache._set('maine', [5, 5, 5]);
+    cache._set('mainz', [0]);
+    cache._set('market', [Math.pow(2, 52), 1]);
+    return cache;
+};
+
+const compare = function(t, expected, actual, label) {
+    ['main st', 'main street', 'maine', 'mainz', 'market', 'nothing'].forEach((key) => {
+        t.deepEqual(actual._get(key), expected._get(key), label + ': _get ' + key);
+    });
+    ['m', 'mai', 'main', 'main st', 'market'].forEach((key) => {
+        [scan.disabled, scan.enabled, scan.word_boundary].forEach((prefix) => {
+            [undefined, [0], [1]].forEach((languages) => {
+                t.deepEqual(
+                    actual._getMatching(key, prefix, languages),
+                    expected._getMatching(key, prefix, languages),
+                    label + ': _getMatching ' + key + ' ' + prefix + ' ' + JSON.stringify(languages)
+                );
+            });
+        });
+    });
+};
+
+test('pack options', (t) => {
+    const cache = buildCache();
+    t.throws(() => { cache.pack(tmpfile(), 'block'); }, /options must be an object/, 'throws on non-object options');
+    t.throws(() => { cache.pack(tmpfile(), { encoding: 'zigzag' }); }, /encoding must be/, 'throws on unknown encoding');
+    t.throws(() => { cache.packMmap(tmpfile(), { encoding: 1 }); }, /encoding must be/, 'packMmap throws on unknown encoding');
+    t.ok(cache.pack(tmpfile(), { encoding: 'varint' }), 'accepts varint');
+    t.end();
+});
+
+test('block encoding matches varint encoding', (t) => {
+    const cache = buildCache();
+
+    const varintPack = tmpfile();
+    cache.pack(varintPack);
+    const varint = new RocksDBCache('varint', varintPack);
+
+    const blockPack = tmpfile();
+    cache.pack(blockPack, { encoding: 'block' });
+    const block = new RocksDBCache('block', blockPack);
+    compare(t, varint, block, 'rocksdb');
+
+    const blockMmap = tmpfile();
+    cache.packMmap(blockMmap, { encoding: 'block' });
+    compare(t, varint, new MmapCache('mmap', blockMmap), 'mmap');
+
+    // repacking an existing cache re-encodes it in whichever encoding is asked for
+    const reencoded = tmpfile();
+    block.pack(reencoded, { encoding: 'varint' });
+    compare(t, varint, new RocksDBCache('reencoded', reencoded), 'block to varint');
+
+    const reencodedMmap = tmpfile();
+    varint.packMmap(reencodedMmap, { encoding: 'block' });
+    compare(t, varint, new MmapCache('reencoded', reencodedMmap), 'varint to block mmap');
+    t.end();
+});
+
+test('block encoding is decoded identically by every kernel', (t) => {
+    const cache = buildCache();
+    const blockPack = tmpfile();
+    cache.pack(blockPack, { encoding: 'block' });
+
+    const script = `
+        const cache = new (require(${JSON.stringify(require.resolve('../index.js'))}).RocksDBCache)('a', ${JSON.stringify(blockPack)});
+        console.log(JSON.stringify([cache._get('main st'), cache._getMatching('main', 1, [0])]));
+    `;
+    const run = function(kernel) {
+        const env = Object.assign({}, process.env, { CARMEN_CACHE_GRID_KERNEL: kernel });
+        return execFileSync(process.execPath, ['-e', script], { env: env }).toString();
+    };
+
+    const expected = run('');
+    t.equal(run('sse4.2'), expected, 'sse4.2 kernel matches');
+    t.equal(run('scalar'), expected, 'scalar kernel matches');
+    t.end();
+});
@@ -292,3 +292,209 @@ test('getMatching', (t) => {
     // t.deepEqual(loader.list('grid'), [ 'else.', 'something', 'test', 'test.' ], 'keys in shard');
     t.end();
 });
+
+test('getMatching prefix range boundaries', (t) => {
+    const cache = new carmenCache.MemoryCache('mem');
+
+    // keys that sort immediately before, inside, and after the 'ab' prefix range
+    const keys = { 'aa': 1, 'aaz': 2, 'ab': 3, 'ab c': 4, 'abc': 5, 'abz': 6, 'ac': 7, 'b': 8, '1ab': 9 };
+    Object.keys(keys).forEach((key) => {
+        cache._set(key, [Grid.encode({ id: keys[key], x: 1, y: 1, relev: 1, score: 1 })]);
+    });
+
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('packed', pack);
+
+    [cache, loader].forEach((c) => {
+        t.deepEqual(getIds(c._getMatching('ab', scan.enabled)), [3, 4, 5, 6], "getMatching for 'ab' with prefix match only includes keys starting with 'ab'");
+        t.deepEqual(getIds(c._getMatching('ab', scan.word_boundary)), [3, 4], "getMatching for 'ab' with word boundary prefix match only includes 'ab' and 'ab c'");
+        t.deepEqual(getIds(c._getMatching('ab', scan.disabled)), [3], "getMatching for 'ab' with no prefix match only includes 'ab'");
+        t.deepEqual(getIds(c._getMatching('b', scan.enabled)), [8], "getMatching for 'b' with prefix match stops at the end of the cache");
+        t.false(c._getMatching('abd', scan.enabled), "getMatching for 'abd' with prefix match returns nothing");
+        t.false(c._getMatching('ad', scan.enabled), "getMatching for 'ad' with prefix match returns nothing");
+    });
+
+    t.end();
+});
+
+test('getMatching across many table blocks', (t) => {
+    const cache = new carmenCache.MemoryCache('mem');
+
+    // enough keys under one prefix that the scan crosses many table blocks,
+    // so merged values come from blocks the iterator has already moved past
+    const expected = [];
+    for (let i = 0; i < 3000; i++) {
+        const key = 'prefix ' + ('0000' + i).slice(-4);
+        const grids = [];
+        for (let j = 0; j < 5; j++) {
+            grids.push(Grid.encode({ id: i * 5 + j, x: i % 100, y: j, relev: 1, score: 1 }));
+        }
+        cache._set(key, grids, [i % 2]);
+        expected.push.apply(expected, grids);
+    }
+
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('packed', pack);
+
+    [scan.enabled, scan.word_boundary].forEach((prefix) => {
+        [[0], [1]].forEach((languages) => {
+            t.deepEqual(
+                loader._getMatching('prefix', prefix, languages),
+                cache._getMatching('prefix', prefix, languages),
+                'rocksdb matches memory for prefix ' + prefix + ' ' + JSON.stringify(languages)
+            );
+        });
+    });
+    t.equal(loader._getMatching('prefix ', scan.enabled).length, expected.length, 'every grid is returned');
+    t.end();
+});
+
+test('getMatching with lazily loaded values', (t) => {
+    const cache = new carmenCache.MemoryCache('mem');
+
+    // keys whose grid ranges interleave, share grids, and differ in language,
+    // so the merge has to load some values before others are exhausted
+    for (let i = 0; i < 50; i++) {
+        const grids = [];
+        for (let j = 0; j < 20; j++) {
+            grids.push(Grid.encode({ id: (i * 7 + j * 13) % 400, x: 1, y: 1, relev: 1, score: (i + j) % 8 }));
+        }
+        cache._set('lazy ' + i, grids, [i % 3]);
+    }
+    cache._set('lazy empty', []);
+
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('packed', pack);
+
+    // repacking regenerates the metadata rather than copying it
+    const repack = tmpfile();
+    loader.pack(repack);
+    const reloader = new carmenCache.RocksDBCache('repacked', repack);
+
+    const mmap = tmpfile();
+    loader.packMmap(mmap);
+    const mapped = new carmenCache.MmapCache('mapped', mmap);
+
+    [scan.enabled, scan.word_boundary].forEach((prefix) => {
+        [[0], [1], [2], [0, 1]].forEach((languages) => {
+            const expected = cache._getMatching('lazy', prefix, languages);
+            const label = ' for prefix ' + prefix + ' ' + JSON.stringify(languages);
+            t.deepEqual(loader._getMatching('lazy', prefix, languages), expected, 'packed cache matches memory' + label);
+            t.deepEqual(reloader._getMatching('lazy', prefix, languages), expected, 'repacked cache matches memory' + label);
+            t.deepEqual(mapped._getMatching('lazy', prefix, languages), expected, 'mmap cache matches memory' + label);
+        });
+    });
+    t.deepEqual(loader.list().sort(), cache.list().sort(), 'metadata records are not listed');
+    t.end();
+});
+
+test('getMatching async and getMatchingMany', (t) => {
+    const cache = new carmenCache.MemoryCache('mem');
+    for (let i = 0; i < 30; i++) {
+        const grids = [];
+        for (let j = 0; j < 10; j++) {
+            grids.push(Grid.encode({ id: (i * 7 + j * 13) % 200, x: 1, y: 1, relev: 1, score: (i + j) % 8 }));
+        }
+        cache._set('many ' + (i % 10), grids, [i % 3]);
+    }
+
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('packed', pack);
+    const decoded = new carmenCache.RocksDBCache('decoded', pack, { decodedCacheSize: 1024 * 1024 });
+    const mmap = tmpfile();
+    cache.packMmap(mmap);
+    const mapped = new carmenCache.MmapCache('mapped', mmap);
+
+    const queries = [
+        { phrase: 'many 1' },
+        { phrase: 'many 2', languages: [0] },
+        { phrase: 'many 3', prefix: scan.disabled, languages: [1, 2] },
+        { phrase: 'many', prefix: scan.enabled, languages: [2] },
+        { phrase: 'many 1', prefix: scan.word_boundary },
+        { phrase: 'missing' },
+        { phrase: 'many 1' }
+    ];
+    const expected = queries.map((q) => cache._getMatching(q.phrase, q.prefix || 0, q.languages));
+    t.equal(expected[5], undefined, 'a missing phrase has no grids');
+
+    t.throws(() => { loader.getMatchingMany([{}], () => {}); }, /phrase must be a String/, 'requires a phrase');
+    t.throws(() => { loader.getMatchingMany([{ phrase: 'a', prefix: 3 }], () => {}); }, /prefix must be an integer between 0 - 2/, 'checks prefix');
+    t.throws(() => { loader.getMatchingMany(queries); }, /second arg must be a callback function/, 'requires a callback');
+
+    let pending = 0;
+    const done = () => { if (--pending === 0) t.end(); };
+    [cache, loader, decoded, mapped].forEach((c) => {
+        pending++;
+        c.getMatchingMany(queries, (err, results) => {
+            t.ifError(err, 'no errors');
+            t.deepEqual(results, expected, c.id + ' getMatchingMany matches memory');
+            // a second batch is served from the decoded cache, where there is one
+            c.getMatchingMany(queries, (err, results) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(results, expected, c.id + ' repeated getMatchingMany matches memory');
+                done();
+            });
+        });
+        queries.forEach((q, i) => {
+            pending++;
+            c._getMatching(q.phrase, q.prefix || 0, q.languages || null, false, (err, grids) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(grids, expected[i], c.id + ' async getMatching matches memory for ' + JSON.stringify(q));
+                done();
+            });
+        });
+    });
+});
+
+// splits each grid from _getMatchingGrids into its language match boost (bit
+// 63) and the rest, which fits in a Number
+const splitGrids = function(grids) {
+    const words = typeof BigUint64Array !== 'undefined' && grids instanceof BigUint64Array ?
+        new Uint32Array(grids.buffer, grids.byteOffset, grids.length * 2) :
+        new Uint32Array(grids.buffer.slice(grids.byteOffset, grids.byteOffset + grids.length));
+    const out = [];
+    for (let i = 0; i < words.length; i += 2) {
+        // native byte order, which every platform we build for has little-endian
+        const lo = words[i];
+        const hi = words[i + 1];
+        out.push({ boosted: hi >= 0x80000000, grid: (hi & 0x7fffffff) * Math.pow(2, 32) + lo });
+    }
+    return out;
+};
+
+test('getMatchingGrids', (t) => {
+    const cache = new carmenCache.MemoryCache('mem');
+    for (let i = 0; i < 20; i++) {
+        cache._set('raw ' + (i % 4), [Grid.encode({ id: i, x: i, y: 2, relev: 1, score: i % 8 })], [i % 3]);
+    }
+    const pack = tmpfile();
+    cache.pack(pack);
+    const loader = new carmenCache.RocksDBCache('packed', pack);
+
+    t.throws(() => { cache._getMatchingGrids(); }, /expected two to four info/, 'checks args like getMatching');
+    t.equal(cache._getMatchingGrids('missing', scan.disabled), undefined, 'undefined without matches');
+
+    let pending = 0;
+    [cache, loader].forEach((c) => {
+        [scan.disabled, scan.enabled].forEach((prefix) => {
+            const phrase = prefix === scan.disabled ? 'raw 1' : 'raw';
+            const expected = c._getMatching(phrase, prefix, [0]).map((cover) => {
+                return { boosted: cover.matches_language, grid: Grid.encode(cover) };
+            });
+            const label = c.id + ' prefix ' + prefix;
+            t.ok(expected.some((x) => x.boosted), label + ' has boosted grids');
+            t.deepEqual(splitGrids(c._getMatchingGrids(phrase, prefix, [0])), expected, label + ' grids keep their boost');
+
+            pending++;
+            c._getMatchingGrids(phrase, prefix, [0], false, (err, grids) => {
+                t.ifError(err, 'no errors');
+                t.deepEqual(splitGrids(grids), expected, label + ' async grids match');
+                if (--pending === 0) t.end();
+            });
+        });
+    });
+});
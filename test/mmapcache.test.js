@@ -0,0 +1,164 @@
+'use strict';
+const carmenCache = require('../index.js');
+const MemoryCache = carmenCache.MemoryCache;
+const RocksDBCache = carmenCache.RocksDBCache;
+const MmapCache = carmenCache.MmapCache;
+const Grid = require('./grid.js');
+const coalesce = carmenCache.coalesce;
+const scan = carmenCache.PREFIX_SCAN;
+const test = require('tape');
+const fs = require('fs');
+
+// MmapCache reads the same keys and messages as RocksDBCache out of a single
+// memory-mapped file, so every read should match an equivalent RocksDBCache.
+
+const tmpdir = '/tmp/temp.' + Math.random().toString(36).substr(2, 5);
+fs.mkdirSync(tmpdir);
+let tmpidx = 0;
+const tmpfile = function() { return tmpdir + '/' + (tmpidx++) + '.dat'; };
+
+const sorted = function(arr) {
+    return [].concat(arr).sort();
+};
+
+const buildCache = function() {
+    const cache = new MemoryCache('a');
+    cache._set('main st', [1, 2, 3]);
+    cache._set('main st', [4, 5], [0]);
+    cache._set('main street', [6, 7], [1]);
+    cache._set('mainz', [8]);
+    cache._set('maine', [9, 3], [0, 1]);
+    cache._set('market', [10, 11]);
+    cache._set('m', [12]);
+    cache._set('springfield', [13, 14, 15]);
+    return cache;
+};
+
+test('MmapCache: args', (t) => {
+    t.throws(() => { MmapCache('a', 'b'); }, /Cannot call constructor/, 'throws without new');
+    t.throws(() => { new MmapCache('a'); }, /expected arguments/, 'throws on missing filename');
+    t.throws(() => { new MmapCache('a', 1); }, /must be a String/, 'throws on invalid filename');
+    t.throws(() => { new MmapCache('a', tmpdir + '/missing.dat'); }, /unable to open mmap file/, 'throws on missing file');
+
+    const bogus = tmpfile();
+    fs.writeFileSync(bogus, Buffer.alloc(128, 'x'));
+    t.throws(() => { new MmapCache('a', bogus); }, /not a carmen mmap index/, 'throws on file with bad magic');
+
+    const memcache = buildCache();
+    const pack = tmpfile();
+    memcache.packMmap(pack);
+    const truncated = tmpfile();
+    fs.writeFileSync(truncated, fs.readFileSync(pack).slice(0, -1));
+    t.throws(() => { new MmapCache('a', truncated); }, /corrupt carmen mmap index/, 'throws on truncated file');
+
+    // the 64-byte header holds an 8-byte magic, uint32 version and flags,
+    // then uint64 count and five more uint64 fields; the count + 1 key
+    // offsets follow it, then the count + 1 value offsets
+    const hugeCount = fs.readFileSync(pack);
+    hugeCount.writeUInt32LE(0xffffffff, 16);
+    hugeCount.writeUInt32LE(0x1fffffff, 20);
+    const huge = tmpfile();
+    fs.writeFileSync(huge, hugeCount);
+    t.throws(() => { new MmapCache('a', huge); }, /corrupt carmen mmap index/, 'throws on a count too large for the file');
+
+    const count = fs.readFileSync(pack).readUInt32LE(16);
+    const keyOffset = (i) => 64 + i * 8;
+    const valueOffset = (i) => 64 + (count + 1) * 8 + i * 8;
+    const corrupt = (description, position, value) => {
+        const bytes = fs.readFileSync(pack);
+        bytes.writeUInt32LE(value(bytes), position);
+        const file = tmpfile();
+        fs.writeFileSync(file, bytes);
+        t.throws(() => { new MmapCache('a', file); }, /corrupt carmen mmap index/, 'throws on ' + description);
+    };
+    corrupt('a first key offset that isn\'t 0', keyOffset(0), () => 1);
+    corrupt('a key offset outside its section', keyOffset(1), () => 0xffffff);
+    corrupt('key offsets that decrease', keyOffset(1), (bytes) => bytes.readUInt32LE(keyOffset(count)));
+    corrupt('a value offset outside its section', valueOffset(1), () => 0xffffff);
+    corrupt('value offsets that decrease', valueOffset(1), (bytes) => bytes.readUInt32LE(valueOffset(count)));
+
+    t.throws(() => { memcache.packMmap(); }, /expected one info/, 'packMmap throws without filename');
+    t.throws(() => { memcache.packMmap(1); }, /must be a String/, 'packMmap throws on invalid filename');
+    t.end();
+});
+
+test('MmapCache: matches RocksDBCache', (t) => {
+    const memcache = buildCache();
+
+    const rocksPack = tmpfile();
+    memcache.pack(rocksPack);
+    const rocks = new RocksDBCache('b', rocksPack);
+
+    const fromMemory = tmpfile();
+    memcache.packMmap(fromMemory);
+    const fromRocks = tmpfile();
+    rocks.packMmap(fromRocks);
+
+    [new MmapCache('c', fromMemory), new MmapCache('d', fromRocks)].forEach((mmap) => {
+        t.deepEqual(sorted(mmap.list().map(JSON.stringify)), sorted(rocks.list().map(JSON.stringify)), mmap.id + ': list matches');
+
+        ['main st', 'main street', 'mainz', 'maine', 'm', 'nothing'].forEach((key) => {
+            t.deepEqual(mmap._get(key), rocks._get(key), mmap.id + ': _get ' + key);
+            t.deepEqual(mmap._get(key, [0]), rocks._get(key, [0]), mmap.id + ': _get ' + key + ' [0]');
+        });
+
+        ['m', 'ma', 'mai', 'main', 'main ', 'main st', 'main stre', 'market', 'springfield', 'x'].forEach((key) => {
+            [scan.disabled, scan.enabled, scan.word_boundary].forEach((prefix) => {
+                [undefined, [0], [1]].forEach((languages) => {
+                    t.deepEqual(
+                        mmap._getMatching(key, prefix, languages),
+                        rocks._getMatching(key, prefix, languages),
+                        mmap.id + ': _getMatching ' + key + ' ' + prefix + ' ' + JSON.stringify(languages)
+                    );
+                });
+            });
+        });
+    });
+    t.end();
+});
+
+test('MmapCache: empty index', (t) => {
+    const pack = tmpfile();
+    new MemoryCache('a').packMmap(pack);
+    const mmap = new MmapCache('b', pack);
+    t.deepEqual(mmap.list(), [], 'lists no keys');
+    t.deepEqual(mmap._get('a'), undefined, 'gets nothing');
+    t.deepEqual(mmap._getMatching('a', scan.enabled), undefined, 'matches nothing');
+    t.end();
+});
+
+test('MmapCache: coalesce', (t) => {
+    const memcache = new MemoryCache('a');
+    memcache._set('1', [
+        Grid.encode({ id: 2, x: 2, y: 2, relev: 0.8, score: 3 }),
+        Grid.encode({ id: 3, x: 3, y: 3, relev: 1, score: 1 }),
+        Grid.encode({ id: 1, x: 1, y: 1, relev: 1, score: 3 })
+    ]);
+    const rocksPack = tmpfile();
+    memcache.pack(rocksPack);
+    const rocks = new RocksDBCache('a', rocksPack);
+    const mmapPack = tmpfile();
+    memcache.packMmap(mmapPack);
+    const mmap = new MmapCache('a', mmapPack);
+
+    const stack = function(cache) {
+        return [{
+            cache: cache,
+            mask: 1 << 0,
+            idx: 0,
+            zoom: 2,
+            weight: 1,
+            phrase: '1',
+            prefix: scan.disabled
+        }];
+    };
+
+    coalesce(stack(rocks), { centerzxy: [3, 3, 3] }, (err, expected) => {
+        t.ifError(err);
+        coalesce(stack(mmap), { centerzxy: [3, 3, 3] }, (err, res) => {
+            t.ifError(err);
+            t.deepEqual(res, expected, 'coalesce results match RocksDBCache');
+            t.end();
+        });
+    });
+});